@@ -0,0 +1,804 @@
+// Benchmarks for simple_svg.
+//
+// Each scenario reports time/elem (per shape, point or label), bytes/s of
+// SVG produced and allocs/elem (global operator new calls per element).
+//
+// Extra flags on top of the Google Benchmark ones:
+//   --check_baseline=<file>   fail if any scenario's ns/elem exceeds the
+//                             recorded baseline by more than the allowed
+//                             factor
+//   --max_regression=<x>      allowed factor, default 3
+//   --update_baseline=<file>  write the measured ns/elem as a new baseline
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <streambuf>
+
+#include "../simple_svg_1.0.0.hpp"
+
+using namespace svg;
+
+// Allocation counting
+// -----------------------------------------------------------------------------------
+
+static std::atomic<std::size_t> g_allocations(0);
+
+// GCC sees the malloc/free inside the replacements after inlining and takes
+//  them for a mismatch with new/delete.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void *operator new(std::size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+void *operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { std::free(ptr); }
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+// Sets the per-element counters shared by all scenarios.
+static void reportElements(benchmark::State &state, std::size_t elements,
+                           std::size_t bytes_per_iteration,
+                           std::size_t allocations)
+{
+    double per_run = static_cast<double>(elements) * state.iterations();
+    state.counters["elements"] = static_cast<double>(elements);
+    // Shown with an SI prefix, e.g. "35n" is 35 ns per element.
+    state.counters["time/elem"] = benchmark::Counter(
+        per_run, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+    state.counters["allocs/elem"] = allocations / per_run;
+    state.SetBytesProcessed(static_cast<int64_t>(bytes_per_iteration) *
+                            state.iterations());
+}
+
+// Runs body once per iteration and reports it as processing elements items.
+template <typename Body>
+static void runScenario(benchmark::State &state, std::size_t elements,
+                        Body body)
+{
+    std::size_t bytes = 0;
+    std::size_t allocations = 0;
+    for (auto _ : state)
+    {
+        std::size_t before = g_allocations.load(std::memory_order_relaxed);
+        bytes = body();
+        allocations += g_allocations.load(std::memory_order_relaxed) - before;
+    }
+    reportElements(state, elements, bytes, allocations);
+}
+
+// Reproducible pseudo random data, independent of the standard library.
+class Lcg
+{
+   public:
+    explicit Lcg(unsigned seed = 12345) : state(seed) {}
+    double next()
+    {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) / static_cast<double>(1u << 24);
+    }
+
+   private:
+    unsigned state;
+};
+
+static Layout benchLayout()
+{
+    return Layout(Dimensions(1920, 1080), Layout::BottomLeft);
+}
+
+// Discards everything written to it.
+class NullBuffer : public std::streambuf
+{
+   protected:
+    std::streamsize xsputn(char const *, std::streamsize count) override
+    {
+        return count;
+    }
+    int overflow(int ch) override { return ch; }
+};
+
+// Scenarios
+// -----------------------------------------------------------------------------------
+
+static void BM_Polyline(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    Polyline polyline(Stroke(1, Color::Blue));
+    for (std::size_t i = 0; i < count; ++i)
+        polyline << Point(i * 1920.0 / count, rng.next() * 1080);
+
+    Layout layout = benchLayout();
+    runScenario(state, count,
+                [&] { return polyline.toString(layout).size(); });
+}
+BENCHMARK(BM_Polyline)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+// Integer samples drawn at a fractional scale; range(1) writes them in user
+//  coordinates under a group transform instead of translating each point.
+static void BM_PolylineDelegated(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    Polyline polyline(Stroke(1, Color::Blue));
+    for (std::size_t i = 0; i < count; ++i)
+        polyline << Point(static_cast<double>(i),
+                          static_cast<int>(rng.next() * 1000));
+
+    Layout const layout(Dimensions(1920, 1080), Layout::BottomLeft, 1.37);
+    Layout const shape_layout =
+        state.range(1) ? delegatedLayout(layout) : layout;
+    runScenario(state, count,
+                [&] { return polyline.toString(shape_layout).size(); });
+}
+BENCHMARK(BM_PolylineDelegated)
+    ->Args({1000000, 0})
+    ->Args({1000000, 1})
+    ->Unit(benchmark::kMillisecond);
+
+// Whole-pixel data, where formatting is cheap and the per-point
+//  coordinate translation matters; range(1) is the Layout::Origin.
+static void BM_PolylinePixels(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    Polyline polyline(Stroke(1, Color::Blue));
+    for (std::size_t i = 0; i < count; ++i)
+        polyline << Point(static_cast<double>(i % 1920),
+                          std::floor(rng.next() * 1080));
+
+    Layout layout(Dimensions(1920, 1080),
+                  static_cast<Layout::Origin>(state.range(1)));
+    runScenario(state, count,
+                [&] { return polyline.toString(layout).size(); });
+}
+BENCHMARK(BM_PolylinePixels)
+    ->Args({1000000, Layout::TopLeft})
+    ->Args({1000000, Layout::BottomLeft})
+    ->Unit(benchmark::kMillisecond);
+
+// The same pixel data stored as float and int16_t instead of double, a half
+//  and a quarter of the memory to hold and to read while writing.
+template <typename T>
+static void BM_PolylineStorage(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    BasicPolyline<T> polyline(Stroke(1, Color::Blue));
+    for (std::size_t i = 0; i < count; ++i)
+        polyline << Point(static_cast<double>(i % 1920),
+                          std::floor(rng.next() * 1080));
+
+    Layout layout(Dimensions(1920, 1080), Layout::TopLeft);
+    runScenario(state, count,
+                [&] { return polyline.toString(layout).size(); });
+}
+BENCHMARK_TEMPLATE(BM_PolylineStorage, float)
+    ->Arg(1000000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_PolylineStorage, std::int16_t)
+    ->Arg(1000000)
+    ->Unit(benchmark::kMillisecond);
+
+// Zoomed in on a tenth of a long series with clipping enabled.
+static void BM_PolylineClipped(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    Polyline polyline(Stroke(1, Color::Blue));
+    for (std::size_t i = 0; i < count; ++i)
+        polyline << Point(i * 1920.0 / count, rng.next() * 108);
+
+    Layout layout(Dimensions(1920, 1080), Layout::BottomLeft, 10,
+                  Point(-960, 0));
+    layout.clip = true;
+    runScenario(state, count,
+                [&] { return polyline.toString(layout).size(); });
+}
+BENCHMARK(BM_PolylineClipped)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+// A dense series on a 0.1 px grid; most points collapse onto a neighbour.
+static void BM_PolylineQuantized(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    Polyline polyline(Stroke(1, Color::Blue));
+    for (std::size_t i = 0; i < count; ++i)
+        polyline << Point(i * 1920.0 / count, 540 + rng.next() * 0.2);
+
+    Layout layout = benchLayout();
+    layout.quantum = 0.1;
+    runScenario(state, count,
+                [&] { return polyline.toString(layout).size(); });
+}
+BENCHMARK(BM_PolylineQuantized)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+// A smooth sensor-like series fitted to cubic segments within a quarter
+//  pixel, then written.
+static void BM_PolylineCurveFit(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Polyline polyline(Stroke(1, Color::Blue));
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        double const x = i * 1920.0 / count;
+        polyline << Point(x, 540 + 300 * std::sin(x / 150) +
+                                 40 * std::sin(x / 23));
+    }
+
+    Layout layout = benchLayout();
+    runScenario(state, count,
+                [&]
+                {
+                    return polyline.fitCurves(0.25 / layout.scale)
+                        .toString(layout)
+                        .size();
+                });
+}
+BENCHMARK(BM_PolylineCurveFit)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+static void BM_Circles(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    ShapeColl shapes;
+    for (std::size_t i = 0; i < count; ++i)
+        shapes << Circle(Point(rng.next() * 1920, rng.next() * 1080), 4,
+                         Fill(Color::Red), Stroke(1, Color::Black));
+
+    Layout layout = benchLayout();
+    runScenario(state, count, [&] { return shapes.toString(layout).size(); });
+}
+BENCHMARK(BM_Circles)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_Rectangles(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    ShapeColl shapes;
+    for (std::size_t i = 0; i < count; ++i)
+        shapes << Rectangle(Point(rng.next() * 1920, rng.next() * 1080), 8, 6,
+                            Fill(Color(40, 80, 160)));
+
+    Layout layout = benchLayout();
+    runScenario(state, count, [&] { return shapes.toString(layout).size(); });
+}
+BENCHMARK(BM_Rectangles)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+// Network diagram edges sharing one stroke; range(1) runs StyleMerger over
+//  the scene first, which is timed as well.
+static void BM_MergedLines(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    ShapeColl shapes;
+    for (std::size_t i = 0; i < count; ++i)
+        shapes << Line(Point(rng.next() * 1920, rng.next() * 1080),
+                       Point(rng.next() * 1920, rng.next() * 1080),
+                       Stroke(0.5, Color::Black));
+
+    Layout layout = benchLayout();
+    bool const merge = state.range(1) != 0;
+    runScenario(state, count,
+                [&]
+                {
+                    if (!merge) return shapes.toString(layout).size();
+                    StyleMerger merger;
+                    return merger.merge(shapes).toString(layout).size();
+                });
+}
+BENCHMARK(BM_MergedLines)
+    ->Args({200000, 0})
+    ->Args({200000, 1})
+    ->Unit(benchmark::kMillisecond);
+
+// Markers under opaque panels that cover about half of the view; range(1)
+//  runs OverdrawCuller over the scene first, which is timed as well.
+static void BM_OverdrawCull(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    ShapeColl shapes;
+    for (std::size_t i = 0; i < count; ++i)
+        shapes << Circle(Point(rng.next() * 1920, rng.next() * 1080), 6,
+                         Fill(Color(200, 40, 40)));
+    for (int panel = 0; panel < 8; ++panel)
+        shapes << Rectangle(Point(panel * 240.0, panel % 2 ? 0 : 540), 240,
+                            540, Fill(Color::White), Stroke(1, Color::Black));
+
+    Layout layout = benchLayout();
+    bool const cull = state.range(1) != 0;
+    runScenario(state, count,
+                [&]
+                {
+                    if (!cull) return shapes.toString(layout).size();
+                    OverdrawCuller culler;
+                    return culler.cull(shapes, layout).toString(layout).size();
+                });
+}
+BENCHMARK(BM_OverdrawCull)
+    ->Args({100000, 0})
+    ->Args({100000, 1})
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_PathSubpaths(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    Path path(Fill(Color::Yellow), Stroke(1, Color::Purple));
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        Point corner(rng.next() * 1900, rng.next() * 1060);
+        path << corner << corner + Size(10, 0) << corner + Size(10, 10)
+             << corner + Size(0, 10);
+        path.startNewSubPath();
+    }
+
+    Layout layout = benchLayout();
+    runScenario(state, count, [&] { return path.toString(layout).size(); });
+}
+BENCHMARK(BM_PathSubpaths)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+static void BM_LineChart(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    Polyline series(Stroke(1, Color::Blue));
+    for (std::size_t i = 0; i < count; ++i)
+        series << Point(static_cast<double>(i), rng.next() * 100);
+    LineChart chart(Dimensions(10, 10));
+    chart << series;
+
+    Layout layout = benchLayout();
+    runScenario(state, count, [&] { return chart.toString(layout).size(); });
+}
+BENCHMARK(BM_LineChart)->Arg(50000)->Unit(benchmark::kMillisecond);
+
+// A live plot: each iteration appends one sample to a full window and
+//  redraws it, reusing the output buffer.
+static void BM_StreamingLineChart(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    StreamingLineChart chart(count, Dimensions(10, 10));
+    std::size_t const series = chart.addSeries(Stroke(1, Color::Blue));
+    std::size_t sample = 0;
+    for (; sample < count; ++sample)
+        chart.push(series, Point(static_cast<double>(sample), rng.next() * 100));
+
+    Layout layout = benchLayout();
+    std::string out;
+    runScenario(state, count,
+                [&]
+                {
+                    chart.push(series, Point(static_cast<double>(sample++),
+                                             rng.next() * 100));
+                    out.clear();
+                    chart.appendTo(out, layout);
+                    return out.size();
+                });
+}
+BENCHMARK(BM_StreamingLineChart)->Arg(50000)->Unit(benchmark::kMillisecond);
+
+// 1M-point scatter plot; the second argument selects MarkerBatch::Mode.
+static void BM_MarkerBatch(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    MarkerBatch batch(3, Fill(Color::Red), Stroke(),
+                      static_cast<MarkerBatch::Mode>(state.range(1)));
+    batch.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+        batch << Point(rng.next() * 1920, rng.next() * 1080);
+
+    Layout layout = benchLayout();
+    runScenario(state, count, [&] { return batch.toString(layout).size(); });
+}
+BENCHMARK(BM_MarkerBatch)
+    ->Args({1000000, MarkerBatch::Circles})
+    ->Args({1000000, MarkerBatch::UseInstances})
+    ->Args({1000000, MarkerBatch::SinglePath})
+    ->Unit(benchmark::kMillisecond);
+
+// A smooth 2000x2000 field, as produced by interpolated sensor data.
+static void BM_Heatmap(benchmark::State &state)
+{
+    std::size_t const size = static_cast<std::size_t>(state.range(0));
+    std::vector<double> values(size * size);
+    for (std::size_t row = 0; row < size; ++row)
+        for (std::size_t column = 0; column < size; ++column)
+            values[row * size + column] =
+                std::sin(row * 0.004) * std::cos(column * 0.003);
+    Heatmap heatmap(Point(0, 0), size, size, 0.5, 0.5, values,
+                    ColorMap({Color(0, 0, 255), Color(255, 255, 255),
+                              Color(255, 0, 0)},
+                             -1, 1, 32));
+
+    Layout layout = benchLayout();
+    runScenario(state, size * size,
+                [&] { return heatmap.toString(layout).size(); });
+}
+BENCHMARK(BM_Heatmap)->Arg(2000)->Unit(benchmark::kMillisecond);
+
+// Labels as they come from user data: most are clean, some need escaping.
+static void BM_TextLabels(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    ShapeColl shapes;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        std::ostringstream label;
+        label << "Sensor " << i << " - building north wing, floor "
+              << i % 40;
+        if (i % 10 == 0) label << " <offline> & \"stale\"";
+        shapes << Text(Point(rng.next() * 1800, rng.next() * 1080),
+                       label.str(), Fill(Color::Black),
+                       Font(10, "Helvetica"));
+    }
+
+    Layout layout = benchLayout();
+    runScenario(state, count, [&] { return shapes.toString(layout).size(); });
+}
+BENCHMARK(BM_TextLabels)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static Document circleDocument(std::string const &file_name,
+                               std::size_t count)
+{
+    Lcg rng;
+    Document doc(file_name, benchLayout());
+    for (std::size_t i = 0; i < count; ++i)
+        doc << Circle(Point(rng.next() * 1920, rng.next() * 1080), 4,
+                      Fill(Color::Red), Stroke(1, Color::Black));
+    return doc;
+}
+
+static void BM_DocumentSaveFile(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Document doc = circleDocument("simple_svg_bench.svg", count);
+    std::size_t const bytes = doc.toString().size();
+
+    runScenario(state, count,
+                [&]
+                {
+                    if (!doc.save()) state.SkipWithError("save() failed");
+                    return bytes;
+                });
+    std::remove("simple_svg_bench.svg");
+}
+BENCHMARK(BM_DocumentSaveFile)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_DocumentSaveNull(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Document doc = circleDocument("", count);
+    std::size_t const bytes = doc.toString().size();
+    NullBuffer null_buffer;
+    std::ostream null_stream(&null_buffer);
+
+    runScenario(state, count,
+                [&]
+                {
+                    doc.writeToStream(null_stream);
+                    return bytes;
+                });
+}
+BENCHMARK(BM_DocumentSaveNull)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+// Small sparkline documents formatted in memory, one Document each, or with
+//  range(1) set through a BatchRenderer.  Measured in wall time, as the
+//  batch runs on worker threads.
+static void BM_Sparklines(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    std::vector<Polyline> lines(count, Polyline(Stroke(1, Color::Blue)));
+    for (auto &line : lines)
+        for (int i = 0; i < 30; ++i)
+            line << Point(i * 4, static_cast<int>(rng.next() * 30));
+
+    Layout const layout(Dimensions(120, 30));
+    if (state.range(1) == 0)
+    {
+        runScenario(state, count,
+                    [&]
+                    {
+                        std::size_t bytes = 0;
+                        for (auto const &line : lines)
+                        {
+                            Document doc("", layout);
+                            doc << line;
+                            bytes += doc.toString().size();
+                        }
+                        return bytes;
+                    });
+        return;
+    }
+
+    std::vector<std::string> outputs(count);
+    std::vector<RenderJob> jobs;
+    for (std::size_t i = 0; i < count; ++i)
+        jobs.emplace_back(lines[i], layout, &outputs[i]);
+    BatchRenderer renderer;
+    runScenario(state, count, [&] { return renderer.render(jobs).bytes; });
+}
+BENCHMARK(BM_Sparklines)
+    ->Args({20000, 0})
+    ->Args({20000, 1})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Reading output back: bytes/s is the parse rate over the SVG text.
+static void BM_LoadCircles(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    std::string const svg = circleDocument("", count).toString();
+
+    runScenario(state, count,
+                [&]
+                {
+                    LoadResult loaded = loadSvg(svg.data(), svg.size());
+                    if (loaded.shapes.size() != count)
+                        state.SkipWithError("loadSvg() failed");
+                    return svg.size();
+                });
+}
+BENCHMARK(BM_LoadCircles)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_LoadPolyline(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    Polyline polyline(Stroke(1, Color::Blue));
+    for (std::size_t i = 0; i < count; ++i)
+        polyline << Point(i * 1920.0 / count, rng.next() * 1080);
+    Document doc("", benchLayout());
+    doc << polyline;
+    std::string const svg = doc.toString();
+
+    runScenario(state, count,
+                [&]
+                {
+                    LoadResult loaded = loadSvg(svg.data(), svg.size());
+                    if (loaded.shapes.size() != 1)
+                        state.SkipWithError("loadSvg() failed");
+                    return svg.size();
+                });
+}
+BENCHMARK(BM_LoadPolyline)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+// Display list to SVG, opening the list each time as a cache hit would.
+static void BM_DisplayListCircles(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    DisplayListWriter writer;
+    for (std::size_t i = 0; i < count; ++i)
+        writer << Circle(Point(rng.next() * 1920, rng.next() * 1080), 4,
+                         Fill(Color::Red), Stroke(1, Color::Black));
+    std::string const bytes = writer.bytes();
+
+    Layout layout = benchLayout();
+    runScenario(state, count,
+                [&]
+                {
+                    DisplayList list(bytes.data(), bytes.size());
+                    return list.toString(layout).size();
+                });
+}
+BENCHMARK(BM_DisplayListCircles)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_DisplayListPolyline(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    Polyline polyline(Stroke(1, Color::Blue));
+    for (std::size_t i = 0; i < count; ++i)
+        polyline << Point(static_cast<double>(i),
+                          std::floor(rng.next() * 1080));
+    DisplayListWriter writer;
+    writer << polyline;
+    std::string const bytes = writer.bytes();
+
+    Layout layout(Dimensions(1920, 1080), Layout::BottomLeft,
+                  1920.0 / count);
+    runScenario(state, count,
+                [&]
+                {
+                    DisplayList list(bytes.data(), bytes.size());
+                    return list.toString(layout).size();
+                });
+}
+BENCHMARK(BM_DisplayListPolyline)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+// Dashboard pages sharing one chart and legend, with the process-wide
+//  fragment cache off (0) and on (1).
+static void BM_SharedFragments(benchmark::State &state)
+{
+    std::size_t const count = static_cast<std::size_t>(state.range(0));
+    Lcg rng;
+    LineChart chart(Dimensions(20, 20));
+    Polyline series(Stroke(1, Color::Blue));
+    for (std::size_t i = 0; i < 2000; ++i)
+        series << Point(i * 0.5, rng.next() * 500);
+    chart << series;
+    ShapeColl legend;
+    for (int i = 0; i < 10; ++i)
+        legend << Rectangle(Point(1100, 40.0 * i), 20, 20, Fill(Color::Blue))
+               << Text(Point(1130, 40.0 * i), "series");
+
+    FragmentCache &cache = FragmentCache::global();
+    cache.setBudget(state.range(1) ? 64 << 20 : 0);
+    cache.resetStats();
+    runScenario(state, count,
+                [&]
+                {
+                    std::size_t bytes = 0;
+                    for (std::size_t i = 0; i < count; ++i)
+                    {
+                        Document page("", benchLayout());
+                        page << chart << legend
+                             << Text(Point(10, 1000), "page");
+                        bytes += page.toString().size();
+                    }
+                    return bytes;
+                });
+    state.counters["hit_rate"] = cache.stats().hitRate();
+    cache.setBudget(0);
+}
+BENCHMARK(BM_SharedFragments)
+    ->Args({100, 0})
+    ->Args({100, 1})
+    ->Unit(benchmark::kMillisecond);
+
+// Baseline handling
+// -----------------------------------------------------------------------------------
+
+// Reads the flat {"name": ns_per_elem, ...} map written by writeBaseline.
+static std::map<std::string, double> readBaseline(std::string const &file)
+{
+    std::map<std::string, double> baseline;
+    std::ifstream ifs(file.c_str());
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    std::string const text = ss.str();
+
+    std::size_t pos = 0;
+    while ((pos = text.find('"', pos)) != std::string::npos)
+    {
+        std::size_t end = text.find('"', pos + 1);
+        if (end == std::string::npos) break;
+        std::string name = text.substr(pos + 1, end - pos - 1);
+        std::size_t colon = text.find(':', end);
+        if (colon == std::string::npos) break;
+        char *number_end = nullptr;
+        double value = std::strtod(text.c_str() + colon + 1, &number_end);
+        if (number_end != text.c_str() + colon + 1) baseline[name] = value;
+        pos = number_end ? number_end - text.c_str() : colon + 1;
+    }
+    return baseline;
+}
+
+static bool writeBaseline(std::string const &file,
+                          std::map<std::string, double> const &measured)
+{
+    std::ofstream ofs(file.c_str());
+    if (!ofs.good()) return false;
+
+    ofs << "{\n";
+    std::size_t index = 0;
+    for (auto const &entry : measured)
+    {
+        ofs << "    \"" << entry.first << "\": " << entry.second
+            << (++index < measured.size() ? ",\n" : "\n");
+    }
+    ofs << "}\n";
+    return ofs.good();
+}
+
+// Console output as usual, plus ns/elem collected per benchmark.
+class BaselineReporter : public benchmark::ConsoleReporter
+{
+   public:
+    void ReportRuns(std::vector<Run> const &reports) override
+    {
+        ConsoleReporter::ReportRuns(reports);
+        for (auto const &run : reports)
+        {
+            if (run.error_occurred || run.run_type != Run::RT_Iteration)
+                continue;
+            auto elements = run.counters.find("elements");
+            if (elements == run.counters.end() || run.iterations == 0)
+                continue;
+            double ns = run.real_accumulated_time * 1e9 / run.iterations;
+            measured[run.benchmark_name()] = ns / elements->second.value;
+        }
+    }
+
+    std::map<std::string, double> measured;
+};
+
+static bool takeFlag(std::string const &arg, char const *flag,
+                     std::string &value)
+{
+    std::string prefix = std::string("--") + flag + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    std::string check_file;
+    std::string update_file;
+    std::string max_regression = "3";
+
+    // Strip our flags before Google Benchmark sees the command line.
+    int kept = 1;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (!takeFlag(arg, "check_baseline", check_file) &&
+            !takeFlag(arg, "update_baseline", update_file) &&
+            !takeFlag(arg, "max_regression", max_regression))
+            argv[kept++] = argv[i];
+    }
+    argc = kept;
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+
+    BaselineReporter reporter;
+    benchmark::RunSpecifiedBenchmarks(&reporter);
+    benchmark::Shutdown();
+
+    if (!update_file.empty() && !writeBaseline(update_file, reporter.measured))
+    {
+        std::cerr << "Could not write baseline " << update_file << std::endl;
+        return 1;
+    }
+
+    if (check_file.empty()) return 0;
+
+    std::map<std::string, double> baseline = readBaseline(check_file);
+    if (baseline.empty())
+    {
+        std::cerr << "No baseline entries in " << check_file << std::endl;
+        return 1;
+    }
+
+    double const factor = std::atof(max_regression.c_str());
+    int regressions = 0;
+    for (auto const &entry : reporter.measured)
+    {
+        auto expected = baseline.find(entry.first);
+        if (expected == baseline.end()) continue;
+
+        bool regressed = entry.second > expected->second * factor;
+        std::cout << (regressed ? "REGRESSION " : "ok         ")
+                  << entry.first << ": " << entry.second
+                  << " ns/elem (baseline " << expected->second << ")"
+                  << std::endl;
+        if (regressed) ++regressions;
+    }
+    return regressions == 0 ? 0 : 1;
+}
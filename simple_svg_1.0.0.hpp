@@ -32,15 +32,189 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef SIMPLE_SVG_HPP
 #define SIMPLE_SVG_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMPLE_SVG_HAS_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define SIMPLE_SVG_HAS_AVX2 1
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 namespace svg
 {
+namespace detail
+{
+inline bool isXmlSpecial(char c)
+{
+    return c == '<' || c == '>' || c == '&' || c == '"' || c == '\'';
+}
+
+inline char const *xmlEntity(char c)
+{
+    switch (c)
+    {
+        case '<':
+            return "&lt;";
+        case '>':
+            return "&gt;";
+        case '&':
+            return "&amp;";
+        case '"':
+            return "&quot;";
+        default:
+            return "&apos;";
+    }
+}
+
+inline unsigned countTrailingZeros(unsigned mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+// FNV-1a over size bytes at data, continuing from hash.
+inline std::uint64_t hashBytes(void const *data, std::size_t size,
+                               std::uint64_t hash = 14695981039346656037ull)
+{
+    unsigned char const *bytes = static_cast<unsigned char const *>(data);
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Index of the first XML special character at or after pos, or size if there
+//  is none.  Whole 32/16 byte blocks are compared at once where the target
+//  supports it, the tail is scanned a byte at a time.
+inline std::size_t findXmlSpecial(char const *data, std::size_t size,
+                                  std::size_t pos = 0)
+{
+#ifdef SIMPLE_SVG_HAS_AVX2
+    __m256i const lt32 = _mm256_set1_epi8('<');
+    __m256i const gt32 = _mm256_set1_epi8('>');
+    __m256i const amp32 = _mm256_set1_epi8('&');
+    __m256i const quot32 = _mm256_set1_epi8('"');
+    __m256i const apos32 = _mm256_set1_epi8('\'');
+    for (; pos + 32 <= size; pos += 32)
+    {
+        __m256i block =
+            _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + pos));
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, lt32),
+                            _mm256_cmpeq_epi8(block, gt32)),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, amp32),
+                                            _mm256_cmpeq_epi8(block, quot32)),
+                            _mm256_cmpeq_epi8(block, apos32)));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hits));
+        if (mask) return pos + countTrailingZeros(mask);
+    }
+#endif
+#ifdef SIMPLE_SVG_HAS_SSE2
+    __m128i const lt = _mm_set1_epi8('<');
+    __m128i const gt = _mm_set1_epi8('>');
+    __m128i const amp = _mm_set1_epi8('&');
+    __m128i const quot = _mm_set1_epi8('"');
+    __m128i const apos = _mm_set1_epi8('\'');
+    for (; pos + 16 <= size; pos += 16)
+    {
+        __m128i block =
+            _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + pos));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, lt), _mm_cmpeq_epi8(block, gt)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, amp),
+                                      _mm_cmpeq_epi8(block, quot)),
+                         _mm_cmpeq_epi8(block, apos)));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hits));
+        if (mask) return pos + countTrailingZeros(mask);
+    }
+#endif
+    for (; pos < size; ++pos)
+        if (isXmlSpecial(data[pos])) return pos;
+    return size;
+}
+}  // namespace detail
+
 // Utility XML/String Functions.
+
+// Appends text to out with the five XML special characters replaced by their
+//  entities.  Runs without special characters are copied in one piece.
+inline void appendXmlEscaped(std::string &out, char const *text,
+                             std::size_t size)
+{
+    std::size_t start = 0;
+    while (start < size)
+    {
+        std::size_t special = detail::findXmlSpecial(text, size, start);
+        out.append(text + start, special - start);
+        if (special == size) break;
+
+        out += detail::xmlEntity(text[special]);
+        start = special + 1;
+    }
+}
+inline std::string escapeXml(std::string const &text)
+{
+    // Common case: nothing to escape, hand back a plain copy.
+    if (detail::findXmlSpecial(text.data(), text.size()) == text.size())
+        return text;
+
+    std::string escaped;
+    escaped.reserve(text.size() + 16);
+    appendXmlEscaped(escaped, text.data(), text.size());
+    return escaped;
+}
+
 template <typename T>
 inline std::string attribute(std::string const &attribute_name, T const &value,
                              std::string const &unit = "")
@@ -49,6 +223,25 @@ inline std::string attribute(std::string const &attribute_name, T const &value,
     ss << attribute_name << "=\"" << value << unit << "\" ";
     return ss.str();
 }
+// String values may come from user data, so they are escaped.
+inline std::string attribute(std::string const &attribute_name,
+                             std::string const &value,
+                             std::string const &unit = "")
+{
+    std::string ret;
+    ret.reserve(attribute_name.size() + value.size() + unit.size() + 4);
+    ret += attribute_name;
+    ret += "=\"";
+    appendXmlEscaped(ret, value.data(), value.size());
+    ret += unit;
+    ret += "\" ";
+    return ret;
+}
+inline std::string attribute(std::string const &attribute_name,
+                             char const *value, std::string const &unit = "")
+{
+    return attribute(attribute_name, std::string(value), unit);
+}
 inline std::string elemStart(std::string const &element_name)
 {
     return "\t<" + element_name + " ";
@@ -59,6 +252,41 @@ inline std::string elemEnd(std::string const &element_name)
 }
 inline std::string emptyElemEnd() { return "/>\n"; }
 
+// Appends value formatted exactly as a default-configured stream would
+//  ("%g"), without going through a stream.  Integers below one million,
+//  the common case for pixel data, skip printf altogether.
+inline void appendNumber(std::string &out, double value)
+{
+    if (value > -1e6 && value < 1e6 && value == static_cast<int>(value) &&
+        !(value == 0 && std::signbit(value)))
+    {
+        char digits[8];
+        int integer = static_cast<int>(value);
+        unsigned magnitude = integer < 0 ? -integer : integer;
+        int length = 0;
+        do
+        {
+            digits[length++] = static_cast<char>('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude);
+        if (integer < 0) out += '-';
+        while (length) out += digits[--length];
+        return;
+    }
+
+    char buffer[32];
+    int length = std::snprintf(buffer, sizeof(buffer), "%g", value);
+    out.append(buffer, static_cast<std::size_t>(length));
+}
+// name="value" as attribute() writes it, without a stream.
+inline void appendAttribute(std::string &out, char const *name, double value)
+{
+    out += name;
+    out += "=\"";
+    appendNumber(out, value);
+    out += "\" ";
+}
+
 // Quick optional return type.  This allows functions to return an invalid
 //  value if no good return is possible.  The user checks for validity
 //  before using the returned value.
@@ -93,45 +321,85 @@ struct Dimensions
     double height;
 };
 
-struct Point
+namespace detail
+{
+// Converts a computed coordinate for storage as T, rounding to the nearest
+//  integer for integral types.
+template <typename T>
+inline T coordinateCast(double value, std::true_type)
+{
+    return static_cast<T>(std::llround(value));
+}
+template <typename T>
+inline T coordinateCast(double value, std::false_type)
+{
+    return static_cast<T>(value);
+}
+template <typename T>
+inline T coordinateCast(double value)
+{
+    return coordinateCast<T>(value, std::is_integral<T>());
+}
+}  // namespace detail
+
+// A point stored as T.  Point (double) is what the library computes with;
+//  float or a small integer type halve or quarter the memory of large
+//  point lists (see BasicPolyline and friends).
+template <typename T>
+struct BasicPoint
 {
-    explicit Point(double x = 0, double y = 0) : x(x), y(y) {}
-    double x;
-    double y;
+    static_assert(std::is_arithmetic<T>::value,
+                  "Coordinates must be arithmetic");
+
+    explicit BasicPoint(T x = 0, T y = 0) : x(x), y(y) {}
+    template <typename U>
+    explicit BasicPoint(BasicPoint<U> const &other)
+        : x(detail::coordinateCast<T>(other.x)),
+          y(detail::coordinateCast<T>(other.y))
+    {
+    }
+    T x;
+    T y;
 
-    Point operator+(const Point &other) const
+    BasicPoint operator+(const BasicPoint &other) const
     {
-        return Point(x + other.x, y + other.y);
+        return BasicPoint(x + other.x, y + other.y);
     }
 
-    Point operator-(const Point &other) const
+    BasicPoint operator-(const BasicPoint &other) const
     {
-        return Point(x - other.x, y - other.y);
+        return BasicPoint(x - other.x, y - other.y);
     }
 };
-inline optional<Point> getMinPoint(std::vector<Point> const &points)
+typedef BasicPoint<double> Point;
+
+template <typename T>
+inline optional<BasicPoint<T>> getMinPoint(
+    std::vector<BasicPoint<T>> const &points)
 {
-    if (points.empty()) return optional<Point>();
+    if (points.empty()) return optional<BasicPoint<T>>();
 
-    Point min = points[0];
+    BasicPoint<T> min = points[0];
     for (unsigned i = 0; i < points.size(); ++i)
     {
         if (points[i].x < min.x) min.x = points[i].x;
         if (points[i].y < min.y) min.y = points[i].y;
     }
-    return optional<Point>(min);
+    return optional<BasicPoint<T>>(min);
 }
-inline optional<Point> getMaxPoint(std::vector<Point> const &points)
+template <typename T>
+inline optional<BasicPoint<T>> getMaxPoint(
+    std::vector<BasicPoint<T>> const &points)
 {
-    if (points.empty()) return optional<Point>();
+    if (points.empty()) return optional<BasicPoint<T>>();
 
-    Point max = points[0];
+    BasicPoint<T> max = points[0];
     for (unsigned i = 0; i < points.size(); ++i)
     {
         if (points[i].x > max.x) max.x = points[i].x;
         if (points[i].y > max.y) max.y = points[i].y;
     }
-    return optional<Point>(max);
+    return optional<BasicPoint<T>>(max);
 }
 
 struct Size
@@ -154,6 +422,17 @@ struct Box
 };
 
 // Defines the dimensions, scale, origin, and origin offset of the document.
+// Running numbers for the ids of <defs> entries (MarkerBatch definitions),
+//  so that they are unique within one document.  scope tells apart the
+//  sources formatting shapes for the same document, e.g. the producers of
+//  a DocumentBuilder.
+struct DefinitionIds
+{
+    explicit DefinitionIds(std::uint64_t scope = 0) : scope(scope), next(0) {}
+    std::uint64_t scope;
+    std::uint64_t next;
+};
+
 struct Layout
 {
     enum Origin
@@ -170,13 +449,41 @@ struct Layout
         : dimensions(dimensions),
           scale(scale),
           origin(origin),
-          origin_offset(origin_offset)
+          origin_offset(origin_offset),
+          clip(false),
+          quantum(0),
+          removed_points(nullptr),
+          definition_ids(nullptr),
+          delegated(false),
+          outer_origin(origin),
+          outer_scale(scale),
+          outer_offset(origin_offset)
     {
     }
     Dimensions dimensions;
     double scale;
     Origin origin;
     Point origin_offset;
+    // Cut Polyline, Polygon and Path geometry to the visible area (plus room
+    //  for the stroke) before writing it, and skip circles outside of it.
+    bool clip;
+    // When positive, Polyline, Polygon and Path coordinates are snapped to
+    //  multiples of quantum SVG pixels (e.g. 0.1) and points that then repeat
+    //  the previous one or continue it in a straight line are dropped.  The
+    //  number dropped is added to *removed_points if that is set.
+    double quantum;
+    std::atomic<std::uint64_t> *removed_points;
+    // Where shapes writing <defs> take their ids from.  Document, its
+    //  readers, DocumentBuilder and BatchRenderer set it; without it the
+    //  ids are derived from the content.
+    DefinitionIds *definition_ids;
+    // Set on the layout from delegatedLayout(), along with the origin, scale
+    //  and offset of the layout whose transform the enclosing group applies.
+    //  Clipping, text and non-scaling strokes use them.
+    bool delegated;
+    Origin outer_origin;
+    double outer_scale;
+    Point outer_offset;
 };
 
 // Convert coordinates in user space to SVG native space.
@@ -204,6 +511,225 @@ inline double translateScale(double dimension, Layout const &layout)
     return dimension * layout.scale;
 }
 
+// The transform matrix(a 0 0 d e f) that maps user coordinates to SVG space
+//  the way translateX() and translateY() do.
+struct LayoutTransform
+{
+    double a, d, e, f;
+};
+inline LayoutTransform layoutTransform(Layout const &layout)
+{
+    LayoutTransform m;
+    bool const right = layout.origin == Layout::TopRight ||
+                       layout.origin == Layout::BottomRight;
+    bool const bottom = layout.origin == Layout::BottomLeft ||
+                        layout.origin == Layout::BottomRight;
+    double const offset_x = layout.origin_offset.x * layout.scale;
+    double const offset_y = layout.origin_offset.y * layout.scale;
+    m.a = right ? -layout.scale : layout.scale;
+    m.e = right ? layout.dimensions.width - offset_x : offset_x;
+    m.d = bottom ? -layout.scale : layout.scale;
+    m.f = bottom ? layout.dimensions.height - offset_y : offset_y;
+    return m;
+}
+// <g transform="matrix(...)"> for layout, see delegatedLayout().
+inline void appendGroupStart(std::string &out, Layout const &layout)
+{
+    LayoutTransform const m = layoutTransform(layout);
+    out += "<g transform=\"matrix(";
+    appendNumber(out, m.a);
+    out += " 0 0 ";
+    appendNumber(out, m.d);
+    out += ' ';
+    appendNumber(out, m.e);
+    out += ' ';
+    appendNumber(out, m.f);
+    out += ")\">\n";
+}
+// The layout to write shapes with inside appendGroupStart(layout): user
+//  coordinates are written as they are and the group transform maps them,
+//  so no per-point math is done.  Clipping is against the viewport mapped
+//  back to user units; quantum is converted to user units.
+inline Layout delegatedLayout(Layout const &layout)
+{
+    Layout ret(layout.dimensions, Layout::TopLeft);
+    ret.clip = layout.clip;
+    ret.quantum = layout.scale > 0 ? layout.quantum / layout.scale : 0;
+    ret.removed_points = layout.removed_points;
+    ret.definition_ids = layout.definition_ids;
+    ret.delegated = true;
+    ret.outer_origin = layout.origin;
+    ret.outer_scale = layout.scale;
+    ret.outer_offset = layout.origin_offset;
+    return ret;
+}
+// The layout a delegatedLayout() result was made from; layout itself if it
+//  is not delegated.
+inline Layout outerLayout(Layout const &layout)
+{
+    if (!layout.delegated) return layout;
+    return Layout(layout.dimensions, layout.outer_origin, layout.outer_scale,
+                  layout.outer_offset);
+}
+
+// Compile-time layout descriptor: translateX() and translateY() for one
+//  origin, with the scale and offset folded away when Identity is set.
+//  Results are exactly those of the runtime functions; withStaticLayout()
+//  picks the instance for a Layout so that per-point loops run on it.
+template <Layout::Origin O, bool Identity>
+struct StaticLayout
+{
+    static constexpr bool flip_x =
+        O == Layout::TopRight || O == Layout::BottomRight;
+    static constexpr bool flip_y =
+        O == Layout::BottomLeft || O == Layout::BottomRight;
+
+    static double x(double x, Layout const &layout)
+    {
+        // Adding zero keeps -0 turning into 0 as it does with the offset.
+        double scaled =
+            Identity ? x + 0.0 : (layout.origin_offset.x + x) * layout.scale;
+        return flip_x ? layout.dimensions.width - scaled : scaled;
+    }
+    static double y(double y, Layout const &layout)
+    {
+        double scaled =
+            Identity ? y + 0.0 : (layout.origin_offset.y + y) * layout.scale;
+        return flip_y ? layout.dimensions.height - scaled : scaled;
+    }
+};
+
+// Scale 1 and a zero offset, where -0 offsets do not count: they could
+//  change the sign of a zero result.
+inline bool isIdentityLayout(Layout const &layout)
+{
+    return layout.scale == 1 && layout.origin_offset.x == 0 &&
+           layout.origin_offset.y == 0 &&
+           !std::signbit(layout.origin_offset.x) &&
+           !std::signbit(layout.origin_offset.y);
+}
+
+// Calls Op<StaticLayout<...>>::run(args...) with the descriptor matching
+//  layout, so Op is compiled once per origin without runtime branches.
+template <template <typename> class Op, typename... Args>
+inline void withStaticLayout(Layout const &layout, Args &&...args)
+{
+    bool const identity = isIdentityLayout(layout);
+    switch (layout.origin)
+    {
+        case Layout::TopLeft:
+            return identity
+                       ? Op<StaticLayout<Layout::TopLeft, true>>::run(args...)
+                       : Op<StaticLayout<Layout::TopLeft, false>>::run(
+                             args...);
+        case Layout::BottomLeft:
+            return identity
+                       ? Op<StaticLayout<Layout::BottomLeft, true>>::run(
+                             args...)
+                       : Op<StaticLayout<Layout::BottomLeft, false>>::run(
+                             args...);
+        case Layout::TopRight:
+            return identity
+                       ? Op<StaticLayout<Layout::TopRight, true>>::run(args...)
+                       : Op<StaticLayout<Layout::TopRight, false>>::run(
+                             args...);
+        case Layout::BottomRight:
+            return identity
+                       ? Op<StaticLayout<Layout::BottomRight, true>>::run(
+                             args...)
+                       : Op<StaticLayout<Layout::BottomRight, false>>::run(
+                             args...);
+    }
+}
+
+// Render statistics.  Collected by Document and ShapeColl only when
+//  SIMPLE_SVG_ENABLE_STATS is defined before this header is included;
+//  otherwise the hooks compile to nothing and the counters stay zero.
+struct ShapeStats
+{
+    ShapeStats()
+        : elements(0), points(0), bytes(0), nanoseconds(0), allocations(0)
+    {
+    }
+    ShapeStats &operator+=(ShapeStats const &other)
+    {
+        elements += other.elements;
+        points += other.points;
+        bytes += other.bytes;
+        nanoseconds += other.nanoseconds;
+        allocations += other.allocations;
+        return *this;
+    }
+    std::uint64_t elements;
+    std::uint64_t points;
+    std::uint64_t bytes;
+    std::uint64_t nanoseconds;
+    std::uint64_t allocations;
+};
+
+struct RenderStats
+{
+    RenderStats()
+        : allocations(0),
+          format_nanoseconds(0),
+          io_nanoseconds(0),
+          bytes_written(0),
+          cache_hits(0)
+    {
+    }
+    void reset() { *this = RenderStats(); }
+    ShapeStats total() const
+    {
+        ShapeStats sum;
+        for (auto const &entry : shapes) sum += entry.second;
+        return sum;
+    }
+
+    // Keyed by Shape::shapeName().
+    std::map<std::string, ShapeStats> shapes;
+    std::uint64_t allocations;
+    // Time spent producing SVG text versus writing it out in save().
+    std::uint64_t format_nanoseconds;
+    std::uint64_t io_nanoseconds;
+    std::uint64_t bytes_written;
+    // Shapes and collections served from the FragmentCache.  Their elements
+    //  and points count as rendered; the bytes and lookup time of a cached
+    //  collection go to its own "ShapeColl" entry.
+    std::uint64_t cache_hits;
+};
+
+typedef std::function<void(RenderStats const &)> RenderStatsCallback;
+
+// The library cannot see allocations itself.  Install a function returning a
+//  running allocation count (e.g. from a counting operator new) and the
+//  stats will record the difference around every serialized shape.
+inline std::function<std::uint64_t()> &allocationCounter()
+{
+    static std::function<std::uint64_t()> counter;
+    return counter;
+}
+inline void setAllocationCounter(std::function<std::uint64_t()> counter)
+{
+    allocationCounter() = counter;
+}
+
+namespace detail
+{
+inline std::uint64_t elapsedNanoseconds(
+    std::chrono::steady_clock::time_point start)
+{
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count());
+}
+inline std::uint64_t allocationCount()
+{
+    std::function<std::uint64_t()> const &counter = allocationCounter();
+    return counter ? counter() : 0;
+}
+}  // namespace detail
+
 class Serializeable
 {
    public:
@@ -212,6 +738,27 @@ class Serializeable
     virtual std::string toString(Layout const &layout) const = 0;
 };
 
+namespace detail
+{
+// Two lowercase hex digits for every byte value, indexed by 2 * byte.
+inline char const *hexByteTable()
+{
+    static char const table[] =
+        "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+        "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+        "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+        "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+        "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+        "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+        "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+        "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+    return table;
+}
+}  // namespace detail
+
+// A color packed as 0xRRGGBBAA.  Serializes to the shortest of "#rgb",
+//  "#rrggbb" or "none"; partial alpha is written separately by Fill and Stroke
+//  as fill-opacity/stroke-opacity.
 class Color : public Serializeable
 {
    public:
@@ -235,89 +782,116 @@ class Color : public Serializeable
         Yellow
     };
 
-    Color(int r, int g, int b) : transparent(false), red(r), green(g), blue(b)
+    Color(int r, int g, int b, int a = 255) : rgba(pack(r, g, b, a)) {}
+    explicit Color(Defaults color) : rgba(defaultRgba(color)) {}
+    virtual ~Color() override {}
+    std::string toString(Layout const &) const override
     {
+        char buffer[maxLength];
+        return std::string(buffer, write(buffer));
     }
-    explicit Color(Defaults color)
-        : transparent(false), red(0), green(0), blue(0)
+    void appendTo(std::string &out) const
     {
-        switch (color)
-        {
-            case Aqua:
-                assign(0, 255, 255);
-                break;
-            case Black:
-                assign(0, 0, 0);
-                break;
-            case Blue:
-                assign(0, 0, 255);
-                break;
-            case Brown:
-                assign(165, 42, 42);
-                break;
-            case Cyan:
-                assign(0, 255, 255);
-                break;
-            case Fuchsia:
-                assign(255, 0, 255);
-                break;
-            case Green:
-                assign(0, 128, 0);
-                break;
-            case Lime:
-                assign(0, 255, 0);
-                break;
-            case Magenta:
-                assign(255, 0, 255);
-                break;
-            case Orange:
-                assign(255, 165, 0);
-                break;
-            case Purple:
-                assign(128, 0, 128);
-                break;
-            case Red:
-                assign(255, 0, 0);
-                break;
-            case Silver:
-                assign(192, 192, 192);
-                break;
-            case White:
-                assign(255, 255, 255);
-                break;
-            case Yellow:
-                assign(255, 255, 0);
-                break;
-            default:
-                transparent = true;
-                break;
-        }
+        char buffer[maxLength];
+        out.append(buffer, write(buffer));
     }
-    virtual ~Color() override {}
-    std::string toString(Layout const &) const override
+    // Writes at most maxLength characters, returns the number written.
+    std::size_t write(char *out) const
     {
-        std::stringstream ss;
-        if (transparent)
-            ss << "none";
-        else
-            ss << "rgb(" << red << "," << green << "," << blue << ")";
-        return ss.str();
+        if (isTransparent())
+        {
+            out[0] = 'n';
+            out[1] = 'o';
+            out[2] = 'n';
+            out[3] = 'e';
+            return 4;
+        }
+
+        char const *hex = detail::hexByteTable();
+        char const *r = hex + 2 * red();
+        char const *g = hex + 2 * green();
+        char const *b = hex + 2 * blue();
+        out[0] = '#';
+        if (r[0] == r[1] && g[0] == g[1] && b[0] == b[1])
+        {
+            out[1] = r[0];
+            out[2] = g[0];
+            out[3] = b[0];
+            return 4;
+        }
+        out[1] = r[0];
+        out[2] = r[1];
+        out[3] = g[0];
+        out[4] = g[1];
+        out[5] = b[0];
+        out[6] = b[1];
+        return 7;
     }
 
+    int red() const { return (rgba >> 24) & 0xFF; }
+    int green() const { return (rgba >> 16) & 0xFF; }
+    int blue() const { return (rgba >> 8) & 0xFF; }
+    int alpha() const { return rgba & 0xFF; }
+    double opacity() const { return alpha() / 255.0; }
+    bool isTransparent() const { return alpha() == 0; }
+    bool isOpaque() const { return alpha() == 0xFF; }
+    std::uint32_t packed() const { return rgba; }
+
+    bool operator==(Color const &other) const { return rgba == other.rgba; }
+    bool operator!=(Color const &other) const { return rgba != other.rgba; }
+
+    static std::size_t const maxLength = 7;
+
    private:
-    bool transparent;
-    int red;
-    int green;
-    int blue;
+    std::uint32_t rgba;
 
-    void assign(int r, int g, int b)
+    static constexpr std::uint32_t channel(int value)
+    {
+        return value < 0     ? 0u
+               : value > 255 ? 255u
+                             : static_cast<std::uint32_t>(value);
+    }
+    static constexpr std::uint32_t pack(int r, int g, int b, int a = 255)
+    {
+        return channel(r) << 24 | channel(g) << 16 | channel(b) << 8 |
+               channel(a);
+    }
+    static constexpr std::uint32_t defaultRgba(Defaults color)
     {
-        red = r;
-        green = g;
-        blue = b;
+        return color == Aqua      ? pack(0, 255, 255)
+               : color == Black   ? pack(0, 0, 0)
+               : color == Blue    ? pack(0, 0, 255)
+               : color == Brown   ? pack(165, 42, 42)
+               : color == Cyan    ? pack(0, 255, 255)
+               : color == Fuchsia ? pack(255, 0, 255)
+               : color == Green   ? pack(0, 128, 0)
+               : color == Lime    ? pack(0, 255, 0)
+               : color == Magenta ? pack(255, 0, 255)
+               : color == Orange  ? pack(255, 165, 0)
+               : color == Purple  ? pack(128, 0, 128)
+               : color == Red     ? pack(255, 0, 0)
+               : color == Silver  ? pack(192, 192, 192)
+               : color == White   ? pack(255, 255, 255)
+               : color == Yellow  ? pack(255, 255, 0)
+                                  : 0u;
     }
 };
 
+// Appends name="color" and, for translucent colors, name-opacity="alpha".
+inline void appendColorAttribute(std::string &out, char const *name,
+                                 Color const &color)
+{
+    out += name;
+    out += "=\"";
+    color.appendTo(out);
+    out += "\" ";
+    if (!color.isOpaque() && !color.isTransparent())
+    {
+        out += name;
+        appendAttribute(out, "-opacity", color.opacity());
+    }
+}
+
 class Fill : public Serializeable
 {
    public:
@@ -327,11 +901,17 @@ class Fill : public Serializeable
 
     std::string toString(Layout const &layout) const override
     {
-        std::stringstream ss;
-        ss << attribute("fill", color.toString(layout));
-        return ss.str();
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &) const
+    {
+        appendColorAttribute(out, "fill", color);
     }
 
+    Color const &getColor() const { return color; }
+
    private:
     Color color;
 };
@@ -352,17 +932,29 @@ class Stroke : public Serializeable
     }
 
     std::string toString(Layout const &layout) const override
+    {
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const
     {
         // If stroke width is invalid.
-        if (width < 0) return std::string();
+        if (width < 0) return;
 
-        std::stringstream ss;
-        ss << attribute("stroke-width", translateScale(width, layout))
-           << attribute("stroke", color.toString(layout));
-        if (nonScaling) ss << attribute("vector-effect", "non-scaling-stroke");
-        return ss.str();
+        // Under a delegated transform a non-scaling width stays in pixels.
+        double const scale = nonScaling && layout.delegated
+                                 ? layout.outer_scale
+                                 : layout.scale;
+        appendAttribute(out, "stroke-width", width * scale);
+        appendColorAttribute(out, "stroke", color);
+        if (nonScaling) out += "vector-effect=\"non-scaling-stroke\" ";
     }
 
+    double getWidth() const { return width; }
+    Color const &getColor() const { return color; }
+    bool isNonScaling() const { return nonScaling; }
+
    private:
     double width;
     Color color;
@@ -378,13 +970,20 @@ class Font : public Serializeable
     }
     std::string toString(Layout const &layout) const override
     {
-        std::stringstream ss;
-        ss << attribute("font-size", translateScale(size, layout))
-           << attribute("font-family", family);
-        return ss.str();
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const
+    {
+        appendAttribute(out, "font-size", translateScale(size, layout));
+        out += "font-family=\"";
+        appendXmlEscaped(out, family.data(), family.size());
+        out += "\" ";
     }
 
     double getSize() const { return size; }
+    std::string const &getFamily() const { return family; }
 
    private:
     double size;
@@ -403,13 +1002,76 @@ class Shape : public Serializeable
 
     virtual ~Shape() override {}
     virtual std::string toString(Layout const &layout) const override = 0;
+    // Appends what toString() returns.  The built-in shapes write straight
+    //  into out, so without clipping or quantization rendering into a reused
+    //  buffer does not allocate once the buffer has grown to size.  Heatmap
+    //  is the exception: its merge pass needs scratch space.
+    virtual void appendTo(std::string &out, Layout const &layout) const
+    {
+        out += toString(layout);
+    }
     virtual void offset(Point const &offset) = 0;
 
+    // Used to break render statistics down by shape type.
+    virtual char const *shapeName() const { return "Shape"; }
+    virtual std::size_t pointCount() const { return 0; }
+
    protected:
     Fill fill;
     Stroke stroke;
 };
 
+namespace detail
+{
+// Appends element to out and adds the cost to stats under its shape name.
+inline void instrumentedAppend(Serializeable const &element,
+                               Layout const &layout, RenderStats &stats,
+                               std::string &out)
+{
+    Shape const *shape = dynamic_cast<Shape const *>(&element);
+    std::size_t const start_size = out.size();
+    std::uint64_t allocations_before = allocationCount();
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    if (shape)
+        shape->appendTo(out, layout);
+    else
+        out += element.toString(layout);
+    std::uint64_t nanoseconds = elapsedNanoseconds(start);
+    std::uint64_t allocations = allocationCount() - allocations_before;
+
+    ShapeStats &entry = stats.shapes[shape ? shape->shapeName() : "Other"];
+    entry.elements += 1;
+    entry.points += shape ? shape->pointCount() : 0;
+    entry.bytes += out.size() - start_size;
+    entry.nanoseconds += nanoseconds;
+    entry.allocations += allocations;
+    stats.allocations += allocations;
+    stats.format_nanoseconds += nanoseconds;
+}
+inline std::string instrumentedToString(Serializeable const &element,
+                                        Layout const &layout,
+                                        RenderStats &stats)
+{
+    std::string ret;
+    instrumentedAppend(element, layout, stats, ret);
+    return ret;
+}
+
+// Hooks into FragmentCache::global(), defined with it at the end of this
+//  header.  findFragment appends the cached SVG of element to out; on a miss
+//  key is what storeFragment needs afterwards, empty if the cache is off or
+//  element is not looked up.  Nested elements are only looked up when they
+//  are collections or charts.
+inline bool findFragment(Serializeable const &element, Layout const &layout,
+                         bool nested, std::string &key, std::string &out);
+inline void storeFragment(std::string const &key, std::string const &svg);
+// Adds element, found in the cache as bytes of SVG in nanoseconds, to
+//  stats.  Defined after ShapeColl.
+inline void recordCached(Serializeable const &element, std::size_t bytes,
+                         std::uint64_t nanoseconds, RenderStats &stats);
+}  // namespace detail
+
 class ShapeColl : public Shape
 {
    public:
@@ -425,11 +1087,55 @@ class ShapeColl : public Shape
     }
 
     std::string toString(Layout const &layout) const override
+    {
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        for (const auto &element : elements)
+        {
+            std::string key;
+            if (detail::findFragment(*element, layout, true, key, out))
+                continue;
+
+            std::size_t const start = out.size();
+            if (Shape const *shape =
+                    dynamic_cast<Shape const *>(element.get()))
+                shape->appendTo(out, layout);
+            else
+                out += element->toString(layout);
+            if (!key.empty()) detail::storeFragment(key, out.substr(start));
+        }
+    }
+    // As above, adding the cost of every contained shape to stats.  Nested
+    //  collections are broken down to their leaf shapes.
+    std::string toString(Layout const &layout, RenderStats &stats) const
     {
         std::string ret;
         for (const auto &element : elements)
         {
-            ret += element->toString(layout);
+            std::string key;
+            std::size_t const start = ret.size();
+            std::chrono::steady_clock::time_point const lookup =
+                std::chrono::steady_clock::now();
+            if (detail::findFragment(*element, layout, true, key, ret))
+            {
+                detail::recordCached(*element, ret.size() - start,
+                                     detail::elapsedNanoseconds(lookup),
+                                     stats);
+                continue;
+            }
+
+            std::string node;
+            if (ShapeColl const *coll =
+                    dynamic_cast<ShapeColl const *>(element.get()))
+                node = coll->toString(layout, stats);
+            else
+                node = detail::instrumentedToString(*element, layout, stats);
+            detail::storeFragment(key, node);
+            ret += node;
         }
         return ret;
     }
@@ -445,553 +1151,6320 @@ class ShapeColl : public Shape
         }
     }
 
+    std::size_t size() const { return elements.size(); }
+    bool empty() const { return elements.empty(); }
+    std::shared_ptr<Serializeable> const &operator[](std::size_t index) const
+    {
+        return elements[index];
+    }
+
+    char const *shapeName() const override { return "ShapeColl"; }
+    std::size_t pointCount() const override
+    {
+        std::size_t count = 0;
+        for (const auto &element : elements)
+        {
+            Shape const *shape = dynamic_cast<Shape const *>(element.get());
+            if (shape) count += shape->pointCount();
+        }
+        return count;
+    }
+
    private:
     std::vector<std::shared_ptr<Serializeable>> elements;
+
+    friend class StyleMerger;
+    friend class OverdrawCuller;
 };
 
-template <typename T>
-inline std::string vectorToString(std::vector<T> collection,
-                                  Layout const &layout)
+namespace detail
 {
-    std::string combination_str;
-    for (unsigned i = 0; i < collection.size(); ++i)
-        combination_str += collection[i].toString(layout);
-
-    return combination_str;
+// The elements and points of a cached collection count per leaf shape, as
+//  its rendering would have.
+inline void countCachedShapes(Serializeable const &element, RenderStats &stats)
+{
+    if (ShapeColl const *coll = dynamic_cast<ShapeColl const *>(&element))
+    {
+        for (std::size_t i = 0; i < coll->size(); ++i)
+            countCachedShapes(*(*coll)[i], stats);
+        return;
+    }
+    Shape const *shape = dynamic_cast<Shape const *>(&element);
+    ShapeStats &entry = stats.shapes[shape ? shape->shapeName() : "Other"];
+    entry.elements += 1;
+    entry.points += shape ? shape->pointCount() : 0;
+}
+inline void recordCached(Serializeable const &element, std::size_t bytes,
+                         std::uint64_t nanoseconds, RenderStats &stats)
+{
+    countCachedShapes(element, stats);
+    Shape const *shape = dynamic_cast<Shape const *>(&element);
+    ShapeStats &entry = stats.shapes[shape ? shape->shapeName() : "Other"];
+    entry.bytes += bytes;
+    entry.nanoseconds += nanoseconds;
+    stats.format_nanoseconds += nanoseconds;
+    ++stats.cache_hits;
 }
+}  // namespace detail
 
-class Circle : public Shape
+// A <g> element around other shapes.  transform is written as given, in SVG
+//  syntax; it applies to the coordinates the shapes are written in, SVG
+//  space normally and user space under a delegated transform.
+class Group : public Shape
 {
    public:
-    Circle(Point const &center, double diameter, Fill const &fill = Fill(),
-           Stroke const &stroke = Stroke())
-        : Shape(fill, stroke), center(center), radius(diameter / 2)
+    explicit Group(std::string const &transform = std::string())
+        : transform(transform)
     {
     }
-    std::string toString(Layout const &layout) const override
+
+    template <typename T>
+    Group &operator<<(const T &serializeable)
     {
-        std::stringstream ss;
-        ss << elemStart("circle")
-           << attribute("cx", translateX(center.x, layout))
-           << attribute("cy", translateY(center.y, layout))
-           << attribute("r", translateScale(radius, layout))
-           << fill.toString(layout) << stroke.toString(layout)
-           << emptyElemEnd();
-        return ss.str();
+        children << serializeable;
+        return *this;
     }
-    void offset(Point const &offset) override
+
+    std::string toString(Layout const &layout) const override
     {
-        center.x += offset.x;
-        center.y += offset.y;
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        out += "\t<g";
+        if (!transform.empty())
+        {
+            out += " transform=\"";
+            appendXmlEscaped(out, transform.data(), transform.size());
+            out += '"';
+        }
+        out += ">\n";
+        children.appendTo(out, layout);
+        out += "\t</g>\n";
+    }
+    void offset(Point const &offset) override { children.offset(offset); }
+
+    std::size_t size() const { return children.size(); }
+    bool empty() const { return children.empty(); }
+    std::shared_ptr<Serializeable> const &operator[](std::size_t index) const
+    {
+        return children[index];
     }
 
+    char const *shapeName() const override { return "Group"; }
+    std::size_t pointCount() const override { return children.pointCount(); }
+
    private:
-    Point center;
-    double radius;
+    std::string transform;
+    ShapeColl children;
 };
 
-class Elipse : public Shape
+template <typename T>
+inline std::string vectorToString(std::vector<T> collection,
+                                  Layout const &layout)
 {
-   public:
-    Elipse(Point const &center, double width, double height,
-           Fill const &fill = Fill(), Stroke const &stroke = Stroke())
-        : Shape(fill, stroke),
-          center(center),
-          radius_width(width / 2),
-          radius_height(height / 2)
-    {
-    }
-    std::string toString(Layout const &layout) const override
+    std::string combination_str;
+    for (unsigned i = 0; i < collection.size(); ++i)
+        combination_str += collection[i].toString(layout);
+
+    return combination_str;
+}
+
+namespace detail
+{
+// Visible area in SVG space, widened by margin on every side.  Under a
+//  delegated transform, where shapes are written in user units, the
+//  viewport is mapped back to them.
+struct ClipRect
+{
+    ClipRect(Layout const &layout, double margin)
+        : left(-margin),
+          top(-margin),
+          right(layout.dimensions.width + margin),
+          bottom(layout.dimensions.height + margin)
     {
-        std::stringstream ss;
-        ss << elemStart("ellipse")
-           << attribute("cx", translateX(center.x, layout))
-           << attribute("cy", translateY(center.y, layout))
-           << attribute("rx", translateScale(radius_width, layout))
-           << attribute("ry", translateScale(radius_height, layout))
-           << fill.toString(layout) << stroke.toString(layout)
-           << emptyElemEnd();
-        return ss.str();
+        if (!layout.delegated) return;
+
+        LayoutTransform const m = layoutTransform(outerLayout(layout));
+        double const x0 = -m.e / m.a;
+        double const x1 = (layout.dimensions.width - m.e) / m.a;
+        double const y0 = -m.f / m.d;
+        double const y1 = (layout.dimensions.height - m.f) / m.d;
+        left = std::min(x0, x1) - margin;
+        right = std::max(x0, x1) + margin;
+        top = std::min(y0, y1) - margin;
+        bottom = std::max(y0, y1) + margin;
     }
-    void offset(Point const &offset) override
+    bool contains(Point const &point) const
     {
-        center.x += offset.x;
-        center.y += offset.y;
+        return point.x >= left && point.x <= right && point.y >= top &&
+               point.y <= bottom;
     }
-
-   private:
-    Point center;
-    double radius_width;
-    double radius_height;
+    double left;
+    double top;
+    double right;
+    double bottom;
 };
 
-class Rectangle : public Shape
+// Room needed outside the viewport so a clipped stroke never shows its cut
+//  end: a miter join reaches at most 2 widths (default limit 4) out.  Under
+//  a delegated transform this is in user units, where a pixel is
+//  1 / outer_scale.
+inline double strokeClipMargin(Stroke const &stroke, Layout const &layout)
 {
-   public:
-    Rectangle(Point const &edge, double width, double height,
-              Fill const &fill = Fill(), Stroke const &stroke = Stroke())
-        : Shape(fill, stroke), edge(edge), width(width), height(height)
+    double const pixel =
+        layout.delegated ? 1 / std::fabs(layout.outer_scale) : 1;
+    return stroke.getWidth() < 0
+               ? pixel
+               : 2 * translateScale(stroke.getWidth(), layout) + pixel;
+}
+
+template <typename L>
+struct ToSvgSpace
+{
+    template <typename P>
+    static void run(std::vector<Point> &out, std::vector<P> const &points,
+                    Layout const &layout)
     {
+        out.reserve(points.size());
+        for (auto const &point : points)
+            out.push_back(Point(L::x(point.x, layout), L::y(point.y, layout)));
     }
-    std::string toString(Layout const &layout) const override
-    {
-        std::stringstream ss;
-        double x = translateX(edge.x, layout);
-        double y = translateY(edge.y, layout);
-        double w = translateScale(width, layout);
-        double h = translateScale(height, layout);
+};
+
+template <typename T>
+inline std::vector<Point> toSvgSpace(std::vector<BasicPoint<T>> const &points,
+                                     Layout const &layout)
+{
+    std::vector<Point> ret;
+    withStaticLayout<ToSvgSpace>(layout, ret, points, layout);
+    return ret;
+}
 
-        // Adjust y-coordinate for top vs. bottom origin
-        if (layout.origin == Layout::TopLeft ||
-            layout.origin == Layout::TopRight)
+// Liang-Barsky: narrows [t0, t1] of the segment a-b to the part inside rect.
+//  Returns false if no part of the segment is inside.
+inline bool clipSegment(ClipRect const &rect, Point const &a, Point const &b,
+                        double &t0, double &t1)
+{
+    double const dx = b.x - a.x;
+    double const dy = b.y - a.y;
+    double const p[4] = {-dx, dx, -dy, dy};
+    double const q[4] = {a.x - rect.left, rect.right - a.x, a.y - rect.top,
+                         rect.bottom - a.y};
+    t0 = 0;
+    t1 = 1;
+    for (int i = 0; i < 4; ++i)
+    {
+        if (p[i] == 0)
+        {
+            if (q[i] < 0) return false;
+            continue;
+        }
+        double t = q[i] / p[i];
+        if (p[i] < 0)
         {
-            // No change needed for y
+            if (t > t1) return false;
+            if (t > t0) t0 = t;
         }
         else
         {
-            y -= h;
+            if (t < t0) return false;
+            if (t < t1) t1 = t;
         }
+    }
+    return true;
+}
+
+// Splits an open line into the pieces that are inside rect.
+inline std::vector<std::vector<Point>> clipPolyline(
+    std::vector<Point> const &points, ClipRect const &rect)
+{
+    std::vector<std::vector<Point>> pieces;
+    if (points.size() == 1 && rect.contains(points[0]))
+        pieces.push_back(points);
 
-        // Adjust x-coordinate for left vs. right origin
-        if (layout.origin == Layout::TopLeft ||
-            layout.origin == Layout::BottomLeft)
+    bool open = false;
+    for (std::size_t i = 1; i < points.size(); ++i)
+    {
+        Point const &a = points[i - 1];
+        Point const &b = points[i];
+        double t0, t1;
+        if (!clipSegment(rect, a, b, t0, t1))
         {
-            // No change needed for x
+            open = false;
+            continue;
         }
-        else
+        if (!open || t0 > 0)
         {
-            x -= w;
+            pieces.push_back(std::vector<Point>());
+            pieces.back().push_back(
+                t0 > 0 ? Point(a.x + t0 * (b.x - a.x), a.y + t0 * (b.y - a.y))
+                       : a);
         }
-
-        ss << elemStart("rect") << attribute("x", x) << attribute("y", y)
-           << attribute("width", w) << attribute("height", h)
-           << fill.toString(layout) << stroke.toString(layout)
-           << emptyElemEnd();
-        return ss.str();
-    }
-    void offset(Point const &offset) override
-    {
-        edge.x += offset.x;
-        edge.y += offset.y;
+        pieces.back().push_back(
+            t1 < 1 ? Point(a.x + t1 * (b.x - a.x), a.y + t1 * (b.y - a.y)) : b);
+        open = t1 == 1;
     }
+    return pieces;
+}
 
-   private:
-    Point edge;
-    double width;
-    double height;
-};
-
-class Line : public Shape
+// Signed distance of point to one edge of rect, positive on the inside.
+inline double edgeDistance(ClipRect const &rect, int edge, Point const &point)
 {
-   public:
-    Line(Point const &start_point, Point const &end_point,
-         Stroke const &stroke = Stroke())
-        : Shape(Fill(), stroke), start_point(start_point), end_point(end_point)
+    switch (edge)
     {
+        case 0:
+            return point.x - rect.left;
+        case 1:
+            return rect.right - point.x;
+        case 2:
+            return point.y - rect.top;
+        default:
+            return rect.bottom - point.y;
     }
-    std::string toString(Layout const &layout) const override
+}
+
+// Sutherland-Hodgman: the part of a closed polygon inside rect.  Parts of
+//  the result may run along the edges of rect, which are off screen.
+inline std::vector<Point> clipPolygon(std::vector<Point> const &points,
+                                      ClipRect const &rect)
+{
+    std::vector<Point> ret = points;
+    std::vector<Point> input;
+    for (int edge = 0; edge < 4 && !ret.empty(); ++edge)
     {
-        std::stringstream ss;
-        ss << elemStart("line")
-           << attribute("x1", translateX(start_point.x, layout))
-           << attribute("y1", translateY(start_point.y, layout))
-           << attribute("x2", translateX(end_point.x, layout))
-           << attribute("y2", translateY(end_point.y, layout))
-           << stroke.toString(layout) << emptyElemEnd();
-        return ss.str();
+        input.swap(ret);
+        ret.clear();
+        Point previous = input.back();
+        double previous_distance = edgeDistance(rect, edge, previous);
+        for (auto const &current : input)
+        {
+            double distance = edgeDistance(rect, edge, current);
+            if ((distance >= 0) != (previous_distance >= 0))
+            {
+                double t = previous_distance / (previous_distance - distance);
+                ret.push_back(Point(previous.x + t * (current.x - previous.x),
+                                    previous.y + t * (current.y - previous.y)));
+            }
+            if (distance >= 0) ret.push_back(current);
+            previous = current;
+            previous_distance = distance;
+        }
     }
-    void offset(Point const &offset) override
+    return ret;
+}
+
+// Snaps SVG-space points to multiples of quantum and drops each point that
+//  equals its predecessor or lies on the straight continuation between its
+//  neighbors.  Neither changes what is drawn.  Returns the number dropped.
+inline std::size_t quantizePoints(std::vector<Point> &points, double quantum)
+{
+    // Grid coordinates are integers, so the tests below are exact.  Beyond
+    //  2^31 cells the cross product could overflow; only duplicates go then.
+    long long const limit = 1LL << 31;
+    std::size_t kept = 0;
+    long long ax = 0, ay = 0, bx = 0, by = 0;
+    for (std::size_t i = 0; i < points.size(); ++i)
     {
-        start_point.x += offset.x;
-        start_point.y += offset.y;
+        long long cx = std::llround(points[i].x / quantum);
+        long long cy = std::llround(points[i].y / quantum);
+        if (kept > 0 && cx == bx && cy == by) continue;
 
-        end_point.x += offset.x;
-        end_point.y += offset.y;
+        bool small = cx > -limit && cx < limit && cy > -limit && cy < limit;
+        long long ux = bx - ax, uy = by - ay;
+        long long vx = cx - bx, vy = cy - by;
+        if (kept > 1 && small && ux * vy == uy * vx && ux * vx + uy * vy > 0)
+            --kept;  // b lies on the way from a to c
+        else
+        {
+            ax = bx;
+            ay = by;
+        }
+        bx = cx;
+        by = cy;
+        points[kept++] = Point(cx * quantum, cy * quantum);
     }
+    std::size_t removed = points.size() - kept;
+    points.resize(kept);
+    return removed;
+}
 
-   private:
-    Point start_point;
-    Point end_point;
-};
+inline bool needsGeometryPass(Layout const &layout)
+{
+    return layout.clip || layout.quantum > 0;
+}
 
-class Polygon : public Shape
+// Points in SVG space after the optional clip and quantize passes.  An open
+//  line may be split in several pieces by clipping; a closed one (polygon)
+//  never is.  Pieces that are clipped away entirely are not returned.
+template <typename T>
+inline std::vector<std::vector<Point>> geometryPass(
+    std::vector<BasicPoint<T>> const &points, Layout const &layout,
+    bool closed, bool clip, double clip_margin)
 {
-   public:
-    explicit Polygon(Fill const &fill = Fill(), Stroke const &stroke = Stroke())
-        : Shape(fill, stroke)
+    std::vector<std::vector<Point>> pieces;
+    if (!clip)
+        pieces.push_back(toSvgSpace(points, layout));
+    else if (closed)
     {
+        pieces.push_back(clipPolygon(toSvgSpace(points, layout),
+                                     ClipRect(layout, clip_margin)));
+        if (pieces.back().empty()) pieces.clear();
     }
+    else
+        pieces = clipPolyline(toSvgSpace(points, layout),
+                              ClipRect(layout, clip_margin));
 
-    explicit Polygon(Stroke const &stroke = Stroke())
-        : Shape(Fill(Color::Transparent), stroke)
-    {
-    }
-    Polygon &operator<<(Point const &point)
+    if (layout.quantum > 0)
     {
-        points.push_back(point);
-        return *this;
+        std::size_t removed = 0;
+        for (auto &piece : pieces)
+            removed += quantizePoints(piece, layout.quantum);
+        if (layout.removed_points) *layout.removed_points += removed;
     }
-    std::string toString(Layout const &layout) const override
-    {
-        std::stringstream ss;
-        ss << elemStart("polygon");
-
-        ss << "points=\"";
-        for (unsigned i = 0; i < points.size(); ++i)
-            ss << translateX(points[i].x, layout) << ","
-               << translateY(points[i].y, layout) << " ";
-        ss << "\" ";
+    return pieces;
+}
 
-        ss << fill.toString(layout) << stroke.toString(layout)
-           << emptyElemEnd();
-        return ss.str();
-    }
-    void offset(Point const &offset) override
+template <typename L>
+struct AppendTranslated
+{
+    template <typename P>
+    static void run(std::string &out, std::vector<P> const &points,
+                    Layout const &layout)
     {
-        for (unsigned i = 0; i < points.size(); ++i)
+        for (auto const &point : points)
         {
-            points[i].x += offset.x;
-            points[i].y += offset.y;
+            appendNumber(out, L::x(point.x, layout));
+            out += ',';
+            appendNumber(out, L::y(point.y, layout));
+            out += ' ';
         }
     }
-
-   private:
-    std::vector<Point> points;
 };
 
-class Path : public Shape
+// As appendPointList, translating user space points for layout.
+template <typename T>
+inline void appendTranslatedPoints(std::string &out,
+                                   std::vector<BasicPoint<T>> const &points,
+                                   Layout const &layout)
 {
-   public:
-    explicit Path(Fill const &fill = Fill(), Stroke const &stroke = Stroke())
-        : Shape(fill, stroke)
+    withStaticLayout<AppendTranslated>(layout, out, points, layout);
+}
+
+// Shape::offset() for stored points.
+template <typename T>
+inline void offsetPoints(std::vector<BasicPoint<T>> &points,
+                         Point const &offset)
+{
+    for (auto &point : points)
+        point = BasicPoint<T>(Point(point.x + offset.x, point.y + offset.y));
+}
+
+// "x,y x,y " as used by points="..." and path data.
+inline void appendPointList(std::string &out, std::vector<Point> const &points)
+{
+    for (auto const &point : points)
     {
-        startNewSubPath();
+        appendNumber(out, point.x);
+        out += ',';
+        appendNumber(out, point.y);
+        out += ' ';
     }
+}
 
-    explicit Path(Stroke const &stroke = Stroke())
-        : Shape(Fill(Color::Transparent), stroke)
+// Appends the points of the cubic p0 c1 c2 p3 after p0, on a polyline
+//  that stays within tolerance of the curve.  The step count is the
+//  usual bound from the curve's second differences.  p0 is copied, as it
+//  is often out.back().
+inline void flattenCubic(std::vector<Point> &out, Point const p0,
+                         Point const &c1, Point const &c2, Point const &p3,
+                         double tolerance)
+{
+    double const dx = std::max(std::fabs(p0.x - 2 * c1.x + c2.x),
+                               std::fabs(c1.x - 2 * c2.x + p3.x));
+    double const dy = std::max(std::fabs(p0.y - 2 * c1.y + c2.y),
+                               std::fabs(c1.y - 2 * c2.y + p3.y));
+    double const steps =
+        std::ceil(std::sqrt(0.75 * std::sqrt(dx * dx + dy * dy) / tolerance));
+    std::size_t const count =
+        steps >= 1 ? static_cast<std::size_t>(std::min(steps, 1e4)) : 1;
+    for (std::size_t i = 1; i < count; ++i)
     {
-        startNewSubPath();
+        double const t = static_cast<double>(i) / count;
+        double const s = 1 - t;
+        double const b0 = s * s * s, b1 = 3 * s * s * t, b2 = 3 * s * t * t,
+                     b3 = t * t * t;
+        out.push_back(Point(b0 * p0.x + b1 * c1.x + b2 * c2.x + b3 * p3.x,
+                            b0 * p0.y + b1 * c1.y + b2 * c2.y + b3 * p3.y));
     }
-    Path &operator<<(Point const &point)
+    out.push_back(p3);
+}
+
+// Path data for a subpath in SVG space: "M" and its first point, then
+//  implicit line-tos, with "C" before each run of cubic segments and "L"
+//  before straight points that follow one.  curves holds the indices of
+//  the points that start a segment's control, control, end triple.
+inline void appendSegments(std::string &out, std::vector<Point> const &points,
+                           std::vector<std::size_t> const &curves)
+{
+    out += 'M';
+    char command = 'L';
+    std::size_t next_curve = 0;
+    for (std::size_t i = 0; i < points.size(); ++i)
     {
-        paths.back().push_back(point);
-        return *this;
+        bool const curve =
+            next_curve < curves.size() && curves[next_curve] == i;
+        if (curve && command != 'C')
+        {
+            command = 'C';
+            out += command;
+        }
+        else if (!curve && command != 'L' &&
+                 i >= curves[next_curve - 1] + 3)
+        {
+            command = 'L';
+            out += command;
+        }
+        if (curve) ++next_curve;
+        appendNumber(out, points[i].x);
+        out += ',';
+        appendNumber(out, points[i].y);
+        out += ' ';
     }
+}
 
-    void startNewSubPath()
+// Least squares cubic Bezier fitting after Schneider ("An Algorithm for
+//  Automatically Fitting Digitized Curves", Graphics Gems, 1990): fit one
+//  cubic to the points, and where some point is further than tolerance
+//  from it even after refining the parameters, split there and fit the
+//  halves with a shared tangent.  Returns the first point followed by the
+//  control, control, end triple of each segment.
+class CurveFitter
+{
+   public:
+    template <typename T>
+    CurveFitter(std::vector<BasicPoint<T>> const &points, double tolerance)
+        : squared_tolerance(tolerance * tolerance)
     {
-        if (paths.empty() || 0 < paths.back().size()) paths.emplace_back();
+        // Consecutive duplicates have no tangent.
+        for (auto const &point : points)
+            if (data.empty() || point.x != data.back().x ||
+                point.y != data.back().y)
+                data.push_back(Point(point));
     }
 
-    std::string toString(Layout const &layout) const override
+    std::vector<Point> fit()
     {
-        std::stringstream ss;
-        ss << elemStart("path");
+        std::vector<Point> ret;
+        if (data.empty()) return ret;
+        ret.push_back(data[0]);
+        std::size_t const last = data.size() - 1;
+        if (last == 0) return ret;
 
-        ss << "d=\"";
-        for (auto const &subpath : paths)
+        // Ranges still to fit, the next one to the left at the back.
+        std::vector<Range> pending;
+        pending.push_back(Range(0, last, unit(data[1] - data[0]),
+                                unit(data[last - 1] - data[last])));
+        while (!pending.empty())
         {
-            if (subpath.empty()) continue;
-
-            ss << "M";
-            for (auto const &point : subpath)
-                ss << translateX(point.x, layout) << ","
-                   << translateY(point.y, layout) << " ";
-            ss << "z ";
-        }
-        ss << "\" ";
-        ss << "fill-rule=\"evenodd\" ";
-
-        ss << fill.toString(layout) << stroke.toString(layout)
-           << emptyElemEnd();
-        return ss.str();
-    }
+            Range const range = pending.back();
+            pending.pop_back();
 
-    void offset(Point const &offset) override
-    {
-        for (auto &subpath : paths)
-            for (auto &point : subpath)
+            Point bezier[4];
+            std::size_t split = 0;
+            if (fitRange(range, bezier, split))
             {
-                point.x += offset.x;
-                point.y += offset.y;
+                ret.push_back(bezier[1]);
+                ret.push_back(bezier[2]);
+                ret.push_back(bezier[3]);
+                continue;
             }
+            Point center = unit(data[split - 1] - data[split + 1]);
+            if (center.x == 0 && center.y == 0)
+                center = unit(data[split - 1] - data[split]);
+            pending.push_back(
+                Range(split, range.last, scaled(center, -1), range.right));
+            pending.push_back(Range(range.first, split, range.left, center));
+        }
+        return ret;
     }
 
    private:
-    std::vector<std::vector<Point>> paths;
-};
+    struct Range
+    {
+        Range(std::size_t first, std::size_t last, Point const &left,
+              Point const &right)
+            : first(first), last(last), left(left), right(right)
+        {
+        }
+        std::size_t first;
+        std::size_t last;
+        // Unit tangents pointing into the range at either end.
+        Point left;
+        Point right;
+    };
 
-class Polyline : public Shape
-{
-   public:
-    explicit Polyline(Fill const &fill = Fill(),
-                      Stroke const &stroke = Stroke())
-        : Shape(fill, stroke)
+    std::vector<Point> data;
+    std::vector<double> u;
+    double squared_tolerance;
+
+    static Point scaled(Point const &p, double factor)
     {
+        return Point(p.x * factor, p.y * factor);
     }
-
-    explicit Polyline(Stroke const &stroke = Stroke())
-        : Shape(Fill(Color::Transparent), stroke)
+    static double dot(Point const &a, Point const &b)
+    {
+        return a.x * b.x + a.y * b.y;
+    }
+    static Point unit(Point const &p)
+    {
+        double const length = std::sqrt(dot(p, p));
+        return length > 0 ? scaled(p, 1 / length) : p;
+    }
+    static Point evaluate(Point const *bezier, int degree, double t)
     {
+        Point work[4];
+        for (int i = 0; i <= degree; ++i) work[i] = bezier[i];
+        for (int level = 1; level <= degree; ++level)
+            for (int i = 0; i <= degree - level; ++i)
+                work[i] = scaled(work[i], 1 - t) + scaled(work[i + 1], t);
+        return work[0];
     }
 
-    explicit Polyline(std::vector<Point> const &points,
-                      Fill const &fill = Fill(),
-                      Stroke const &stroke = Stroke())
-        : Shape(fill, stroke), points(points)
+    // False with the point to split at if the range needs more segments.
+    bool fitRange(Range const &range, Point *bezier, std::size_t &split)
     {
+        Point const &first = data[range.first];
+        Point const &last = data[range.last];
+        if (range.last - range.first == 1)
+        {
+            double const third = std::sqrt(dot(last - first, last - first)) / 3;
+            bezier[0] = first;
+            bezier[1] = first + scaled(range.left, third);
+            bezier[2] = last + scaled(range.right, third);
+            bezier[3] = last;
+            return true;
+        }
+
+        chordLengths(range);
+        generate(range, bezier);
+        double error = maxError(range, bezier, split);
+        if (error <= squared_tolerance) return true;
+        if (error > 16 * squared_tolerance) return false;
+
+        for (int iteration = 0; iteration < 4; ++iteration)
+        {
+            reparameterize(range, bezier);
+            generate(range, bezier);
+            error = maxError(range, bezier, split);
+            if (error <= squared_tolerance) return true;
+        }
+        return false;
     }
 
-    Polyline &operator<<(Point const &point)
+    void chordLengths(Range const &range)
     {
-        points.push_back(point);
-        return *this;
+        u.assign(1, 0);
+        for (std::size_t i = range.first + 1; i <= range.last; ++i)
+        {
+            Point const d = data[i] - data[i - 1];
+            u.push_back(u.back() + std::sqrt(dot(d, d)));
+        }
+        for (auto &t : u) t /= u.back();
     }
-    std::string toString(Layout const &layout) const override
+
+    // Control points along the end tangents at the distances that
+    //  minimize the squared error at the parameters in u.
+    void generate(Range const &range, Point *bezier) const
     {
-        std::stringstream ss;
-        ss << elemStart("polyline");
+        Point const &first = data[range.first];
+        Point const &last = data[range.last];
+        double c00 = 0, c01 = 0, c11 = 0, x0 = 0, x1 = 0;
+        for (std::size_t i = 0; i < u.size(); ++i)
+        {
+            double const t = u[i];
+            double const s = 1 - t;
+            double const b0 = s * s * s, b1 = 3 * s * s * t,
+                         b2 = 3 * s * t * t, b3 = t * t * t;
+            Point const a0 = scaled(range.left, b1);
+            Point const a1 = scaled(range.right, b2);
+            c00 += dot(a0, a0);
+            c01 += dot(a0, a1);
+            c11 += dot(a1, a1);
+            Point const rest =
+                data[range.first + i] -
+                (scaled(first, b0 + b1) + scaled(last, b2 + b3));
+            x0 += dot(a0, rest);
+            x1 += dot(a1, rest);
+        }
 
-        ss << "points=\"";
-        for (unsigned i = 0; i < points.size(); ++i)
-            ss << translateX(points[i].x, layout) << ","
-               << translateY(points[i].y, layout) << " ";
-        ss << "\" ";
+        double const det = c00 * c11 - c01 * c01;
+        double alpha_left = det != 0 ? (x0 * c11 - x1 * c01) / det : 0;
+        double alpha_right = det != 0 ? (c00 * x1 - c01 * x0) / det : 0;
+        double const length = std::sqrt(dot(last - first, last - first));
+        double const epsilon = 1e-6 * length;
+        if (!(alpha_left > epsilon) || !(alpha_right > epsilon))
+            alpha_left = alpha_right = length / 3;
 
-        ss << fill.toString(layout) << stroke.toString(layout)
-           << emptyElemEnd();
-        return ss.str();
+        bezier[0] = first;
+        bezier[1] = first + scaled(range.left, alpha_left);
+        bezier[2] = last + scaled(range.right, alpha_right);
+        bezier[3] = last;
     }
-    void offset(Point const &offset) override
+
+    // Largest squared distance from a point to the curve at its parameter,
+    //  and where it is.
+    double maxError(Range const &range, Point const *bezier,
+                    std::size_t &split) const
+    {
+        double max = 0;
+        split = (range.first + range.last) / 2;
+        for (std::size_t i = 1; i + 1 < u.size(); ++i)
+        {
+            Point const d = evaluate(bezier, 3, u[i]) - data[range.first + i];
+            double const error = dot(d, d);
+            if (error > max)
+            {
+                max = error;
+                split = range.first + i;
+            }
+        }
+        return max;
+    }
+
+    // One Newton-Raphson step towards the closest point for each parameter.
+    void reparameterize(Range const &range, Point const *bezier)
     {
-        for (unsigned i = 0; i < points.size(); ++i)
+        Point first_derivative[3], second_derivative[2];
+        for (int i = 0; i < 3; ++i)
+            first_derivative[i] = scaled(bezier[i + 1] - bezier[i], 3);
+        for (int i = 0; i < 2; ++i)
+            second_derivative[i] =
+                scaled(first_derivative[i + 1] - first_derivative[i], 2);
+
+        for (std::size_t i = 1; i + 1 < u.size(); ++i)
         {
-            points[i].x += offset.x;
-            points[i].y += offset.y;
+            Point const d = evaluate(bezier, 3, u[i]) - data[range.first + i];
+            Point const d1 = evaluate(first_derivative, 2, u[i]);
+            Point const d2 = evaluate(second_derivative, 1, u[i]);
+            double const denominator = dot(d1, d1) + dot(d, d2);
+            if (denominator == 0) continue;
+            double const t = u[i] - dot(d, d1) / denominator;
+            u[i] = std::min(1.0, std::max(0.0, t));
         }
     }
-    std::vector<Point> points;
 };
+}  // namespace detail
 
-class Text : public Shape
+class Circle : public Shape
 {
    public:
-    Text(Point const &origin, std::string const &content,
-         Fill const &fill = Fill(), Font const &font = Font(),
-         Stroke const &stroke = Stroke())
-        : Shape(fill, stroke), origin(origin), content(content), font(font)
+    Circle(Point const &center, double diameter, Fill const &fill = Fill(),
+           Stroke const &stroke = Stroke())
+        : Shape(fill, stroke), center(center), radius(diameter / 2)
     {
     }
     std::string toString(Layout const &layout) const override
     {
-        std::stringstream ss;
-        Box bbox = getBoundingBox();
-        double x = translateX(origin.x, layout);
-        double y = translateY(origin.y, layout);
-
-        // Adjust position based on layout origin
-        switch (layout.origin)
-        {
-            case Layout::TopLeft:
-                y += bbox.size.height;
-                break;
-            case Layout::TopRight:
-                x -= bbox.size.width;
-                y += bbox.size.height;
-                break;
-            case Layout::BottomRight:
-                x -= bbox.size.width;
-                break;
-            case Layout::BottomLeft:
-                // No adjustment needed
-                break;
-        }
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        if (layout.clip && !isVisible(layout)) return;
 
-        ss << elemStart("text") << attribute("x", x) << attribute("y", y)
-           << fill.toString(layout) << stroke.toString(layout)
-           << font.toString(layout) << ">" << content << elemEnd("text");
-        return ss.str();
+        out += "\t<circle ";
+        appendAttribute(out, "cx", translateX(center.x, layout));
+        appendAttribute(out, "cy", translateY(center.y, layout));
+        appendAttribute(out, "r", translateScale(radius, layout));
+        fill.appendTo(out, layout);
+        stroke.appendTo(out, layout);
+        out += "/>\n";
     }
     void offset(Point const &offset) override
     {
-        origin.x += offset.x;
-        origin.y += offset.y;
+        center.x += offset.x;
+        center.y += offset.y;
     }
 
-    // Get the bounding box of the text
-    Box getBoundingBox() const
-    {
-        double width = measureTextWidth(content, font);
-        double height = measureTextHeight(font);
-        return Box(origin, Size(width, height));
-    }
+    char const *shapeName() const override { return "Circle"; }
+    std::size_t pointCount() const override { return 1; }
 
    private:
-    Point origin;
-    std::string content;
-    Font font;
+    Point center;
+    double radius;
 
-    double measureTextWidth(std::string const &text, Font const &font) const
+    bool isVisible(Layout const &layout) const
     {
-        // Implement text width measurement based on font
-        return text.length() * font.getSize() / 1.5;  // approximation
+        double reach = translateScale(radius, layout) +
+                       detail::strokeClipMargin(stroke, layout);
+        return detail::ClipRect(layout, reach)
+            .contains(Point(translateX(center.x, layout),
+                            translateY(center.y, layout)));
     }
 
-    double measureTextHeight(Font const &font) const
-    {
-        // Implement text height measurement based on font
-        return font.getSize();  // approximation
-    }
+    friend class DisplayListWriter;
+    friend class OverdrawCuller;
 };
 
-// Sample charting class.
-class LineChart : public Shape
+class Elipse : public Shape
 {
    public:
-    explicit LineChart(Dimensions margin = Dimensions(), double scale = 1,
-                       Stroke const &axis_stroke = Stroke(.5, Color::Purple))
-        : axis_stroke(axis_stroke), margin(margin), scale(scale)
+    Elipse(Point const &center, double width, double height,
+           Fill const &fill = Fill(), Stroke const &stroke = Stroke())
+        : Shape(fill, stroke),
+          center(center),
+          radius_width(width / 2),
+          radius_height(height / 2)
     {
     }
-    LineChart &operator<<(Polyline const &polyline)
+    std::string toString(Layout const &layout) const override
     {
-        if (polyline.points.empty()) return *this;
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        out += "\t<ellipse ";
+        appendAttribute(out, "cx", translateX(center.x, layout));
+        appendAttribute(out, "cy", translateY(center.y, layout));
+        appendAttribute(out, "rx", translateScale(radius_width, layout));
+        appendAttribute(out, "ry", translateScale(radius_height, layout));
+        fill.appendTo(out, layout);
+        stroke.appendTo(out, layout);
+        out += "/>\n";
+    }
+    void offset(Point const &offset) override
+    {
+        center.x += offset.x;
+        center.y += offset.y;
+    }
 
-        polylines.push_back(polyline);
-        return *this;
+    char const *shapeName() const override { return "Elipse"; }
+    std::size_t pointCount() const override { return 1; }
+
+   private:
+    Point center;
+    double radius_width;
+    double radius_height;
+
+    friend class DisplayListWriter;
+    friend class OverdrawCuller;
+};
+
+class Rectangle : public Shape
+{
+   public:
+    Rectangle(Point const &edge, double width, double height,
+              Fill const &fill = Fill(), Stroke const &stroke = Stroke())
+        : Shape(fill, stroke), edge(edge), width(width), height(height)
+    {
     }
     std::string toString(Layout const &layout) const override
     {
-        if (polylines.empty()) return "";
-
         std::string ret;
-        for (unsigned i = 0; i < polylines.size(); ++i)
-            ret += polylineToString(polylines[i], layout);
-
-        return ret + axisString(layout);
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        out += "\t<rect ";
+        withStaticLayout<AppendBox>(layout, out, *this, layout);
+        fill.appendTo(out, layout);
+        stroke.appendTo(out, layout);
+        out += "/>\n";
     }
     void offset(Point const &offset) override
     {
-        for (unsigned i = 0; i < polylines.size(); ++i)
-            polylines[i].offset(offset);
+        edge.x += offset.x;
+        edge.y += offset.y;
     }
 
+    char const *shapeName() const override { return "Rectangle"; }
+    std::size_t pointCount() const override { return 1; }
+
    private:
-    Stroke axis_stroke;
-    Dimensions margin;
-    double scale;
-    std::vector<Polyline> polylines;
+    Point edge;
+    double width;
+    double height;
 
-    optional<Dimensions> getDimensions() const
+    // x, y, width and height.  edge is the corner nearest the origin, so a
+    //  flipped axis moves the SVG corner by the size.
+    template <typename L>
+    struct AppendBox
     {
-        if (polylines.empty()) return optional<Dimensions>();
-
-        optional<Point> min = getMinPoint(polylines[0].points);
-        optional<Point> max = getMaxPoint(polylines[0].points);
-        for (unsigned i = 0; i < polylines.size(); ++i)
+        static void run(std::string &out, Rectangle const &rect,
+                        Layout const &layout)
         {
-            if (getMinPoint(polylines[i].points)->x < min->x)
-                min->x = getMinPoint(polylines[i].points)->x;
-            if (getMinPoint(polylines[i].points)->y < min->y)
-                min->y = getMinPoint(polylines[i].points)->y;
-            if (getMaxPoint(polylines[i].points)->x > max->x)
-                max->x = getMaxPoint(polylines[i].points)->x;
-            if (getMaxPoint(polylines[i].points)->y > max->y)
-                max->y = getMaxPoint(polylines[i].points)->y;
+            double x = L::x(rect.edge.x, layout);
+            double y = L::y(rect.edge.y, layout);
+            double const w = translateScale(rect.width, layout);
+            double const h = translateScale(rect.height, layout);
+            if (L::flip_x) x -= w;
+            if (L::flip_y) y -= h;
+
+            appendAttribute(out, "x", x);
+            appendAttribute(out, "y", y);
+            appendAttribute(out, "width", w);
+            appendAttribute(out, "height", h);
         }
+    };
 
-        return optional<Dimensions>(
-            Dimensions(max->x - min->x, max->y - min->y));
+    friend class DisplayListWriter;
+    friend class StyleMerger;
+    friend class OverdrawCuller;
+};
+
+class Line : public Shape
+{
+   public:
+    Line(Point const &start_point, Point const &end_point,
+         Stroke const &stroke = Stroke())
+        : Shape(Fill(), stroke), start_point(start_point), end_point(end_point)
+    {
     }
-    std::string axisString(Layout const &layout) const
+    std::string toString(Layout const &layout) const override
     {
-        optional<Dimensions> dimensions = getDimensions();
-        if (!dimensions) return "";
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        out += "\t<line ";
+        appendAttribute(out, "x1", translateX(start_point.x, layout));
+        appendAttribute(out, "y1", translateY(start_point.y, layout));
+        appendAttribute(out, "x2", translateX(end_point.x, layout));
+        appendAttribute(out, "y2", translateY(end_point.y, layout));
+        stroke.appendTo(out, layout);
+        out += "/>\n";
+    }
+    void offset(Point const &offset) override
+    {
+        start_point.x += offset.x;
+        start_point.y += offset.y;
 
-        // Make the axis 10% wider and higher than the data points.
-        double width = dimensions->width * 1.1;
-        double height = dimensions->height * 1.1;
+        end_point.x += offset.x;
+        end_point.y += offset.y;
+    }
 
-        // Draw the axis.
-        Polyline axis(Fill(Color::Transparent), axis_stroke);
-        axis << Point(margin.width, margin.height + height)
-             << Point(margin.width, margin.height)
-             << Point(margin.width + width, margin.height);
+    char const *shapeName() const override { return "Line"; }
+    std::size_t pointCount() const override { return 2; }
 
-        return axis.toString(layout);
-    }
-    std::string polylineToString(Polyline const &polyline,
-                                 Layout const &layout) const
+   private:
+    Point start_point;
+    Point end_point;
+
+    friend class DisplayListWriter;
+    friend class StyleMerger;
+    friend class OverdrawCuller;
+};
+
+// The geometry classes are templates on the coordinate type T their points
+//  are stored as; Polygon, Path, Polyline and LineChart store double.
+//  Points are converted to double as they are written.
+template <typename T>
+class BasicPolygon : public Shape
+{
+   public:
+    explicit BasicPolygon(Fill const &fill = Fill(),
+                          Stroke const &stroke = Stroke())
+        : Shape(fill, stroke)
     {
-        Polyline shifted_polyline = polyline;
-        shifted_polyline.offset(Point(margin.width, margin.height));
+    }
 
-        std::vector<Circle> vertices;
-        for (unsigned i = 0; i < shifted_polyline.points.size(); ++i)
-            vertices.push_back(Circle(
-                shifted_polyline.points[i], getDimensions()->height / 30.0,
-                Fill(Color::Black)));  // Use Fill instead of direct Color
+    explicit BasicPolygon(Stroke const &stroke = Stroke())
+        : Shape(Fill(Color::Transparent), stroke)
+    {
+    }
+    template <typename U>
+    BasicPolygon &operator<<(BasicPoint<U> const &point)
+    {
+        points.push_back(BasicPoint<T>(point));
+        return *this;
+    }
+    std::string toString(Layout const &layout) const override
+    {
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        if (detail::needsGeometryPass(layout))
+        {
+            std::vector<std::vector<Point>> pieces = detail::geometryPass(
+                points, layout, true, layout.clip,
+                detail::strokeClipMargin(stroke, layout));
+            if (pieces.empty()) return;
 
-        return shifted_polyline.toString(layout) +
-               vectorToString(vertices, layout);
+            out += "\t<polygon points=\"";
+            detail::appendPointList(out, pieces[0]);
+        }
+        else
+        {
+            out += "\t<polygon points=\"";
+            detail::appendTranslatedPoints(out, points, layout);
+        }
+        out += "\" ";
+        fill.appendTo(out, layout);
+        stroke.appendTo(out, layout);
+        out += "/>\n";
+    }
+    void offset(Point const &offset) override
+    {
+        detail::offsetPoints(points, offset);
     }
+
+    char const *shapeName() const override { return "Polygon"; }
+    std::size_t pointCount() const override { return points.size(); }
+
+   private:
+    std::vector<BasicPoint<T>> points;
+
+    friend class DisplayListWriter;
+    friend class StyleMerger;
+    friend class OverdrawCuller;
 };
+typedef BasicPolygon<double> Polygon;
 
-class Document
+template <typename T>
+class BasicPath : public Shape
 {
    public:
-    Document() {};
-    explicit Document(std::string const &file_name,
-                      Layout const &layout = Layout())
-        : file_name(file_name), layout(layout)
+    explicit BasicPath(Fill const &fill = Fill(),
+                       Stroke const &stroke = Stroke())
+        : Shape(fill, stroke)
     {
+        startNewSubPath();
     }
 
-    Document &operator<<(Shape const &shape)
+    explicit BasicPath(Stroke const &stroke = Stroke())
+        : Shape(Fill(Color::Transparent), stroke)
+    {
+        startNewSubPath();
+    }
+    template <typename U>
+    BasicPath &operator<<(BasicPoint<U> const &point)
     {
-        body_nodes_str_list.push_back(shape.toString(layout));
+        paths.back().push_back(BasicPoint<T>(point));
         return *this;
     }
-    std::string toString() const
+    // A cubic Bezier segment from the last point.  On an empty subpath end
+    //  is only the starting point.
+    BasicPath &curveTo(Point const &control1, Point const &control2,
+                       Point const &end)
     {
-        std::stringstream ss;
-        writeToStream(ss);
-        return ss.str();
+        if (paths.back().empty()) return *this << end;
+
+        curves.back().push_back(paths.back().size());
+        paths.back().push_back(BasicPoint<T>(control1));
+        paths.back().push_back(BasicPoint<T>(control2));
+        paths.back().push_back(BasicPoint<T>(end));
+        return *this;
     }
-    bool save() const
+
+    // Subpaths are closed unless started with closed set to false.
+    void startNewSubPath(bool closed_subpath = true)
     {
-        std::ofstream ofs(file_name.c_str());
-        if (!ofs.good()) return false;
+        if (paths.empty() || 0 < paths.back().size())
+        {
+            paths.emplace_back();
+            curves.emplace_back();
+            closed.push_back(closed_subpath);
+        }
+        else
+            closed.back() = closed_subpath;
+    }
 
-        writeToStream(ofs);
-        ofs.close();
-        return true;
+    // Starts an open subpath of cubic segments that pass within tolerance
+    //  of every point, in user units (p / Layout::scale for p pixels).
+    //  Smooth dense data takes a few segments instead of one per point.
+    template <typename U>
+    BasicPath &addFittedCurve(std::vector<BasicPoint<U>> const &points,
+                              double tolerance)
+    {
+        std::vector<Point> const fitted =
+            detail::CurveFitter(points, tolerance).fit();
+        if (fitted.empty()) return *this;
+
+        startNewSubPath(false);
+        *this << fitted[0];
+        for (std::size_t i = 1; i + 2 < fitted.size(); i += 3)
+            curveTo(fitted[i], fitted[i + 1], fitted[i + 2]);
+        return *this;
     }
 
-   private:
-    void writeToStream(std::ostream &str) const
+    std::string toString(Layout const &layout) const override
+    {
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const override
     {
-        str << "<?xml " << attribute("version", "1.0")
-            << attribute("standalone", "no")
-            << "?>\n<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" "
-            << "\"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n<svg "
-            << attribute("width", layout.dimensions.width, "px")
-            << attribute("height", layout.dimensions.height, "px")
-            << attribute("xmlns", "http://www.w3.org/2000/svg")
-            << attribute("version", "1.1") << ">\n";
-        for (const auto &body_node_str : body_nodes_str_list)
+        if (detail::needsGeometryPass(layout))
         {
-            str << body_node_str;
+            std::string data = processedData(layout);
+            if (data.empty()) return;
+            out += "\t<path d=\"";
+            out += data;
+        }
+        else
+        {
+            out += "\t<path d=\"";
+            for (std::size_t i = 0; i < paths.size(); ++i)
+            {
+                if (paths[i].empty()) continue;
+
+                if (curves[i].empty())
+                {
+                    out += 'M';
+                    detail::appendTranslatedPoints(out, paths[i], layout);
+                }
+                else
+                    detail::appendSegments(
+                        out, detail::toSvgSpace(paths[i], layout), curves[i]);
+                if (closed[i]) out += "z ";
+            }
         }
-        str << elemEnd("svg");
+        out += "\" fill-rule=\"evenodd\" ";
+        fill.appendTo(out, layout);
+        stroke.appendTo(out, layout);
+        out += "/>\n";
+    }
+
+    void offset(Point const &offset) override
+    {
+        for (auto &subpath : paths) detail::offsetPoints(subpath, offset);
+    }
+
+    char const *shapeName() const override { return "Path"; }
+    std::size_t pointCount() const override
+    {
+        std::size_t count = 0;
+        for (auto const &subpath : paths) count += subpath.size();
+        return count;
+    }
+    std::size_t curveCount() const
+    {
+        std::size_t count = 0;
+        for (auto const &subpath : curves) count += subpath.size();
+        return count;
     }
 
    private:
-    std::string file_name;
-    Layout layout;
+    // Control points are stored in line with the others; curves holds the
+    //  index of the first control point of each cubic segment.
+    std::vector<std::vector<BasicPoint<T>>> paths;
+    std::vector<std::vector<std::size_t>> curves;
+    std::vector<bool> closed;
+
+    // The subpath with its curves flattened, for clipping and quantization.
+    std::vector<Point> flattened(std::size_t index, double tolerance) const
+    {
+        std::vector<BasicPoint<T>> const &subpath = paths[index];
+        std::vector<std::size_t> const &starts = curves[index];
+        if (starts.empty())
+            return std::vector<Point>(subpath.begin(), subpath.end());
+
+        std::vector<Point> ret;
+        std::size_t next_curve = 0;
+        for (std::size_t i = 0; i < subpath.size(); ++i)
+        {
+            if (next_curve < starts.size() && starts[next_curve] == i)
+            {
+                detail::flattenCubic(ret, ret.back(), Point(subpath[i]),
+                                     Point(subpath[i + 1]),
+                                     Point(subpath[i + 2]), tolerance);
+                i += 2;
+                ++next_curve;
+            }
+            else
+                ret.push_back(Point(subpath[i]));
+        }
+        return ret;
+    }
+
+    // Closed subpaths are clipped as polygons, open ones as polylines
+    //  unless filled.  Curves are flattened to a tenth of a pixel first.
+    std::string processedData(Layout const &layout) const
+    {
+        double const margin = detail::strokeClipMargin(stroke, layout);
+        double const tolerance = 0.1 / layout.scale;
+        std::string data;
+        for (std::size_t i = 0; i < paths.size(); ++i)
+        {
+            if (paths[i].empty()) continue;
+
+            std::vector<std::vector<Point>> pieces = detail::geometryPass(
+                flattened(i, tolerance), layout, closed[i],
+                layout.clip && (closed[i] || fill.getColor().isTransparent()),
+                margin);
+            for (auto const &piece : pieces)
+            {
+                data += 'M';
+                detail::appendPointList(data, piece);
+                // A clipped polygon is a single piece.
+                if (closed[i])
+                {
+                    data += "z ";
+                    break;
+                }
+            }
+        }
+        return data;
+    }
 
-    std::vector<std::string> body_nodes_str_list;
+    friend class DisplayListWriter;
+    friend class OverdrawCuller;
 };
+typedef BasicPath<double> Path;
+
+template <typename T>
+class BasicPolyline : public Shape
+{
+   public:
+    explicit BasicPolyline(Fill const &fill = Fill(),
+                           Stroke const &stroke = Stroke())
+        : Shape(fill, stroke)
+    {
+    }
+
+    explicit BasicPolyline(Stroke const &stroke = Stroke())
+        : Shape(Fill(Color::Transparent), stroke)
+    {
+    }
+
+    explicit BasicPolyline(std::vector<BasicPoint<T>> const &points,
+                           Fill const &fill = Fill(),
+                           Stroke const &stroke = Stroke())
+        : Shape(fill, stroke), points(points)
+    {
+    }
+    // The same line with coordinates stored as T.
+    template <typename U>
+    explicit BasicPolyline(BasicPolyline<U> const &other)
+        : Shape(other.fill, other.stroke),
+          points(other.points.begin(), other.points.end())
+    {
+    }
+
+    template <typename U>
+    BasicPolyline &operator<<(BasicPoint<U> const &point)
+    {
+        points.push_back(BasicPoint<T>(point));
+        return *this;
+    }
+    std::string toString(Layout const &layout) const override
+    {
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        if (detail::needsGeometryPass(layout))
+        {
+            appendProcessed(out, layout);
+            return;
+        }
+
+        out += "\t<polyline points=\"";
+        detail::appendTranslatedPoints(out, points, layout);
+        out += "\" ";
+        fill.appendTo(out, layout);
+        stroke.appendTo(out, layout);
+        out += "/>\n";
+    }
+    void offset(Point const &offset) override
+    {
+        detail::offsetPoints(points, offset);
+    }
+
+    char const *shapeName() const override { return "Polyline"; }
+    std::size_t pointCount() const override { return points.size(); }
+
+    // The same line as cubic segments within tolerance of every point; see
+    //  Path::addFittedCurve.
+    BasicPath<T> fitCurves(double tolerance) const
+    {
+        BasicPath<T> path(fill, stroke);
+        path.addFittedCurve(points, tolerance);
+        return path;
+    }
+
+    std::vector<BasicPoint<T>> points;
+
+   private:
+    // Pieces that leave and re-enter the visible area become subpaths of a
+    //  single <path>.  A filled polyline is an implicit polygon, so it is
+    //  not clipped.
+    void appendProcessed(std::string &out, Layout const &layout) const
+    {
+        std::vector<std::vector<Point>> pieces = detail::geometryPass(
+            points, layout, false,
+            layout.clip && fill.getColor().isTransparent(),
+            detail::strokeClipMargin(stroke, layout));
+        if (pieces.empty()) return;
+
+        if (pieces.size() == 1)
+        {
+            out += "\t<polyline points=\"";
+            detail::appendPointList(out, pieces[0]);
+        }
+        else
+        {
+            out += "\t<path d=\"";
+            for (auto const &piece : pieces)
+            {
+                out += 'M';
+                detail::appendPointList(out, piece);
+            }
+        }
+        out += "\" ";
+        fill.appendTo(out, layout);
+        stroke.appendTo(out, layout);
+        out += "/>\n";
+    }
+
+    template <typename U>
+    friend class BasicPolyline;
+    template <typename U>
+    friend class BasicLineChart;
+    friend class DisplayListWriter;
+    friend class StyleMerger;
+    friend class OverdrawCuller;
+};
+typedef BasicPolyline<double> Polyline;
+
+class Text : public Shape
+{
+   public:
+    Text(Point const &origin, std::string const &content,
+         Fill const &fill = Fill(), Font const &font = Font(),
+         Stroke const &stroke = Stroke())
+        : Shape(fill, stroke), origin(origin), content(content), font(font)
+    {
+    }
+    std::string toString(Layout const &layout) const override
+    {
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        out += "\t<text ";
+        if (layout.delegated)
+        {
+            // The position the text has without delegation, mapped back
+            //  through the group transform.  Axes that transform flips are
+            //  flipped again so that the text stays upright.
+            Layout const outer = outerLayout(layout);
+            Point const position = svgPosition(outer);
+            LayoutTransform const m = layoutTransform(outer);
+            double const flip_x = m.a < 0 ? -1 : 1;
+            double const flip_y = m.d < 0 ? -1 : 1;
+            appendAttribute(out, "x", (position.x - m.e) / m.a * flip_x);
+            appendAttribute(out, "y", (position.y - m.f) / m.d * flip_y);
+            if (flip_x < 0 || flip_y < 0)
+            {
+                out += "transform=\"scale(";
+                appendNumber(out, flip_x);
+                out += ',';
+                appendNumber(out, flip_y);
+                out += ")\" ";
+            }
+        }
+        else
+        {
+            Point const position = svgPosition(layout);
+            appendAttribute(out, "x", position.x);
+            appendAttribute(out, "y", position.y);
+        }
+        fill.appendTo(out, layout);
+        stroke.appendTo(out, layout);
+        font.appendTo(out, layout);
+        out += '>';
+        appendXmlEscaped(out, content.data(), content.size());
+        out += "</text>\n";
+    }
+    void offset(Point const &offset) override
+    {
+        origin.x += offset.x;
+        origin.y += offset.y;
+    }
+
+    char const *shapeName() const override { return "Text"; }
+    std::size_t pointCount() const override { return 1; }
+
+    // Get the bounding box of the text
+    Box getBoundingBox() const
+    {
+        double width = measureTextWidth(content, font);
+        double height = measureTextHeight(font);
+        return Box(origin, Size(width, height));
+    }
+
+   private:
+    Point origin;
+    std::string content;
+    Font font;
+
+    // The text is anchored at its bottom left corner, so origin is moved to
+    //  there from the corner nearest the layout origin.
+    template <typename L>
+    struct Position
+    {
+        static void run(Point &position, Text const &text,
+                        Layout const &layout)
+        {
+            position.x = L::x(text.origin.x, layout);
+            position.y = L::y(text.origin.y, layout);
+            if (L::flip_x)
+                position.x -= text.measureTextWidth(text.content, text.font);
+            if (!L::flip_y) position.y += text.measureTextHeight(text.font);
+        }
+    };
+    Point svgPosition(Layout const &layout) const
+    {
+        Point position;
+        withStaticLayout<Position>(layout, position, *this, layout);
+        return position;
+    }
+
+    double measureTextWidth(std::string const &text, Font const &font) const
+    {
+        // Implement text width measurement based on font
+        return text.length() * font.getSize() / 1.5;  // approximation
+    }
+
+    double measureTextHeight(Font const &font) const
+    {
+        // Implement text height measurement based on font
+        return font.getSize();  // approximation
+    }
+
+    friend class DisplayListWriter;
+};
+
+namespace detail
+{
+// One line chart series as LineChart writes it: the polyline through the
+//  points shifted by margin, then a black circle of the given (translated)
+//  radius on each point.  at(i) returns point i of count.  Only for layouts
+//  without a geometry pass.
+template <typename L>
+struct AppendChartSeries
+{
+    template <typename At>
+    static void run(std::string &out, At const &at, std::size_t count,
+                    Dimensions const &margin, Fill const &fill,
+                    Stroke const &stroke, double radius, Layout const &layout)
+    {
+        out += "\t<polyline points=\"";
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            Point const point = at(i);
+            appendNumber(out, L::x(point.x + margin.width, layout));
+            out += ',';
+            appendNumber(out, L::y(point.y + margin.height, layout));
+            out += ' ';
+        }
+        out += "\" ";
+        fill.appendTo(out, layout);
+        stroke.appendTo(out, layout);
+        out += "/>\n";
+
+        Fill const vertex_fill(Color::Black);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            Point const point = at(i);
+            out += "\t<circle ";
+            appendAttribute(out, "cx", L::x(point.x + margin.width, layout));
+            appendAttribute(out, "cy", L::y(point.y + margin.height, layout));
+            appendAttribute(out, "r", radius);
+            vertex_fill.appendTo(out, layout);
+            out += "/>\n";
+        }
+    }
+};
+// And the axis after the series, 10% wider and higher than the data.
+template <typename L>
+struct AppendChartAxis
+{
+    static void run(std::string &out, Dimensions const &dimensions,
+                    Dimensions const &margin, Stroke const &stroke,
+                    Layout const &layout)
+    {
+        double const width = dimensions.width * 1.1;
+        double const height = dimensions.height * 1.1;
+        Point const corners[3] = {
+            Point(margin.width, margin.height + height),
+            Point(margin.width, margin.height),
+            Point(margin.width + width, margin.height)};
+
+        out += "\t<polyline points=\"";
+        for (Point const &corner : corners)
+        {
+            appendNumber(out, L::x(corner.x, layout));
+            out += ',';
+            appendNumber(out, L::y(corner.y, layout));
+            out += ' ';
+        }
+        out += "\" ";
+        Fill(Color::Transparent).appendTo(out, layout);
+        stroke.appendTo(out, layout);
+        out += "/>\n";
+    }
+};
+}  // namespace detail
+
+// Sample charting class.
+template <typename T>
+class BasicLineChart : public Shape
+{
+   public:
+    explicit BasicLineChart(Dimensions margin = Dimensions(), double scale = 1,
+                            Stroke const &axis_stroke = Stroke(.5,
+                                                               Color::Purple))
+        : axis_stroke(axis_stroke), margin(margin), scale(scale)
+    {
+    }
+    BasicLineChart &operator<<(BasicPolyline<T> const &polyline)
+    {
+        if (polyline.points.empty()) return *this;
+
+        polylines.push_back(polyline);
+        return *this;
+    }
+    std::string toString(Layout const &layout) const override
+    {
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        if (polylines.empty()) return;
+
+        // Clipping and quantization are left to the general shapes.
+        if (detail::needsGeometryPass(layout))
+        {
+            for (unsigned i = 0; i < polylines.size(); ++i)
+                out += polylineToString(polylines[i], layout);
+            out += axisString(layout);
+            return;
+        }
+
+        optional<Dimensions> bounds = getDimensions();
+        Dimensions const dimensions(bounds->width, bounds->height);
+        double const radius =
+            translateScale(dimensions.height / 30.0 / 2, layout);
+        for (auto const &polyline : polylines)
+            withStaticLayout<detail::AppendChartSeries>(
+                layout, out, PointAt{polyline.points}, polyline.points.size(),
+                margin, polyline.fill, polyline.stroke, radius, layout);
+        withStaticLayout<detail::AppendChartAxis>(layout, out, dimensions,
+                                                  margin, axis_stroke, layout);
+    }
+    void offset(Point const &offset) override
+    {
+        for (unsigned i = 0; i < polylines.size(); ++i)
+            polylines[i].offset(offset);
+    }
+
+    char const *shapeName() const override { return "LineChart"; }
+    std::size_t pointCount() const override
+    {
+        std::size_t count = 0;
+        for (unsigned i = 0; i < polylines.size(); ++i)
+            count += polylines[i].points.size();
+        return count;
+    }
+
+   private:
+    struct PointAt
+    {
+        std::vector<BasicPoint<T>> const &points;
+        Point operator()(std::size_t i) const { return Point(points[i]); }
+    };
+
+    Stroke axis_stroke;
+    Dimensions margin;
+    double scale;
+    std::vector<BasicPolyline<T>> polylines;
+
+    optional<Dimensions> getDimensions() const
+    {
+        if (polylines.empty()) return optional<Dimensions>();
+
+        optional<BasicPoint<T>> min = getMinPoint(polylines[0].points);
+        optional<BasicPoint<T>> max = getMaxPoint(polylines[0].points);
+        for (unsigned i = 0; i < polylines.size(); ++i)
+        {
+            if (getMinPoint(polylines[i].points)->x < min->x)
+                min->x = getMinPoint(polylines[i].points)->x;
+            if (getMinPoint(polylines[i].points)->y < min->y)
+                min->y = getMinPoint(polylines[i].points)->y;
+            if (getMaxPoint(polylines[i].points)->x > max->x)
+                max->x = getMaxPoint(polylines[i].points)->x;
+            if (getMaxPoint(polylines[i].points)->y > max->y)
+                max->y = getMaxPoint(polylines[i].points)->y;
+        }
+
+        return optional<Dimensions>(
+            Dimensions(static_cast<double>(max->x) - min->x,
+                       static_cast<double>(max->y) - min->y));
+    }
+    std::string axisString(Layout const &layout) const
+    {
+        optional<Dimensions> dimensions = getDimensions();
+        if (!dimensions) return "";
+
+        // Make the axis 10% wider and higher than the data points.
+        double width = dimensions->width * 1.1;
+        double height = dimensions->height * 1.1;
+
+        // Draw the axis.
+        Polyline axis(Fill(Color::Transparent), axis_stroke);
+        axis << Point(margin.width, margin.height + height)
+             << Point(margin.width, margin.height)
+             << Point(margin.width + width, margin.height);
+
+        return axis.toString(layout);
+    }
+    std::string polylineToString(BasicPolyline<T> const &polyline,
+                                 Layout const &layout) const
+    {
+        Polyline shifted_polyline(polyline);
+        shifted_polyline.offset(Point(margin.width, margin.height));
+
+        double vertex_diameter = getDimensions()->height / 30.0;
+        std::vector<Circle> vertices;
+        for (unsigned i = 0; i < shifted_polyline.points.size(); ++i)
+            vertices.push_back(Circle(
+                shifted_polyline.points[i], vertex_diameter,
+                Fill(Color::Black)));  // Use Fill instead of direct Color
+
+        return shifted_polyline.toString(layout) +
+               vectorToString(vertices, layout);
+    }
+
+    friend class FragmentCache;
+};
+typedef BasicLineChart<double> LineChart;
+
+namespace detail
+{
+// Minimum of the last capacity values pushed (maximum with std::greater),
+//  in amortized O(1) per push.  Entries are kept in a ring allocated once,
+//  in order of sequence number with strictly improving values.
+template <typename Compare>
+class MonotonicWindow
+{
+   public:
+    explicit MonotonicWindow(std::size_t capacity)
+        : entries(capacity), head(0), count(0)
+    {
+    }
+
+    void push(std::uint64_t sequence, double value)
+    {
+        std::size_t const capacity = entries.size();
+        while (count && entries[head].sequence + capacity <= sequence)
+        {
+            head = (head + 1) % capacity;
+            --count;
+        }
+        while (count && !compare(entries[(head + count - 1) % capacity].value,
+                                 value))
+            --count;
+        Entry &entry = entries[(head + count) % capacity];
+        entry.sequence = sequence;
+        entry.value = value;
+        ++count;
+    }
+    bool empty() const { return count == 0; }
+    double best() const { return entries[head].value; }
+    // For Shape::offset().
+    void shift(double delta)
+    {
+        for (std::size_t i = 0; i < count; ++i)
+            entries[(head + i) % entries.size()].value += delta;
+    }
+
+   private:
+    struct Entry
+    {
+        std::uint64_t sequence;
+        double value;
+    };
+    std::vector<Entry> entries;
+    std::size_t head;
+    std::size_t count;
+    Compare compare;
+};
+}  // namespace detail
+
+// LineChart over a sliding window: each series keeps its last capacity
+//  points in a ring buffer, for plots redrawn as samples arrive.  Appending
+//  does not allocate, the data bounds are kept up to date in amortized O(1),
+//  and serialization reads the rings in place, so a redraw costs the window
+//  size however many samples came before and, into a reused buffer, does
+//  not allocate either.  The output is that of a
+//  LineChart holding the same series and points.
+class StreamingLineChart : public Shape
+{
+   public:
+    explicit StreamingLineChart(std::size_t capacity,
+                                Dimensions margin = Dimensions(),
+                                double scale = 1,
+                                Stroke const &axis_stroke = Stroke(.5,
+                                                                   Color::Purple))
+        : capacity(capacity ? capacity : 1),
+          axis_stroke(axis_stroke),
+          margin(margin),
+          scale(scale)
+    {
+    }
+
+    // Returns the index to pass to push().
+    std::size_t addSeries(Stroke const &stroke,
+                          Fill const &fill = Fill(Color::Transparent))
+    {
+        series.push_back(Series(capacity, fill, stroke));
+        return series.size() - 1;
+    }
+    // Once the window is full, replaces the oldest point of the series.
+    void push(std::size_t index, Point const &point)
+    {
+        Series &target = series[index];
+        target.points[(target.head + target.count) % capacity] = point;
+        if (target.count < capacity)
+            ++target.count;
+        else
+            target.head = (target.head + 1) % capacity;
+
+        std::uint64_t const sequence = target.pushed++;
+        target.min_x.push(sequence, point.x);
+        target.min_y.push(sequence, point.y);
+        target.max_x.push(sequence, point.x);
+        target.max_y.push(sequence, point.y);
+    }
+
+    std::size_t seriesCount() const { return series.size(); }
+    std::size_t windowSize(std::size_t index) const
+    {
+        return series[index].count;
+    }
+    // The index-th oldest point in the window of a series.
+    Point const &point(std::size_t index, std::size_t position) const
+    {
+        Series const &source = series[index];
+        return source.points[(source.head + position) % capacity];
+    }
+
+    std::string toString(Layout const &layout) const override
+    {
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    // Reuse out between redraws to keep its buffer.
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        optional<Dimensions> dimensions = getDimensions();
+        if (!dimensions) return;
+
+        // Clipping and quantization are left to the general shapes.
+        if (detail::needsGeometryPass(layout))
+        {
+            toLineChart().appendTo(out, layout);
+            return;
+        }
+
+        Dimensions const bounds(dimensions->width, dimensions->height);
+        double const radius = translateScale(bounds.height / 30.0 / 2, layout);
+        for (auto const &source : series)
+        {
+            if (!source.count) continue;
+            withStaticLayout<detail::AppendChartSeries>(
+                layout, out, PointAt{source, capacity}, source.count, margin,
+                source.fill, source.stroke, radius, layout);
+        }
+        withStaticLayout<detail::AppendChartAxis>(layout, out, bounds, margin,
+                                                  axis_stroke, layout);
+    }
+
+    // The window contents as a LineChart.
+    LineChart toLineChart() const
+    {
+        LineChart chart(margin, scale, axis_stroke);
+        for (std::size_t i = 0; i < series.size(); ++i)
+        {
+            Polyline polyline(series[i].fill, series[i].stroke);
+            for (std::size_t p = 0; p < series[i].count; ++p)
+                polyline << point(i, p);
+            chart << polyline;
+        }
+        return chart;
+    }
+
+    void offset(Point const &offset) override
+    {
+        for (auto &target : series)
+        {
+            for (std::size_t p = 0; p < target.count; ++p)
+            {
+                Point &shifted = target.points[(target.head + p) % capacity];
+                shifted.x += offset.x;
+                shifted.y += offset.y;
+            }
+            target.min_x.shift(offset.x);
+            target.max_x.shift(offset.x);
+            target.min_y.shift(offset.y);
+            target.max_y.shift(offset.y);
+        }
+    }
+
+    char const *shapeName() const override { return "StreamingLineChart"; }
+    std::size_t pointCount() const override
+    {
+        std::size_t count = 0;
+        for (auto const &source : series) count += source.count;
+        return count;
+    }
+
+   private:
+    struct Series
+    {
+        Series(std::size_t capacity, Fill const &fill, Stroke const &stroke)
+            : points(capacity),
+              head(0),
+              count(0),
+              pushed(0),
+              fill(fill),
+              stroke(stroke),
+              min_x(capacity),
+              min_y(capacity),
+              max_x(capacity),
+              max_y(capacity)
+        {
+        }
+        std::vector<Point> points;
+        std::size_t head;
+        std::size_t count;
+        std::uint64_t pushed;
+        Fill fill;
+        Stroke stroke;
+        detail::MonotonicWindow<std::less<double>> min_x, min_y;
+        detail::MonotonicWindow<std::greater<double>> max_x, max_y;
+    };
+
+    // The index-th oldest point of a series, for detail::AppendChartSeries.
+    struct PointAt
+    {
+        Series const &source;
+        std::size_t capacity;
+        Point const &operator()(std::size_t index) const
+        {
+            return source.points[(source.head + index) % capacity];
+        }
+    };
+
+    std::size_t capacity;
+    Stroke axis_stroke;
+    Dimensions margin;
+    double scale;
+    std::vector<Series> series;
+
+    // Same as LineChart::getDimensions(), from the window bounds.
+    optional<Dimensions> getDimensions() const
+    {
+        bool found = false;
+        Point min, max;
+        for (auto const &source : series)
+        {
+            if (!source.count) continue;
+            if (!found || source.min_x.best() < min.x)
+                min.x = source.min_x.best();
+            if (!found || source.min_y.best() < min.y)
+                min.y = source.min_y.best();
+            if (!found || source.max_x.best() > max.x)
+                max.x = source.max_x.best();
+            if (!found || source.max_y.best() > max.y)
+                max.y = source.max_y.best();
+            found = true;
+        }
+        if (!found) return optional<Dimensions>();
+        return optional<Dimensions>(
+            Dimensions(max.x - min.x, max.y - min.y));
+    }
+};
+
+// Many markers (scatter plot points) sharing one style, kept as coordinate
+//  columns instead of one Circle object each.  Optional columns give every
+//  marker its own diameter or fill color.  The output form is selectable:
+//  one <circle> per marker, <use> instances of a single <circle> definition,
+//  or a single <path> made of arcs (one per run of equal colors).
+class MarkerBatch : public Shape
+{
+   public:
+    enum Mode
+    {
+        Circles,
+        UseInstances,
+        SinglePath
+    };
+
+    explicit MarkerBatch(double diameter, Fill const &fill = Fill(),
+                         Stroke const &stroke = Stroke(), Mode mode = Circles)
+        : Shape(fill, stroke),
+          mode(mode),
+          diameter(diameter)
+    {
+    }
+    MarkerBatch(std::vector<double> const &xs, std::vector<double> const &ys,
+                double diameter, Fill const &fill = Fill(),
+                Stroke const &stroke = Stroke(), Mode mode = Circles)
+        : Shape(fill, stroke),
+          mode(mode),
+          diameter(diameter),
+          xs(xs),
+          ys(ys)
+    {
+        // Extra values in the longer column are ignored.
+        std::size_t count = xs.size() < ys.size() ? xs.size() : ys.size();
+        this->xs.resize(count);
+        this->ys.resize(count);
+    }
+
+    MarkerBatch &operator<<(Point const &point)
+    {
+        xs.push_back(point.x);
+        ys.push_back(point.y);
+        return *this;
+    }
+    void reserve(std::size_t count)
+    {
+        xs.reserve(count);
+        ys.reserve(count);
+    }
+    // Per-marker diameters and fill colors, parallel to the coordinates.
+    MarkerBatch &setDiameters(std::vector<double> const &diameters)
+    {
+        this->diameters = diameters;
+        return *this;
+    }
+    MarkerBatch &setColors(std::vector<Color> const &colors)
+    {
+        this->colors = colors;
+        return *this;
+    }
+    void setMode(Mode mode) { this->mode = mode; }
+    std::size_t size() const { return xs.size(); }
+
+    std::string toString(Layout const &layout) const override
+    {
+        std::string ret;
+        // Roughly the size of one <circle> element.
+        ret.reserve(xs.size() * (colors.empty() ? 48 : 64) + 128);
+        appendTo(ret, layout);
+        return ret;
+    }
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        if (mode == SinglePath)
+            writePaths(out, layout);
+        // <use> cannot change the radius, so sized markers fall back.
+        else if (mode == UseInstances && diameters.empty())
+            writeUses(out, layout);
+        else
+            writeCircles(out, layout);
+    }
+    void offset(Point const &offset) override
+    {
+        for (std::size_t i = 0; i < xs.size(); ++i)
+        {
+            xs[i] += offset.x;
+            ys[i] += offset.y;
+        }
+    }
+
+    char const *shapeName() const override { return "MarkerBatch"; }
+    std::size_t pointCount() const override { return xs.size(); }
+
+   private:
+    Mode mode;
+    double diameter;
+    std::vector<double> xs;
+    std::vector<double> ys;
+    std::vector<double> diameters;
+    std::vector<Color> colors;
+
+    double radius(std::size_t index) const
+    {
+        return (index < diameters.size() ? diameters[index] : diameter) / 2;
+    }
+    // Writes the id of the <defs> entry to id and returns its length.  In
+    //  a document it is the next of layout.definition_ids ("marker-" and
+    //  the count, after the scope if any), so that batches added twice or
+    //  identical ones still get distinct ids.  Otherwise it is derived from
+    //  the content (hashed with the definition, which is what out holds
+    //  from definition_start on), so that it does not depend on other
+    //  batches or threads.
+    std::size_t definitionId(std::string const &out,
+                             std::size_t definition_start,
+                             Layout const &layout, char *id) const
+    {
+        static char const prefix[] = "marker";
+        std::size_t length = sizeof(prefix) - 1;
+        std::memcpy(id, prefix, length);
+        if (DefinitionIds *ids = layout.definition_ids)
+        {
+            id[length++] = '-';
+            if (ids->scope)
+            {
+                length = appendHex(id, length, ids->scope);
+                id[length++] = '-';
+            }
+            return appendHex(id, length, ids->next++);
+        }
+
+        std::uint64_t hash = detail::hashBytes(
+            out.data() + definition_start, out.size() - definition_start);
+        hash = detail::hashBytes(xs.data(), xs.size() * sizeof(double), hash);
+        hash = detail::hashBytes(ys.data(), ys.size() * sizeof(double), hash);
+        for (Color const &color : colors)
+        {
+            std::uint32_t const packed = color.packed();
+            hash = detail::hashBytes(&packed, sizeof(packed), hash);
+        }
+        return appendHex(id, length, hash);
+    }
+    static std::size_t appendHex(char *id, std::size_t length,
+                                 std::uint64_t value)
+    {
+        static char const hex[] = "0123456789abcdef";
+        int shift = 60;
+        while (shift > 0 && !(value >> shift)) shift -= 4;
+        for (; shift >= 0; shift -= 4) id[length++] = hex[(value >> shift) & 15];
+        return length;
+    }
+    bool sameFill(std::size_t a, std::size_t b) const
+    {
+        if (a >= colors.size() || b >= colors.size())
+            return a >= colors.size() && b >= colors.size();
+        return colors[a] == colors[b];
+    }
+    void appendFill(std::string &out, std::size_t index,
+                    Layout const &layout) const
+    {
+        if (index < colors.size())
+            appendColorAttribute(out, "fill", colors[index]);
+        else
+            fill.appendTo(out, layout);
+    }
+
+    // Same bytes as the equivalent Circle objects would produce.
+    void writeCircles(std::string &out, Layout const &layout) const
+    {
+        for (std::size_t i = 0; i < xs.size(); ++i)
+        {
+            out += "\t<circle cx=\"";
+            appendNumber(out, translateX(xs[i], layout));
+            out += "\" cy=\"";
+            appendNumber(out, translateY(ys[i], layout));
+            out += "\" r=\"";
+            appendNumber(out, translateScale(radius(i), layout));
+            out += "\" ";
+            appendFill(out, i, layout);
+            stroke.appendTo(out, layout);
+            out += "/>\n";
+        }
+    }
+    // xlink is declared on a wrapping group so the output stays SVG 1.1.
+    void writeUses(std::string &out, Layout const &layout) const
+    {
+        out += "\t<g xmlns:xlink=\"http://www.w3.org/1999/xlink\">\n";
+        out += "\t<defs><circle id=\"";
+        std::size_t const id_start = out.size();
+        out += "\" r=\"";
+        std::size_t const definition_start = out.size();
+        appendNumber(out, translateScale(diameter / 2, layout));
+        out += "\" ";
+        // With per-marker colors the fill is inherited from each <use>.
+        if (colors.empty()) fill.appendTo(out, layout);
+        stroke.appendTo(out, layout);
+
+        char id[48];
+        std::size_t const id_length =
+            definitionId(out, definition_start, layout, id);
+        out.insert(id_start, id, id_length);
+        out += "/></defs>\n";
+
+        for (std::size_t i = 0; i < xs.size(); ++i)
+        {
+            out += "\t<use xlink:href=\"#";
+            out.append(id, id_length);
+            out += "\" x=\"";
+            appendNumber(out, translateX(xs[i], layout));
+            out += "\" y=\"";
+            appendNumber(out, translateY(ys[i], layout));
+            out += "\" ";
+            if (!colors.empty()) appendFill(out, i, layout);
+            out += "/>\n";
+        }
+        out += "\t</g>\n";
+    }
+    // Each marker is a move to its left edge and two half-circle arcs.
+    void writePaths(std::string &out, Layout const &layout) const
+    {
+        for (std::size_t run = 0; run < xs.size();)
+        {
+            std::size_t end = run + 1;
+            while (end < xs.size() && sameFill(end, run)) ++end;
+
+            out += "\t<path d=\"";
+            for (std::size_t i = run; i < end; ++i)
+            {
+                double r = translateScale(radius(i), layout);
+                out += 'M';
+                appendNumber(out, translateX(xs[i], layout) - r);
+                out += ',';
+                appendNumber(out, translateY(ys[i], layout));
+                out += 'a';
+                appendNumber(out, r);
+                out += ',';
+                appendNumber(out, r);
+                out += " 0 1,0 ";
+                appendNumber(out, 2 * r);
+                out += ",0a";
+                appendNumber(out, r);
+                out += ',';
+                appendNumber(out, r);
+                out += " 0 1,0 ";
+                appendNumber(out, -2 * r);
+                out += ",0z";
+            }
+            out += "\" ";
+            appendFill(out, run, layout);
+            stroke.appendTo(out, layout);
+            out += "/>\n";
+            run = end;
+        }
+    }
+};
+
+// Maps values to colors by linear interpolation between evenly spaced color
+//  stops over [min_value, max_value].  The range is quantized to a fixed
+//  number of levels so that neighboring values share a color exactly.
+class ColorMap
+{
+   public:
+    ColorMap(std::vector<Color> const &stops, double min_value,
+             double max_value, std::size_t levels = 64)
+        : min_value(min_value),
+          max_value(max_value),
+          level_count(levels ? levels : 1)
+    {
+        std::vector<Color> const fallback(1, Color(Color::Black));
+        std::vector<Color> const &used = stops.empty() ? fallback : stops;
+        for (std::size_t level = 0; level < level_count; ++level)
+        {
+            double t = level_count == 1
+                           ? 0.5
+                           : static_cast<double>(level) / (level_count - 1);
+            double position = t * (used.size() - 1);
+            std::size_t index = static_cast<std::size_t>(position);
+            if (index + 1 >= used.size()) index = used.size() - 1;
+            Color const &from = used[index];
+            Color const &to = used[index + 1 < used.size() ? index + 1 : index];
+            double f = position - index;
+            colors.push_back(
+                Color(static_cast<int>(from.red() +
+                                       (to.red() - from.red()) * f + 0.5),
+                      static_cast<int>(from.green() +
+                                       (to.green() - from.green()) * f + 0.5),
+                      static_cast<int>(from.blue() +
+                                       (to.blue() - from.blue()) * f + 0.5),
+                      static_cast<int>(from.alpha() +
+                                       (to.alpha() - from.alpha()) * f + 0.5)));
+        }
+    }
+
+    std::size_t levels() const { return level_count; }
+    // The level of value, or levels() for NaN, which is not drawn.
+    std::size_t level(double value) const
+    {
+        if (value != value) return level_count;
+        if (!(max_value > min_value) || value <= min_value) return 0;
+        if (value >= max_value) return level_count - 1;
+        std::size_t level = static_cast<std::size_t>(
+            (value - min_value) / (max_value - min_value) * level_count);
+        return level < level_count ? level : level_count - 1;
+    }
+    Color const &color(std::size_t level) const { return colors[level]; }
+
+   private:
+    double min_value;
+    double max_value;
+    std::size_t level_count;
+    std::vector<Color> colors;
+};
+
+// A grid of colored cells from a row-major value buffer.  Row r, column c
+//  covers the same area as Rectangle(origin + (c * width, r * height), width,
+//  height).  Values are quantized through the color map, then horizontal
+//  runs and rectangular blocks of equal color are merged, so smooth fields
+//  produce a small fraction of the cells' elements.  By default each color
+//  is one <path>; blocks never overlap, so grouping keeps the picture.
+class Heatmap : public Shape
+{
+   public:
+    enum Output
+    {
+        PathPerColor,
+        Rectangles
+    };
+
+    Heatmap(Point const &origin, std::size_t columns, std::size_t rows,
+            double cell_width, double cell_height, std::vector<double> values,
+            ColorMap const &color_map, Output output = PathPerColor)
+        : origin(origin),
+          columns(columns),
+          rows(rows),
+          cell_width(cell_width),
+          cell_height(cell_height),
+          values(std::move(values)),
+          color_map(color_map),
+          output(output),
+          thread_count(0)
+    {
+        this->values.resize(columns * rows,
+                            std::numeric_limits<double>::quiet_NaN());
+    }
+
+    // Threads used on large grids; 0 means one per hardware thread.
+    void setThreadCount(unsigned count) { thread_count = count; }
+
+    std::string toString(Layout const &layout) const override
+    {
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+    // The merge pass needs scratch space for the runs and blocks, so unlike
+    //  the other shapes this allocates on every call; the output is still
+    //  written straight into out.
+    void appendTo(std::string &out, Layout const &layout) const override
+    {
+        std::vector<Block> blocks = mergeBlocks(quantizedRuns());
+        if (output == Rectangles)
+        {
+            for (auto const &block : blocks)
+            {
+                out += "\t<rect ";
+                appendBlock(out, block, layout, true);
+                appendColorAttribute(out, "fill", color_map.color(block.level));
+                out += "/>\n";
+            }
+            return;
+        }
+
+        // Blocks by level, keeping their order within a level.
+        std::stable_sort(blocks.begin(), blocks.end(),
+                         [](Block const &a, Block const &b)
+                         { return a.level < b.level; });
+        for (std::size_t first = 0; first < blocks.size();)
+        {
+            std::size_t const level = blocks[first].level;
+            out += "\t<path d=\"";
+            std::size_t last = first;
+            for (; last < blocks.size() && blocks[last].level == level; ++last)
+                appendBlock(out, blocks[last], layout, false);
+            out += "\" ";
+            appendColorAttribute(out, "fill", color_map.color(level));
+            out += "/>\n";
+            first = last;
+        }
+    }
+    void offset(Point const &offset) override
+    {
+        origin.x += offset.x;
+        origin.y += offset.y;
+    }
+
+    char const *shapeName() const override { return "Heatmap"; }
+    std::size_t pointCount() const override { return values.size(); }
+
+   private:
+    // Cells [column, column + width) of one row sharing a level.
+    struct Run
+    {
+        std::size_t column;
+        std::size_t width;
+        std::size_t level;
+    };
+    struct Block
+    {
+        std::size_t column;
+        std::size_t row;
+        std::size_t width;
+        std::size_t height;
+        std::size_t level;
+    };
+
+    Point origin;
+    std::size_t columns;
+    std::size_t rows;
+    double cell_width;
+    double cell_height;
+    std::vector<double> values;
+    ColorMap color_map;
+    Output output;
+    unsigned thread_count;
+
+    void rowRuns(std::size_t row, std::vector<Run> &runs) const
+    {
+        double const *value = &values[row * columns];
+        for (std::size_t column = 0; column < columns;)
+        {
+            Run run = {column, 1, color_map.level(value[column])};
+            while (column + run.width < columns &&
+                   color_map.level(value[column + run.width]) == run.level)
+                ++run.width;
+            column += run.width;
+            // NaN cells are left empty.
+            if (run.level < color_map.levels()) runs.push_back(run);
+        }
+    }
+    // Rows are independent, so large grids are split across threads.
+    std::vector<std::vector<Run>> quantizedRuns() const
+    {
+        std::vector<std::vector<Run>> runs(rows);
+        std::size_t threads =
+            thread_count ? thread_count : std::thread::hardware_concurrency();
+        if (threads > rows) threads = rows;
+        if (columns * rows < (1u << 16) || threads < 2)
+        {
+            for (std::size_t row = 0; row < rows; ++row)
+                rowRuns(row, runs[row]);
+            return runs;
+        }
+
+        std::vector<std::thread> workers;
+        for (std::size_t t = 0; t < threads; ++t)
+            workers.push_back(std::thread(
+                [this, &runs, t, threads]()
+                {
+                    for (std::size_t row = t; row < rows; row += threads)
+                        rowRuns(row, runs[row]);
+                }));
+        for (auto &worker : workers) worker.join();
+        return runs;
+    }
+    // A run matching a block from the row above (same columns and level)
+    //  extends that block downwards instead of starting a new one.
+    std::vector<Block> mergeBlocks(
+        std::vector<std::vector<Run>> const &runs) const
+    {
+        std::vector<Block> blocks;
+        std::vector<std::size_t> open;  // blocks touching the previous row
+        std::vector<std::size_t> next;
+        for (std::size_t row = 0; row < runs.size(); ++row)
+        {
+            next.clear();
+            std::size_t candidate = 0;
+            for (auto const &run : runs[row])
+            {
+                while (candidate < open.size() &&
+                       blocks[open[candidate]].column < run.column)
+                    ++candidate;
+                if (candidate < open.size())
+                {
+                    Block &above = blocks[open[candidate]];
+                    if (above.column == run.column &&
+                        above.width == run.width && above.level == run.level)
+                    {
+                        ++above.height;
+                        next.push_back(open[candidate]);
+                        continue;
+                    }
+                }
+                Block block = {run.column, row, run.width, 1, run.level};
+                next.push_back(blocks.size());
+                blocks.push_back(block);
+            }
+            open.swap(next);
+        }
+        return blocks;
+    }
+    void appendBlock(std::string &out, Block const &block,
+                     Layout const &layout, bool as_rect) const
+    {
+        double x0 = translateX(origin.x + block.column * cell_width, layout);
+        double x1 = translateX(
+            origin.x + (block.column + block.width) * cell_width, layout);
+        double y0 = translateY(origin.y + block.row * cell_height, layout);
+        double y1 = translateY(
+            origin.y + (block.row + block.height) * cell_height, layout);
+        double x = x0 < x1 ? x0 : x1;
+        double y = y0 < y1 ? y0 : y1;
+        double w = x0 < x1 ? x1 - x0 : x0 - x1;
+        double h = y0 < y1 ? y1 - y0 : y0 - y1;
+
+        if (as_rect)
+        {
+            out += "x=\"";
+            appendNumber(out, x);
+            out += "\" y=\"";
+            appendNumber(out, y);
+            out += "\" width=\"";
+            appendNumber(out, w);
+            out += "\" height=\"";
+            appendNumber(out, h);
+            out += "\" ";
+            return;
+        }
+        out += 'M';
+        appendNumber(out, x);
+        out += ',';
+        appendNumber(out, y);
+        out += 'h';
+        appendNumber(out, w);
+        out += 'v';
+        appendNumber(out, h);
+        out += 'h';
+        appendNumber(out, -w);
+        out += 'z';
+    }
+};
+
+namespace detail
+{
+// Axis-aligned bounds in user space; empty until a point is added.
+struct Bounds
+{
+    Bounds()
+        : min_x(std::numeric_limits<double>::infinity()),
+          min_y(std::numeric_limits<double>::infinity()),
+          max_x(-std::numeric_limits<double>::infinity()),
+          max_y(-std::numeric_limits<double>::infinity())
+    {
+    }
+    void add(Point const &point)
+    {
+        min_x = std::min(min_x, point.x);
+        min_y = std::min(min_y, point.y);
+        max_x = std::max(max_x, point.x);
+        max_y = std::max(max_y, point.y);
+    }
+    bool empty() const { return !(min_x <= max_x && min_y <= max_y); }
+    Bounds inflated(double margin) const
+    {
+        Bounds ret = *this;
+        ret.min_x -= margin;
+        ret.min_y -= margin;
+        ret.max_x += margin;
+        ret.max_y += margin;
+        return ret;
+    }
+    // Touching counts, as antialiasing blends a shared edge.
+    bool overlaps(Bounds const &other) const
+    {
+        return min_x <= other.max_x && other.min_x <= max_x &&
+               min_y <= other.max_y && other.min_y <= max_y;
+    }
+    bool contains(Bounds const &other) const
+    {
+        return min_x <= other.min_x && other.max_x <= max_x &&
+               min_y <= other.min_y && other.max_y <= max_y;
+    }
+    double min_x;
+    double min_y;
+    double max_x;
+    double max_y;
+};
+
+// Spatial hash of bounds for finding the ones that may overlap a query.
+//  Bounds spanning many cells are kept aside and checked on every query.
+class BoxGrid
+{
+   public:
+    explicit BoxGrid(double cell_size = 1) { reset(cell_size); }
+
+    void reset(double size)
+    {
+        cell_size = size > 0 && std::isfinite(size) ? size : 1;
+        cells.clear();
+        large.clear();
+    }
+    void insert(Bounds const &bounds, std::size_t id)
+    {
+        long x0, y0, x1, y1;
+        if (!cellRange(bounds, x0, y0, x1, y1))
+        {
+            large.push_back(id);
+            return;
+        }
+        for (long y = y0; y <= y1; ++y)
+            for (long x = x0; x <= x1; ++x) cells[key(x, y)].push_back(id);
+    }
+    // Calls visit(id) for the bounds that may overlap these, possibly more
+    //  than once, until it returns true.  Returns whether it did.
+    template <typename Visit>
+    bool find(Bounds const &bounds, Visit visit) const
+    {
+        for (std::size_t id : large)
+            if (visit(id)) return true;
+
+        long x0, y0, x1, y1;
+        if (!cellRange(bounds, x0, y0, x1, y1))
+        {
+            for (auto const &cell : cells)
+                for (std::size_t id : cell.second)
+                    if (visit(id)) return true;
+            return false;
+        }
+        for (long y = y0; y <= y1; ++y)
+            for (long x = x0; x <= x1; ++x)
+            {
+                auto found = cells.find(key(x, y));
+                if (found == cells.end()) continue;
+                for (std::size_t id : found->second)
+                    if (visit(id)) return true;
+            }
+        return false;
+    }
+
+   private:
+    static long const maxCells = 16;
+    static long const limit = 1L << 30;
+
+    double cell_size;
+    std::unordered_map<std::uint64_t, std::vector<std::size_t>> cells;
+    std::vector<std::size_t> large;
+
+    static std::uint64_t key(long x, long y)
+    {
+        return static_cast<std::uint64_t>(x + limit) << 32 |
+               static_cast<std::uint64_t>(y + limit);
+    }
+    long cell(double value) const
+    {
+        double const index = std::floor(value / cell_size);
+        return static_cast<long>(
+            std::max(-double(limit), std::min(double(limit - 1), index)));
+    }
+    // False if the bounds span too many cells.
+    bool cellRange(Bounds const &bounds, long &x0, long &y0, long &x1,
+                   long &y1) const
+    {
+        if (bounds.empty()) return false;
+        x0 = cell(bounds.min_x);
+        y0 = cell(bounds.min_y);
+        x1 = cell(bounds.max_x);
+        y1 = cell(bounds.max_y);
+        return (x1 - x0 + 1) * (y1 - y0 + 1) <= maxCells;
+    }
+};
+}  // namespace detail
+
+struct StyleMergeStats
+{
+    StyleMergeStats() : shapes(0), merged(0), paths(0) {}
+    // Elements left in the output for the shapes looked at.
+    std::uint64_t elements() const { return shapes - merged + paths; }
+
+    // Leaf shapes looked at, those folded into merged paths, and the
+    //  number of those paths.
+    std::uint64_t shapes;
+    std::uint64_t merged;
+    std::uint64_t paths;
+};
+
+// Folds runs of consecutive Lines, Rectangles, Polygons and Polylines with
+//  the same fill and stroke into one Path each, turning thousands of DOM
+//  nodes into a few.  Only runs whose merge renders the same are folded:
+//  shapes stay in paint order, filled shapes and translucent strokes only
+//  merge with shapes they do not overlap (as they would blend or be filled
+//  by the even-odd rule where they do), and filled polygons and polylines,
+//  which may cross themselves, are left alone.  Nested collections are
+//  merged separately.
+class StyleMerger
+{
+   public:
+    explicit StyleMerger(std::size_t min_run = 2)
+        : min_run(std::max<std::size_t>(min_run, 2))
+    {
+    }
+
+    ShapeColl merge(ShapeColl const &scene)
+    {
+        ShapeColl ret;
+        std::vector<Piece> run;
+        for (auto const &element : scene.elements)
+        {
+            if (ShapeColl const *coll =
+                    dynamic_cast<ShapeColl const *>(element.get()))
+            {
+                flush(run, ret);
+                ret.elements.push_back(std::make_shared<ShapeColl>(merge(*coll)));
+                continue;
+            }
+            if (dynamic_cast<Shape const *>(element.get())) ++merge_stats.shapes;
+
+            Piece piece;
+            if (!describe(element, piece))
+            {
+                flush(run, ret);
+                ret.elements.push_back(element);
+                continue;
+            }
+            if (!run.empty() && !joins(run, piece)) flush(run, ret);
+            if (piece.disjoint && run.empty())
+                grid.reset(std::max(piece.bounds.max_x - piece.bounds.min_x,
+                                    piece.bounds.max_y - piece.bounds.min_y));
+            if (piece.disjoint) grid.insert(piece.bounds, run.size());
+            run.push_back(piece);
+        }
+        flush(run, ret);
+        return ret;
+    }
+
+    StyleMergeStats const &stats() const { return merge_stats; }
+    void resetStats() { merge_stats = StyleMergeStats(); }
+
+   private:
+    // A mergeable shape as a subpath.
+    struct Piece
+    {
+        std::shared_ptr<Serializeable> element;
+        Fill fill;
+        Stroke stroke;
+        std::vector<Point> points;
+        bool closed;
+        // Must not overlap the rest of its run; bounds include the stroke.
+        bool disjoint;
+        detail::Bounds bounds;
+    };
+
+    std::size_t min_run;
+    StyleMergeStats merge_stats;
+    detail::BoxGrid grid;
+
+    static bool strokeVisible(Stroke const &stroke)
+    {
+        return stroke.getWidth() > 0 && !stroke.getColor().isTransparent();
+    }
+    static bool sameStyle(Piece const &a, Piece const &b)
+    {
+        Color const &fill_a = a.fill.getColor();
+        Color const &fill_b = b.fill.getColor();
+        if (fill_a != fill_b &&
+            !(fill_a.isTransparent() && fill_b.isTransparent()))
+            return false;
+        if (!strokeVisible(a.stroke) || !strokeVisible(b.stroke))
+            return !strokeVisible(a.stroke) && !strokeVisible(b.stroke);
+        return a.stroke.getWidth() == b.stroke.getWidth() &&
+               a.stroke.getColor() == b.stroke.getColor() &&
+               a.stroke.isNonScaling() == b.stroke.isNonScaling();
+    }
+
+    static bool describe(std::shared_ptr<Serializeable> const &element,
+                         Piece &piece)
+    {
+        Serializeable const *raw = element.get();
+        if (Line const *line = dynamic_cast<Line const *>(raw))
+        {
+            piece.fill = line->fill;
+            piece.stroke = line->stroke;
+            piece.points.push_back(line->start_point);
+            piece.points.push_back(line->end_point);
+            piece.closed = false;
+        }
+        else if (Rectangle const *rect = dynamic_cast<Rectangle const *>(raw))
+        {
+            // <rect> draws nothing when empty, a path would draw the stroke.
+            if (!(rect->width > 0 && rect->height > 0)) return false;
+            piece.fill = rect->fill;
+            piece.stroke = rect->stroke;
+            Point const &edge = rect->edge;
+            piece.points.push_back(edge);
+            piece.points.push_back(Point(edge.x + rect->width, edge.y));
+            piece.points.push_back(
+                Point(edge.x + rect->width, edge.y + rect->height));
+            piece.points.push_back(Point(edge.x, edge.y + rect->height));
+            piece.closed = true;
+        }
+        else if (Polygon const *polygon = dynamic_cast<Polygon const *>(raw))
+        {
+            if (!polygon->fill.getColor().isTransparent()) return false;
+            piece.fill = polygon->fill;
+            piece.stroke = polygon->stroke;
+            piece.points = polygon->points;
+            piece.closed = true;
+        }
+        else if (Polyline const *polyline =
+                     dynamic_cast<Polyline const *>(raw))
+        {
+            if (!polyline->fill.getColor().isTransparent()) return false;
+            piece.fill = polyline->fill;
+            piece.stroke = polyline->stroke;
+            piece.points = polyline->points;
+            piece.closed = false;
+        }
+        else
+            return false;
+
+        Stroke const &stroke = piece.stroke;
+        bool const stroked = strokeVisible(stroke);
+        piece.disjoint = !piece.fill.getColor().isTransparent() ||
+                         (stroked && !stroke.getColor().isOpaque());
+        // How far a non-scaling stroke reaches depends on the layout.
+        if (piece.disjoint && stroked && stroke.isNonScaling()) return false;
+
+        piece.element = element;
+        for (auto const &point : piece.points) piece.bounds.add(point);
+        // Miter joins reach up to twice the width at the default limit.
+        if (stroked) piece.bounds = piece.bounds.inflated(2 * stroke.getWidth());
+        return true;
+    }
+
+    bool joins(std::vector<Piece> const &run, Piece const &piece) const
+    {
+        if (!sameStyle(run.front(), piece)) return false;
+        if (!piece.disjoint) return true;
+        return !grid.find(piece.bounds, [&](std::size_t id)
+                          { return run[id].bounds.overlaps(piece.bounds); });
+    }
+
+    void flush(std::vector<Piece> &run, ShapeColl &out)
+    {
+        if (run.size() < min_run)
+        {
+            for (auto const &piece : run) out.elements.push_back(piece.element);
+            run.clear();
+            return;
+        }
+
+        Piece const &first = run.front();
+        std::shared_ptr<Path> path = std::make_shared<Path>(
+            Fill(first.fill.getColor().isTransparent()
+                     ? Color(Color::Transparent)
+                     : first.fill.getColor()),
+            first.stroke);
+        for (auto const &piece : run)
+        {
+            path->startNewSubPath(piece.closed);
+            for (auto const &point : piece.points) *path << point;
+        }
+        out.elements.push_back(path);
+        merge_stats.merged += run.size();
+        ++merge_stats.paths;
+        run.clear();
+    }
+};
+
+struct OverdrawStats
+{
+    OverdrawStats() : shapes(0), removed(0), bytes_saved(0) {}
+    // Leaf shapes looked at, those dropped as hidden, and the bytes of
+    //  SVG they would have written.
+    std::uint64_t shapes;
+    std::uint64_t removed;
+    std::uint64_t bytes_saved;
+};
+
+// Drops shapes that later opaque shapes paint over completely, for layered
+//  exports that cover earlier content with backgrounds and panels.  A shape
+//  is dropped only when its bounds, stroke included, lie a pixel or more
+//  inside the interior of a later Rectangle, Circle, Elipse or convex
+//  Polygon filled with an opaque color, so that not even an antialiased
+//  edge pixel changes.  Shapes of unknown extent (Text, charts, batches)
+//  are always kept.  Nested collections keep their structure.
+class OverdrawCuller
+{
+   public:
+    ShapeColl cull(ShapeColl const &scene, Layout const &layout)
+    {
+        double const view = std::max(layout.dimensions.width,
+                                     layout.dimensions.height) /
+                            layout.scale;
+        occluders.clear();
+        grid.reset(view / 64);
+        margin = (1 + layout.quantum) / layout.scale;
+        return cullReversed(scene, layout);
+    }
+
+    OverdrawStats const &stats() const { return cull_stats; }
+    void resetStats() { cull_stats = OverdrawStats(); }
+
+   private:
+    OverdrawStats cull_stats;
+    // Interiors of the opaque shapes painted after the one looked at.
+    std::vector<detail::Bounds> occluders;
+    detail::BoxGrid grid;
+    double margin;
+
+    ShapeColl cullReversed(ShapeColl const &scene, Layout const &layout)
+    {
+        std::vector<std::shared_ptr<Serializeable>> kept;
+        for (std::size_t i = scene.elements.size(); i-- > 0;)
+        {
+            std::shared_ptr<Serializeable> const &element = scene.elements[i];
+            if (ShapeColl const *coll =
+                    dynamic_cast<ShapeColl const *>(element.get()))
+            {
+                kept.push_back(
+                    std::make_shared<ShapeColl>(cullReversed(*coll, layout)));
+                continue;
+            }
+            if (dynamic_cast<Shape const *>(element.get())) ++cull_stats.shapes;
+
+            detail::Bounds bounds;
+            if (extent(*element, layout, bounds) && hidden(bounds))
+            {
+                ++cull_stats.removed;
+                cull_stats.bytes_saved += element->toString(layout).size();
+                continue;
+            }
+            kept.push_back(element);
+
+            detail::Bounds interior;
+            if (opaqueInterior(*element, interior) && !interior.empty())
+            {
+                grid.insert(interior, occluders.size());
+                occluders.push_back(interior);
+            }
+        }
+
+        ShapeColl ret;
+        ret.elements.assign(kept.rbegin(), kept.rend());
+        return ret;
+    }
+
+    bool hidden(detail::Bounds const &bounds) const
+    {
+        detail::Bounds const padded = bounds.inflated(margin);
+        return grid.find(padded, [&](std::size_t id)
+                         { return occluders[id].contains(padded); });
+    }
+
+    // Everything the element may paint, in user space.
+    static bool extent(Serializeable const &element, Layout const &layout,
+                       detail::Bounds &bounds)
+    {
+        Stroke stroke;
+        if (Circle const *circle = dynamic_cast<Circle const *>(&element))
+        {
+            addEllipse(bounds, circle->center, circle->radius, circle->radius);
+            stroke = circle->stroke;
+        }
+        else if (Elipse const *elipse = dynamic_cast<Elipse const *>(&element))
+        {
+            addEllipse(bounds, elipse->center, elipse->radius_width,
+                       elipse->radius_height);
+            stroke = elipse->stroke;
+        }
+        else if (Rectangle const *rect =
+                     dynamic_cast<Rectangle const *>(&element))
+        {
+            bounds.add(rect->edge);
+            bounds.add(Point(rect->edge.x + rect->width,
+                             rect->edge.y + rect->height));
+            stroke = rect->stroke;
+        }
+        else if (Line const *line = dynamic_cast<Line const *>(&element))
+        {
+            bounds.add(line->start_point);
+            bounds.add(line->end_point);
+            stroke = line->stroke;
+        }
+        else if (Polygon const *polygon =
+                     dynamic_cast<Polygon const *>(&element))
+        {
+            for (auto const &point : polygon->points) bounds.add(point);
+            stroke = polygon->stroke;
+        }
+        else if (Polyline const *polyline =
+                     dynamic_cast<Polyline const *>(&element))
+        {
+            for (auto const &point : polyline->points) bounds.add(point);
+            stroke = polyline->stroke;
+        }
+        else if (Path const *path = dynamic_cast<Path const *>(&element))
+        {
+            // Curves stay inside the hull of their control points.
+            for (auto const &subpath : path->paths)
+                for (auto const &point : subpath) bounds.add(point);
+            stroke = path->stroke;
+        }
+        else
+            return false;
+
+        if (stroke.getWidth() > 0)
+        {
+            // Miter joins reach up to twice the width at the default limit.
+            double width = stroke.getWidth();
+            if (stroke.isNonScaling()) width /= layout.scale;
+            bounds = bounds.inflated(2 * width);
+        }
+        return !bounds.empty();
+    }
+    static void addEllipse(detail::Bounds &bounds, Point const &center,
+                           double rx, double ry)
+    {
+        bounds.add(Point(center.x - std::fabs(rx), center.y - std::fabs(ry)));
+        bounds.add(Point(center.x + std::fabs(rx), center.y + std::fabs(ry)));
+    }
+
+    // An axis-aligned box that the element's fill covers completely.
+    static bool opaqueInterior(Serializeable const &element,
+                               detail::Bounds &interior)
+    {
+        double const inscribed = std::sqrt(0.5);
+        if (Rectangle const *rect = dynamic_cast<Rectangle const *>(&element))
+        {
+            if (!rect->fill.getColor().isOpaque()) return false;
+            if (!(rect->width > 0 && rect->height > 0)) return false;
+            interior.add(rect->edge);
+            interior.add(Point(rect->edge.x + rect->width,
+                               rect->edge.y + rect->height));
+        }
+        else if (Circle const *circle = dynamic_cast<Circle const *>(&element))
+        {
+            if (!circle->fill.getColor().isOpaque()) return false;
+            if (!(circle->radius > 0)) return false;
+            addEllipse(interior, circle->center, circle->radius * inscribed,
+                       circle->radius * inscribed);
+        }
+        else if (Elipse const *elipse = dynamic_cast<Elipse const *>(&element))
+        {
+            if (!elipse->fill.getColor().isOpaque()) return false;
+            if (!(elipse->radius_width > 0 && elipse->radius_height > 0))
+                return false;
+            addEllipse(interior, elipse->center,
+                       elipse->radius_width * inscribed,
+                       elipse->radius_height * inscribed);
+        }
+        else if (Polygon const *polygon =
+                     dynamic_cast<Polygon const *>(&element))
+        {
+            if (!polygon->fill.getColor().isOpaque()) return false;
+            return convexInterior(polygon->points, interior);
+        }
+        else
+            return false;
+        return true;
+    }
+
+    // For a convex polygon, the largest box shaped like its bounds and
+    //  centered on its vertex centroid that fits inside.  Convexity makes
+    //  checking the corners enough.
+    static bool convexInterior(std::vector<Point> const &points,
+                               detail::Bounds &interior)
+    {
+        std::size_t const n = points.size();
+        if (n < 3) return false;
+
+        int direction = 0;
+        double turning = 0;
+        Point centroid;
+        detail::Bounds bounds;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            Point const &a = points[i];
+            Point const &b = points[(i + 1) % n];
+            Point const &c = points[(i + 2) % n];
+            double const cross =
+                (b.x - a.x) * (c.y - b.y) - (b.y - a.y) * (c.x - b.x);
+            double const dot =
+                (b.x - a.x) * (c.x - b.x) + (b.y - a.y) * (c.y - b.y);
+            int const sign = cross > 0 ? 1 : cross < 0 ? -1 : 0;
+            if (sign && direction && sign != direction) return false;
+            if (sign) direction = sign;
+            turning += std::atan2(cross, dot);
+            centroid.x += a.x / n;
+            centroid.y += a.y / n;
+            bounds.add(a);
+        }
+        // A star turns the same way at every vertex but winds twice.
+        double const pi = std::acos(-1.0);
+        if (!direction || std::fabs(std::fabs(turning) - 2 * pi) > 1e-6)
+            return false;
+
+        double const half_width = (bounds.max_x - bounds.min_x) / 2;
+        double const half_height = (bounds.max_y - bounds.min_y) / 2;
+        auto inside = [&](Point const &p)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                Point const &a = points[i];
+                Point const &b = points[(i + 1) % n];
+                double const cross =
+                    (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+                if (cross * direction < 0) return false;
+            }
+            return true;
+        };
+        double low = 0, high = 1;
+        for (int i = 0; i < 24; ++i)
+        {
+            double const scale = (low + high) / 2;
+            double const w = half_width * scale, h = half_height * scale;
+            if (inside(Point(centroid.x - w, centroid.y - h)) &&
+                inside(Point(centroid.x + w, centroid.y - h)) &&
+                inside(Point(centroid.x + w, centroid.y + h)) &&
+                inside(Point(centroid.x - w, centroid.y + h)))
+                low = scale;
+            else
+                high = scale;
+        }
+        if (low == 0) return false;
+        addEllipse(interior, centroid, half_width * low, half_height * low);
+        return true;
+    }
+};
+
+inline void appendDocumentProlog(std::string &out, Layout const &layout)
+{
+    out += "<?xml version=\"1.0\" standalone=\"no\" ?>\n"
+           "<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" "
+           "\"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n"
+           "<svg width=\"";
+    appendNumber(out, layout.dimensions.width);
+    out += "px\" height=\"";
+    appendNumber(out, layout.dimensions.height);
+    out += "px\" xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\" >\n";
+}
+inline std::string documentProlog(Layout const &layout)
+{
+    std::string ret;
+    appendDocumentProlog(ret, layout);
+    return ret;
+}
+
+// Writes to a file from a dedicated thread.  Data is copied into fixed-size
+//  buffers; a full buffer is handed to the writer thread and the next free one
+//  is filled meanwhile.  With all buffers queued, write() blocks until the
+//  writer catches up, which bounds memory use.
+class AsyncFileWriter
+{
+   public:
+    explicit AsyncFileWriter(std::string const &file_name,
+                             std::size_t buffer_size = 64 * 1024,
+                             std::size_t buffer_count = 2)
+        : file(std::fopen(file_name.c_str(), "wb")),
+          buffer_size(buffer_size ? buffer_size : 1),
+          buffers(buffer_count < 2 ? 2 : buffer_count),
+          current(0),
+          failed(false),
+          done(false)
+    {
+        if (!file)
+        {
+            fail("cannot open " + file_name);
+            return;
+        }
+        for (std::size_t i = 0; i < buffers.size(); ++i)
+        {
+            buffers[i].reserve(this->buffer_size);
+            if (i != current) free_buffers.push_back(i);
+        }
+        writer = std::thread(&AsyncFileWriter::run, this);
+    }
+    ~AsyncFileWriter() { finish(); }
+
+    AsyncFileWriter(AsyncFileWriter const &) = delete;
+    AsyncFileWriter &operator=(AsyncFileWriter const &) = delete;
+
+    // Returns false once any write has failed; see error().
+    bool write(char const *data, std::size_t size)
+    {
+        while (size > 0 && !failed)
+        {
+            std::vector<char> &buffer = buffers[current];
+            std::size_t count = buffer_size - buffer.size();
+            if (count > size) count = size;
+            buffer.insert(buffer.end(), data, data + count);
+            data += count;
+            size -= count;
+            if (buffer.size() == buffer_size) submit();
+        }
+        return !failed;
+    }
+    bool write(std::string const &text)
+    {
+        return write(text.data(), text.size());
+    }
+
+    // Flushes the partly filled buffer, waits for the writer thread and
+    //  closes the file.
+    bool finish()
+    {
+        if (writer.joinable())
+        {
+            if (!buffers[current].empty()) submit();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done = true;
+            }
+            changed.notify_all();
+            writer.join();
+        }
+        if (file)
+        {
+            if (std::fclose(file) != 0) fail("cannot close file");
+            file = nullptr;
+        }
+        return !failed;
+    }
+
+    // Reason for the first failure, valid after finish().
+    std::string const &error() const { return error_message; }
+
+   private:
+    std::FILE *file;
+    std::size_t buffer_size;
+    std::vector<std::vector<char>> buffers;
+    std::size_t current;
+    std::deque<std::size_t> free_buffers;
+    std::deque<std::size_t> ready_buffers;
+
+    std::atomic<bool> failed;
+    bool done;
+    std::string error_message;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread writer;
+
+    void fail(std::string const &what)
+    {
+        if (failed.exchange(true)) return;
+        error_message = what + ": " + std::strerror(errno);
+    }
+    void submit()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready_buffers.push_back(current);
+        changed.notify_all();
+        changed.wait(lock, [this] { return !free_buffers.empty(); });
+        current = free_buffers.front();
+        free_buffers.pop_front();
+    }
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            changed.wait(lock,
+                         [this] { return !ready_buffers.empty() || done; });
+            if (ready_buffers.empty()) return;
+
+            std::size_t index = ready_buffers.front();
+            ready_buffers.pop_front();
+            lock.unlock();
+
+            // After a failure buffers are still recycled so the producer
+            //  never waits forever.
+            std::vector<char> &buffer = buffers[index];
+            if (!failed && std::fwrite(buffer.data(), 1, buffer.size(),
+                                       file) != buffer.size())
+                fail("write failed");
+            buffer.clear();
+
+            lock.lock();
+            free_buffers.push_back(index);
+            changed.notify_all();
+        }
+    }
+};
+
+namespace detail
+{
+inline bool seekFile(std::FILE *file, std::int64_t offset, int origin)
+{
+#if defined(_WIN32)
+    return _fseeki64(file, offset, origin) == 0;
+#else
+    return fseeko(file, static_cast<off_t>(offset), origin) == 0;
+#endif
+}
+inline std::int64_t tellFile(std::FILE *file)
+{
+#if defined(_WIN32)
+    return _ftelli64(file);
+#else
+    return static_cast<std::int64_t>(ftello(file));
+#endif
+}
+inline bool truncateFile(std::FILE *file, std::int64_t size)
+{
+    if (std::fflush(file) != 0) return false;
+#if defined(_WIN32)
+    return _chsize_s(_fileno(file), size) == 0;
+#else
+    return ftruncate(fileno(file), static_cast<off_t>(size)) == 0;
+#endif
+}
+}  // namespace detail
+
+// An SVG file that can be appended to while staying a complete document.
+//  New shapes are written over the closing </svg> tag, which is then written
+//  again, so each append costs only the new data.  Shapes passed to add() are
+//  collected and written every flush_batch shapes.
+class SvgAppendFile
+{
+   public:
+    // A non-empty group_start, e.g. from appendGroupStart(), is written
+    //  before every batch of shapes and closed after it.
+    explicit SvgAppendFile(std::size_t flush_batch = 1,
+                           std::string const &group_start = std::string())
+        : file(nullptr),
+          body_end(0),
+          pending_count(0),
+          flush_batch(flush_batch ? flush_batch : 1),
+          group_start(group_start)
+    {
+    }
+    ~SvgAppendFile()
+    {
+        flush();
+        close();
+    }
+
+    SvgAppendFile(SvgAppendFile const &) = delete;
+    SvgAppendFile &operator=(SvgAppendFile const &) = delete;
+
+    // A missing or empty file is started with prolog.  An existing file is
+    //  continued before its closing tag; if that tag is missing because a
+    //  process died while appending, everything after the last complete line
+    //  is cut off first.
+    bool open(std::string const &file_name, std::string const &prolog)
+    {
+        close();
+        file = std::fopen(file_name.c_str(), "r+b");
+        if (!file) file = std::fopen(file_name.c_str(), "w+b");
+        if (!file) return false;
+
+        if (!detail::seekFile(file, 0, SEEK_END)) return fail();
+        std::int64_t size = detail::tellFile(file);
+        if (size == 0)
+        {
+            body_end = 0;
+            return append(prolog);
+        }
+
+        if (!findBodyEnd(size) || !detail::truncateFile(file, body_end))
+            return fail();
+        return append(std::string());
+    }
+    // Writes body in place of the closing tag, re-appends it and flushes.
+    bool append(std::string const &body)
+    {
+        if (!file) return false;
+
+        std::string const end_tag = elemEnd("svg");
+        if (!detail::seekFile(file, body_end, SEEK_SET) ||
+            std::fwrite(body.data(), 1, body.size(), file) != body.size() ||
+            std::fwrite(end_tag.data(), 1, end_tag.size(), file) !=
+                end_tag.size() ||
+            std::fflush(file) != 0)
+            return fail();
+
+        body_end += static_cast<std::int64_t>(body.size());
+        return true;
+    }
+    bool add(std::string const &node)
+    {
+        if (pending_count == 0) pending += group_start;
+        pending += node;
+        return ++pending_count < flush_batch || flush();
+    }
+    // Writes the shapes collected by add().
+    bool flush()
+    {
+        if (pending_count == 0) return file != nullptr;
+
+        if (!group_start.empty()) pending += "</g>\n";
+        bool written = append(pending);
+        pending.clear();
+        pending_count = 0;
+        return written;
+    }
+    void close()
+    {
+        if (file) std::fclose(file);
+        file = nullptr;
+    }
+    bool isOpen() const { return file != nullptr; }
+
+   private:
+    std::FILE *file;
+    // Offset at which the closing tag starts.
+    std::int64_t body_end;
+    std::string pending;
+    std::size_t pending_count;
+    std::size_t flush_batch;
+    std::string group_start;
+
+    bool fail()
+    {
+        close();
+        return false;
+    }
+    // Locates the closing tag, or the end of the last complete line after a
+    //  torn append, scanning backwards from the end of the file.
+    bool findBodyEnd(std::int64_t size)
+    {
+        std::int64_t const chunk_size = 64 * 1024;
+        std::vector<char> chunk;
+        bool trailing_space = true;
+        for (std::int64_t end = size; end > 0;)
+        {
+            std::int64_t start = end > chunk_size ? end - chunk_size : 0;
+            chunk.resize(static_cast<std::size_t>(end - start));
+            if (!detail::seekFile(file, start, SEEK_SET) ||
+                std::fread(chunk.data(), 1, chunk.size(), file) !=
+                    chunk.size())
+                return false;
+
+            for (std::size_t i = chunk.size(); i-- > 0;)
+            {
+                char c = chunk[i];
+                if (trailing_space &&
+                    (c == ' ' || c == '\n' || c == '\r' || c == '\t'))
+                    continue;
+                // The tag may straddle two chunks, so compare in the file.
+                if (trailing_space && c == '>' &&
+                    endsWithTag(start + static_cast<std::int64_t>(i) + 1))
+                    return true;
+                trailing_space = false;
+                if (c == '\n')
+                {
+                    body_end = start + static_cast<std::int64_t>(i) + 1;
+                    return true;
+                }
+            }
+            end = start;
+        }
+        return false;
+    }
+    bool endsWithTag(std::int64_t end)
+    {
+        char const tag[] = "</svg>";
+        std::int64_t const length = sizeof(tag) - 1;
+        char found[sizeof(tag) - 1];
+        if (end < length || !detail::seekFile(file, end - length, SEEK_SET) ||
+            std::fread(found, 1, sizeof(found), file) != sizeof(found) ||
+            std::memcmp(found, tag, sizeof(found)) != 0)
+            return false;
+        body_end = end - length;
+        return true;
+    }
+};
+
+struct SaveResult
+{
+    SaveResult() : ok(false) {}
+    bool ok;
+    std::string error;
+};
+
+// Refers to a save running in the background.  Dropping the last handle
+//  waits for the save to finish.
+class SaveHandle
+{
+   public:
+    SaveHandle() {}
+    explicit SaveHandle(std::shared_future<SaveResult> const &result)
+        : result(result)
+    {
+    }
+
+    bool valid() const { return result.valid(); }
+    bool ready() const
+    {
+        return result.wait_for(std::chrono::seconds(0)) ==
+               std::future_status::ready;
+    }
+    void wait() const { result.wait(); }
+    // Both block until the save has completed.
+    bool ok() const { return result.get().ok; }
+    std::string const &error() const { return result.get().error; }
+
+   private:
+    std::shared_future<SaveResult> result;
+};
+
+class Document
+{
+   public:
+    Document() : delegate_transform(false) {};
+    // With delegate_transform set, shapes are written in user coordinates
+    //  inside one <g> whose transform applies the layout; see
+    //  delegatedLayout().
+    explicit Document(std::string const &file_name,
+                      Layout const &layout = Layout(),
+                      bool delegate_transform = false)
+        : file_name(file_name),
+          layout(layout),
+          delegate_transform(delegate_transform)
+    {
+    }
+
+    // Shapes are formatted into a buffer kept between calls, so each one
+    //  costs a single allocation for its stored node.
+    Document &operator<<(Shape const &shape)
+    {
+        Layout shape_layout =
+            delegate_transform ? delegatedLayout(layout) : layout;
+        shape_layout.definition_ids = &definition_ids;
+        scratch.clear();
+        std::string key;
+#ifdef SIMPLE_SVG_ENABLE_STATS
+        // Gathered unlocked and added under the lock, so that stats() and
+        //  save() on other threads do not wait for the formatting.
+        RenderStats &shape_stats = scratch_stats;
+        std::chrono::steady_clock::time_point const lookup =
+            std::chrono::steady_clock::now();
+        if (detail::findFragment(shape, shape_layout, false, key, scratch))
+            detail::recordCached(shape, scratch.size(),
+                                 detail::elapsedNanoseconds(lookup),
+                                 shape_stats);
+        else
+        {
+            if (ShapeColl const *coll = dynamic_cast<ShapeColl const *>(&shape))
+                scratch += coll->toString(shape_layout, shape_stats);
+            else
+                detail::instrumentedAppend(shape, shape_layout, shape_stats,
+                                           scratch);
+            if (!key.empty()) detail::storeFragment(key, scratch);
+        }
+        addScratchStats();
+#else
+        if (!detail::findFragment(shape, shape_layout, false, key, scratch))
+        {
+            shape.appendTo(scratch, shape_layout);
+            if (!key.empty()) detail::storeFragment(key, scratch);
+        }
+#endif
+        addNode(std::string(scratch));
+        return *this;
+    }
+    std::string toString() const
+    {
+        std::stringstream ss;
+        writeToStream(ss);
+        return ss.str();
+    }
+    // In append mode the file is already the document; save() only writes
+    //  the pending shapes.
+    bool save() const
+    {
+        if (append_file) return append_file->flush();
+#ifdef SIMPLE_SVG_ENABLE_STATS
+        // Format first so that formatting and I/O can be timed separately.
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        std::string const content = toString();
+        std::uint64_t const format_nanoseconds =
+            detail::elapsedNanoseconds(start);
+
+        start = std::chrono::steady_clock::now();
+        std::ofstream ofs(file_name.c_str());
+        if (!ofs.good()) return false;
+
+        ofs.write(content.data(), content.size());
+        ofs.close();
+        std::uint64_t const io_nanoseconds = detail::elapsedNanoseconds(start);
+
+        recordSave(*stats_state.shared(), format_nanoseconds, io_nanoseconds,
+                   content.size());
+        return true;
+#else
+        std::ofstream ofs(file_name.c_str());
+        if (!ofs.good()) return false;
+
+        writeToStream(ofs);
+        ofs.close();
+        return true;
+#endif
+    }
+
+    // Append mode: file_name stays a complete SVG while shapes are added, for
+    //  viewers that open it during a long run.  Shapes already in the
+    //  document are written first; an existing file is continued.  Shapes
+    //  added in append mode go to the file in batches of flush_batch and are
+    //  not kept in memory.  Copies of the document share the file.  Until
+    //  endAppend(), output of any kind is read back from the file.
+    bool beginAppend(std::size_t flush_batch = 1)
+    {
+        // Under a delegated transform every batch gets its own group.
+        std::string group;
+        if (delegate_transform) appendGroupStart(group, layout);
+        std::shared_ptr<SvgAppendFile> opened =
+            std::make_shared<SvgAppendFile>(flush_batch, group);
+        if (!opened->open(file_name, documentProlog(layout))) return false;
+
+        std::string existing;
+        for (const auto &body_node_str : *body_nodes_str_list)
+            existing += body_node_str;
+        if (!existing.empty() && delegate_transform)
+            existing = group + existing + "</g>\n";
+        if (!opened->append(existing)) return false;
+
+        append_file = opened;
+        return true;
+    }
+    // Writes pending shapes now.  False if not appending or on I/O error.
+    bool flush() { return append_file && append_file->flush(); }
+    bool endAppend()
+    {
+        bool flushed = flush();
+        append_file.reset();
+        return flushed;
+    }
+
+    // Saves on a background thread; the document may be changed or destroyed
+    //  right after the call.  At most buffer_count buffers of buffer_size
+    //  bytes are in flight between formatting and the writer thread.
+    SaveHandle saveAsync(std::size_t buffer_size = 64 * 1024,
+                         std::size_t buffer_count = 2) const
+    {
+        if (append_file)
+        {
+            std::promise<SaveResult> flushed;
+            SaveResult result;
+            result.ok = append_file->flush();
+            if (!result.ok) result.error = "cannot append to " + file_name;
+            flushed.set_value(result);
+            return SaveHandle(flushed.get_future().share());
+        }
+        // The writer shares the nodes; the next shape added copies them
+        //  if it is still running.
+        std::shared_ptr<std::vector<std::string> const> body =
+            body_nodes_str_list;
+#ifdef SIMPLE_SVG_ENABLE_STATS
+        std::chrono::steady_clock::time_point const start =
+            std::chrono::steady_clock::now();
+#endif
+        std::string const header = prolog();
+        std::string const footer = epilog();
+        std::string const name = file_name;
+#ifdef SIMPLE_SVG_ENABLE_STATS
+        std::uint64_t const format_nanoseconds =
+            detail::elapsedNanoseconds(start);
+        std::shared_ptr<StatsState> const state = stats_state.shared();
+#endif
+        return SaveHandle(
+            std::async(
+                std::launch::async,
+                [=]() mutable
+                {
+#ifdef SIMPLE_SVG_ENABLE_STATS
+                    std::chrono::steady_clock::time_point const io_start =
+                        std::chrono::steady_clock::now();
+                    std::uint64_t bytes = header.size() + footer.size();
+#endif
+                    AsyncFileWriter writer(name, buffer_size, buffer_count);
+                    writer.write(header);
+                    for (auto const &node : *body)
+                    {
+                        if (!writer.write(node)) break;
+#ifdef SIMPLE_SVG_ENABLE_STATS
+                        bytes += node.size();
+#endif
+                    }
+                    // The handle keeps this function alive; let the document
+                    //  add to its nodes without copying them again.
+                    body.reset();
+                    writer.write(footer);
+
+                    SaveResult result;
+                    result.ok = writer.finish();
+                    result.error = writer.error();
+#ifdef SIMPLE_SVG_ENABLE_STATS
+                    if (result.ok)
+                        recordSave(*state, format_nanoseconds,
+                                   detail::elapsedNanoseconds(io_start),
+                                   bytes);
+#endif
+                    return result;
+                })
+                .share());
+    }
+
+    // Statistics gathered so far; all zero unless SIMPLE_SVG_ENABLE_STATS is
+    //  defined.  The callback receives them after every successful save(),
+    //  and on the writer thread after every successful saveAsync().
+    //  A copy of the document starts with the stats and callback of the
+    //  original and gathers its own from then on.
+#ifdef SIMPLE_SVG_ENABLE_STATS
+    RenderStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(stats_state->mutex);
+        return stats_state->stats;
+    }
+    void resetStats()
+    {
+        std::lock_guard<std::mutex> lock(stats_state->mutex);
+        stats_state->stats.reset();
+    }
+    void setStatsCallback(RenderStatsCallback callback)
+    {
+        std::lock_guard<std::mutex> lock(stats_state->mutex);
+        stats_state->callback = callback;
+    }
+#else
+    RenderStats stats() const { return RenderStats(); }
+    void resetStats() {}
+    void setStatsCallback(RenderStatsCallback) {}
+#endif
+
+    void writeToStream(std::ostream &str) const
+    {
+        if (append_file)
+        {
+            std::string content;
+            if (readAppended(content))
+                str << content;
+            else
+                str.setstate(std::ios::failbit);
+            return;
+        }
+        str << prolog();
+        for (const auto &body_node_str : *body_nodes_str_list)
+        {
+            str << body_node_str;
+        }
+        str << epilog();
+    }
+
+    // Everything before the first shape, up to and including <svg ...> and
+    //  the group of a delegated transform.
+    std::string prolog() const
+    {
+        std::string ret = documentProlog(layout);
+        if (delegate_transform) appendGroupStart(ret, layout);
+        return ret;
+    }
+    // Everything after the last shape.
+    std::string epilog() const
+    {
+        return delegate_transform ? "</g>\n</svg>\n" : elemEnd("svg");
+    }
+
+   private:
+    std::string file_name;
+    Layout layout;
+    bool delegate_transform;
+
+    // Shared with saveAsync() writers still running, copied on write.
+    std::shared_ptr<std::vector<std::string>> body_nodes_str_list =
+        std::make_shared<std::vector<std::string>>();
+
+#ifdef SIMPLE_SVG_ENABLE_STATS
+    // Behind a pointer for the lock, which save() takes although it is
+    //  const.  Without SIMPLE_SVG_ENABLE_STATS a document holds no stats.
+    struct StatsState
+    {
+        std::mutex mutex;
+        RenderStats stats;
+        RenderStatsCallback callback;
+    };
+    // Copying takes a snapshot into a state of its own, so that copies of
+    //  a document do not add to each other's stats.
+    class StatsHandle
+    {
+       public:
+        StatsHandle() : state(std::make_shared<StatsState>()) {}
+        StatsHandle(StatsHandle const &other) : state(other.snapshot()) {}
+        StatsHandle &operator=(StatsHandle const &other)
+        {
+            if (this != &other) state = other.snapshot();
+            return *this;
+        }
+        StatsState *operator->() const { return state.get(); }
+        // For saveAsync() writers, which may outlive the document.
+        std::shared_ptr<StatsState> const &shared() const { return state; }
+
+       private:
+        std::shared_ptr<StatsState> state;
+
+        std::shared_ptr<StatsState> snapshot() const
+        {
+            std::shared_ptr<StatsState> copy = std::make_shared<StatsState>();
+            std::lock_guard<std::mutex> lock(state->mutex);
+            copy->stats = state->stats;
+            copy->callback = state->callback;
+            return copy;
+        }
+    };
+    StatsHandle stats_state;
+    // Concurrent saves of a const document update the stats in turn; the
+    //  callback runs unlocked on a snapshot.
+    static void recordSave(StatsState &state, std::uint64_t format_nanoseconds,
+                           std::uint64_t io_nanoseconds, std::uint64_t bytes)
+    {
+        RenderStats saved;
+        RenderStatsCallback callback;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            RenderStats &render_stats = state.stats;
+            render_stats.format_nanoseconds += format_nanoseconds;
+            render_stats.io_nanoseconds += io_nanoseconds;
+            render_stats.bytes_written += bytes;
+            if (state.callback)
+            {
+                saved = render_stats;
+                callback = state.callback;
+            }
+        }
+        if (callback) callback(saved);
+    }
+
+    // What operator<< gathers for one shape.  Its entries are zeroed rather
+    //  than erased, so that adding shapes does not allocate for them.
+    RenderStats scratch_stats;
+
+    void addScratchStats()
+    {
+        std::lock_guard<std::mutex> lock(stats_state->mutex);
+        RenderStats &render_stats = stats_state->stats;
+        for (auto &entry : scratch_stats.shapes)
+        {
+            ShapeStats &gathered = entry.second;
+            if (gathered.elements || gathered.bytes)
+                render_stats.shapes[entry.first] += gathered;
+            gathered = ShapeStats();
+        }
+        render_stats.allocations += scratch_stats.allocations;
+        render_stats.format_nanoseconds += scratch_stats.format_nanoseconds;
+        render_stats.cache_hits += scratch_stats.cache_hits;
+        scratch_stats.allocations = 0;
+        scratch_stats.format_nanoseconds = 0;
+        scratch_stats.cache_hits = 0;
+    }
+#endif
+
+    std::shared_ptr<SvgAppendFile> append_file;
+    std::string scratch;
+    DefinitionIds definition_ids;
+
+    // Flushes pending shapes and reads the file written in append mode.
+    bool readAppended(std::string &content) const
+    {
+        if (!append_file->flush()) return false;
+        std::ifstream ifs(file_name.c_str(), std::ios::binary);
+        if (!ifs.good()) return false;
+        std::ostringstream ss;
+        ss << ifs.rdbuf();
+        content = ss.str();
+        return true;
+    }
+    void addNode(std::string &&node)
+    {
+        if (append_file)
+        {
+            append_file->add(node);
+            return;
+        }
+        if (body_nodes_str_list.use_count() > 1)
+            body_nodes_str_list = std::make_shared<std::vector<std::string>>(
+                *body_nodes_str_list);
+        body_nodes_str_list->push_back(std::move(node));
+    }
+
+    friend class DocumentReader;
+    friend class DocumentBuilder;
+};
+
+// Builds one document from several threads.  Each thread takes its own
+//  Producer and serializes shapes into it without any locking; merging
+//  orders everything by layer, then sequence number, then the stream id the
+//  producer was created with, so the output does not depend on thread
+//  timing.  By default a producer numbers its shapes 0, 1, 2, ..., so
+//  producers sharing a layer take turns in stream order unless they pass
+//  sequence numbers of their own.
+class DocumentBuilder
+{
+   public:
+    class Producer
+    {
+       public:
+        Producer &operator<<(Shape const &shape)
+        {
+            return add(shape, next_sequence);
+        }
+        Producer &add(Shape const &shape, std::uint64_t sequence)
+        {
+            Node node;
+            node.sequence = sequence;
+            std::string key;
+            if (!detail::findFragment(shape, layout, false, key, node.svg))
+            {
+                node.svg = shape.toString(layout);
+                detail::storeFragment(key, node.svg);
+            }
+            nodes.push_back(std::move(node));
+            next_sequence = sequence + 1;
+            return *this;
+        }
+
+        int layer() const { return layer_id; }
+        std::uint64_t stream() const { return stream_id; }
+        std::size_t size() const { return nodes.size(); }
+
+       private:
+        struct Node
+        {
+            std::uint64_t sequence;
+            std::string svg;
+        };
+
+        Producer(Layout const &layout, int layer, std::uint64_t stream,
+                 std::uint64_t scope)
+            : layout(layout),
+              layer_id(layer),
+              stream_id(stream),
+              next_sequence(0),
+              definition_ids(scope)
+        {
+            this->layout.definition_ids = &definition_ids;
+        }
+        Producer(Producer const &) = delete;
+        Producer &operator=(Producer const &) = delete;
+
+        Layout layout;
+        int const layer_id;
+        std::uint64_t const stream_id;
+        std::uint64_t next_sequence;
+        std::vector<Node> nodes;
+        // Scoped by producer, so ids do not collide in the merged document.
+        DefinitionIds definition_ids;
+
+        friend class DocumentBuilder;
+    };
+
+    // delegate_transform should match the Document merged into.
+    explicit DocumentBuilder(Layout const &layout = Layout(),
+                             bool delegate_transform = false)
+        : layout(delegate_transform ? delegatedLayout(layout) : layout)
+    {
+    }
+    DocumentBuilder(DocumentBuilder const &) = delete;
+    DocumentBuilder &operator=(DocumentBuilder const &) = delete;
+
+    // A producer for one thread at a time, valid as long as the builder.
+    //  Taking one briefly locks; using it does not.  stream tells apart the
+    //  producers of a layer and should be unique within it, e.g. the index
+    //  of the thread.
+    Producer &producer(int layer, std::uint64_t stream)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        producers.push_back(std::unique_ptr<Producer>(
+            new Producer(layout, layer, stream, producers.size() + 1)));
+        return *producers.back();
+    }
+
+    // Moves everything produced so far into document, which should use the
+    //  same layout.  All producer threads must have finished.
+    void mergeInto(Document &document)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        struct Entry
+        {
+            int layer;
+            std::uint64_t sequence;
+            std::uint64_t stream;
+            std::string *svg;
+        };
+        std::vector<Entry> order;
+        for (auto const &producer : producers)
+            for (auto &node : producer->nodes)
+            {
+                Entry entry = {producer->layer_id, node.sequence,
+                               producer->stream_id, &node.svg};
+                order.push_back(entry);
+            }
+        // Stable, so that a producer's shapes of one sequence number keep
+        //  their order.
+        std::stable_sort(order.begin(), order.end(),
+                         [](Entry const &a, Entry const &b)
+                         {
+                             if (a.layer != b.layer) return a.layer < b.layer;
+                             if (a.sequence != b.sequence)
+                                 return a.sequence < b.sequence;
+                             return a.stream < b.stream;
+                         });
+
+        for (auto const &entry : order) document.addNode(std::move(*entry.svg));
+        for (auto const &producer : producers) producer->nodes.clear();
+    }
+
+   private:
+    // What producers format with.
+    Layout const layout;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Producer>> producers;
+};
+
+// Pulls the XML of a document in pieces of bounded size, e.g. to stream it
+//  over a socket as the peer accepts data.  Over a ShapeColl each shape is
+//  only serialized when the reader gets to it, so the first bytes are
+//  available long before the whole document would be.  The source must
+//  outlive the reader and stay unchanged while it is used.  A document in
+//  append mode is read back from its file in one piece; if that fails the
+//  reader yields nothing and ok() is false.
+class DocumentReader
+{
+   public:
+    explicit DocumentReader(Document const &document)
+        : document(&document),
+          shapes(nullptr),
+          layout(document.layout),
+          next_piece(0),
+          data(nullptr),
+          size(0),
+          offset(0)
+    {
+        if (document.append_file)
+        {
+            if (!document.readAppended(owned))
+            {
+                owned.clear();
+                error_message = "cannot read " + document.file_name;
+            }
+            setPiece(owned);
+            next_piece = bodyCount() + 2;
+        }
+    }
+    DocumentReader(ShapeColl const &shapes, Layout const &layout)
+        : document(nullptr),
+          shapes(&shapes),
+          layout(layout),
+          next_piece(0),
+          data(nullptr),
+          size(0),
+          offset(0)
+    {
+    }
+
+    // Copies up to max_bytes of the remaining output to buffer and returns
+    //  the number of bytes copied, 0 once the document is complete.  Each
+    //  call resumes exactly where the previous one stopped.
+    std::size_t nextChunk(char *buffer, std::size_t max_bytes)
+    {
+        std::size_t copied = 0;
+        while (copied < max_bytes)
+        {
+            if (offset == size && !loadNextPiece()) break;
+
+            std::size_t count = size - offset;
+            if (count > max_bytes - copied) count = max_bytes - copied;
+            std::memcpy(buffer + copied, data + offset, count);
+            offset += count;
+            copied += count;
+        }
+        return copied;
+    }
+    // Whether the whole document has been read, which it never is after a
+    //  failure.
+    bool done() const
+    {
+        return ok() && offset == size && next_piece > bodyCount() + 1;
+    }
+    bool ok() const { return error_message.empty(); }
+    std::string const &error() const { return error_message; }
+
+   private:
+    Document const *document;
+    ShapeColl const *shapes;
+    Layout layout;
+    DefinitionIds definition_ids;
+
+    // 0 is the prolog, 1..bodyCount() the shapes and bodyCount() + 1 the
+    //  closing tag.
+    std::size_t next_piece;
+    std::string owned;
+    char const *data;
+    std::size_t size;
+    std::size_t offset;
+    std::string error_message;
+
+    std::size_t bodyCount() const
+    {
+        return document ? document->body_nodes_str_list->size()
+                        : shapes->size();
+    }
+    bool loadNextPiece()
+    {
+        std::size_t const count = bodyCount();
+        // Empty pieces (e.g. an empty LineChart) are skipped.
+        while (next_piece <= count + 1)
+        {
+            std::size_t const piece = next_piece++;
+            if (document && piece >= 1 && piece <= count)
+            {
+                setPiece((*document->body_nodes_str_list)[piece - 1]);
+            }
+            else
+            {
+                if (piece == 0)
+                    owned = document ? document->prolog()
+                                     : documentProlog(layout);
+                else if (piece == count + 1)
+                    owned = document ? document->epilog() : elemEnd("svg");
+                else
+                {
+                    layout.definition_ids = &definition_ids;
+                    owned = (*shapes)[piece - 1]->toString(layout);
+                }
+                setPiece(owned);
+            }
+            if (size != 0) return true;
+        }
+        return false;
+    }
+    void setPiece(std::string const &piece)
+    {
+        data = piece.data();
+        size = piece.size();
+        offset = 0;
+    }
+};
+
+// A document of one scene for BatchRenderer.  The SVG goes to *output when
+//  that is set, otherwise to the file destination.  The scene must stay
+//  alive and unchanged until render() returns; jobs may share scenes.
+struct RenderJob
+{
+    RenderJob(Shape const &scene, Layout const &layout,
+              std::string const &destination)
+        : scene(&scene), layout(layout), destination(destination),
+          output(nullptr)
+    {
+    }
+    RenderJob(Shape const &scene, Layout const &layout, std::string *output)
+        : scene(&scene), layout(layout), output(output)
+    {
+    }
+
+    Shape const *scene;
+    Layout layout;
+    std::string destination;
+    std::string *output;
+};
+
+// Throughput and latency of one BatchRenderer::render() call.  Latency is
+//  measured per job, from the start of formatting to the end of the write.
+//  Failed jobs are not counted in bytes.
+struct BatchStats
+{
+    BatchStats()
+        : jobs(0),
+          failed(0),
+          bytes(0),
+          nanoseconds(0),
+          p50_nanoseconds(0),
+          p99_nanoseconds(0),
+          max_nanoseconds(0)
+    {
+    }
+
+    std::uint64_t jobs;
+    std::uint64_t failed;
+    std::uint64_t bytes;
+    std::uint64_t nanoseconds;
+    std::uint64_t p50_nanoseconds;
+    std::uint64_t p99_nanoseconds;
+    std::uint64_t max_nanoseconds;
+
+    double jobsPerSecond() const
+    {
+        return nanoseconds ? jobs * 1e9 / nanoseconds : 0;
+    }
+};
+
+// Renders many small documents on a pool of worker threads that lives as
+//  long as the renderer.  Each worker formats into a buffer it keeps between
+//  jobs and batches, and writes each file with a single unbuffered fwrite,
+//  so the cost per document is little more than its shapes.  The output is
+//  the same as saving a Document holding the scene.
+class BatchRenderer
+{
+   public:
+    // Zero threads uses one per hardware thread.
+    explicit BatchRenderer(std::size_t thread_count = 0)
+        : batch(nullptr), next(0), busy(0), generation(0), stopping(false)
+    {
+        if (thread_count == 0)
+            thread_count = std::thread::hardware_concurrency();
+        if (thread_count == 0) thread_count = 1;
+        for (std::size_t i = 0; i < thread_count; ++i)
+            workers.emplace_back(new Worker());
+        for (auto &worker : workers)
+            worker->thread = std::thread(&BatchRenderer::run, this,
+                                         std::ref(*worker));
+    }
+    ~BatchRenderer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        for (auto &worker : workers) worker->thread.join();
+    }
+
+    BatchRenderer(BatchRenderer const &) = delete;
+    BatchRenderer &operator=(BatchRenderer const &) = delete;
+
+    // Renders every job and returns once all are done.  Not to be called
+    //  from several threads at once.
+    BatchStats render(std::vector<RenderJob> const &jobs)
+    {
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            batch = &jobs;
+            next = 0;
+            busy = workers.size();
+            ++generation;
+            changed.notify_all();
+            finished.wait(lock, [this] { return busy == 0; });
+            batch = nullptr;
+        }
+
+        BatchStats stats;
+        stats.nanoseconds = detail::elapsedNanoseconds(start);
+        latencies.clear();
+        for (auto const &worker : workers)
+        {
+            stats.failed += worker->failed;
+            stats.bytes += worker->bytes;
+            latencies.insert(latencies.end(), worker->latencies.begin(),
+                             worker->latencies.end());
+        }
+        stats.jobs = latencies.size();
+        if (!latencies.empty())
+        {
+            stats.p50_nanoseconds = percentile(0.5);
+            stats.p99_nanoseconds = percentile(0.99);
+            stats.max_nanoseconds =
+                *std::max_element(latencies.begin(), latencies.end());
+        }
+        return stats;
+    }
+
+    std::size_t threadCount() const { return workers.size(); }
+
+   private:
+    struct Worker
+    {
+        Worker() : failed(0), bytes(0) {}
+
+        std::thread thread;
+        std::string buffer;
+        std::vector<std::uint64_t> latencies;
+        std::uint64_t failed;
+        std::uint64_t bytes;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<RenderJob> const *batch;
+    std::atomic<std::size_t> next;
+    std::size_t busy;
+    std::uint64_t generation;
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::condition_variable finished;
+    std::vector<std::uint64_t> latencies;
+
+    std::uint64_t percentile(double fraction)
+    {
+        std::size_t index =
+            static_cast<std::size_t>(fraction * (latencies.size() - 1));
+        std::nth_element(latencies.begin(), latencies.begin() + index,
+                         latencies.end());
+        return latencies[index];
+    }
+
+    void run(Worker &worker)
+    {
+        std::uint64_t seen = 0;
+        for (;;)
+        {
+            std::vector<RenderJob> const *jobs;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]
+                             { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                jobs = batch;
+            }
+
+            worker.latencies.clear();
+            worker.failed = 0;
+            worker.bytes = 0;
+            for (std::size_t index = next++; index < jobs->size();
+                 index = next++)
+                renderJob((*jobs)[index], worker);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0) finished.notify_all();
+        }
+    }
+
+    static void renderJob(RenderJob const &job, Worker &worker)
+    {
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        std::string &out = job.output ? *job.output : worker.buffer;
+        out.clear();
+        appendDocumentProlog(out, job.layout);
+        // Each job is a document of its own.
+        DefinitionIds definition_ids;
+        Layout layout = job.layout;
+        layout.definition_ids = &definition_ids;
+        job.scene->appendTo(out, layout);
+        out += "</svg>\n";
+
+        if (!job.output && !writeFile(job.destination, out))
+            ++worker.failed;
+        else
+            worker.bytes += out.size();
+        worker.latencies.push_back(detail::elapsedNanoseconds(start));
+    }
+
+    static bool writeFile(std::string const &file_name,
+                          std::string const &content)
+    {
+        std::FILE *file = std::fopen(file_name.c_str(), "wb");
+        if (!file) return false;
+
+        std::setvbuf(file, nullptr, _IONBF, 0);
+        bool written = std::fwrite(content.data(), 1, content.size(), file) ==
+                       content.size();
+        return std::fclose(file) == 0 && written;
+    }
+};
+
+// Reading SVG back.  The parser understands the subset this library writes:
+//  elements, attributes in single or double quotes, character data and the
+//  predefined and numeric entities.  Processing instructions, comments and
+//  the DOCTYPE are skipped; it does not validate.
+
+// A piece of the parsed input, referred to in place.
+struct XmlSlice
+{
+    XmlSlice() : data(nullptr), size(0) {}
+    XmlSlice(char const *data, std::size_t size) : data(data), size(size) {}
+
+    bool empty() const { return size == 0; }
+    // False for an attribute that is not there, true for an empty one.
+    bool present() const { return data != nullptr; }
+    bool operator==(char const *text) const
+    {
+        return std::strlen(text) == size &&
+               (size == 0 || std::memcmp(data, text, size) == 0);
+    }
+    bool operator!=(char const *text) const { return !(*this == text); }
+    std::string str() const
+    {
+        return data ? std::string(data, size) : std::string();
+    }
+
+    char const *data;
+    std::size_t size;
+};
+
+// Pull parser over a buffer that must outlive it.  Names, values and text
+//  point into the buffer, attribute values and text still escaped.  A
+//  self-closing element is reported as StartElement followed by EndElement.
+class SvgPullParser
+{
+   public:
+    enum Event
+    {
+        StartElement,
+        EndElement,
+        Text,
+        EndOfInput,
+        Error
+    };
+
+    SvgPullParser(char const *data, std::size_t size)
+        : begin(data),
+          pos(data),
+          end(data + size),
+          pending_end(false),
+          error_message(nullptr)
+    {
+    }
+
+    // Error is final: every later call returns it again.
+    Event next()
+    {
+        attributes.clear();
+        if (error_message) return Error;
+        if (pending_end)
+        {
+            pending_end = false;
+            return EndElement;
+        }
+        while (pos < end)
+        {
+            if (*pos != '<')
+            {
+                char const *tag = static_cast<char const *>(
+                    std::memchr(pos, '<', static_cast<std::size_t>(end - pos)));
+                if (!tag) tag = end;
+                current_text = XmlSlice(pos, static_cast<std::size_t>(tag - pos));
+                pos = tag;
+                return Text;
+            }
+            if (pos + 1 == end) return fail("unterminated tag");
+
+            char const marker = pos[1];
+            if (marker == '?')
+            {
+                if (!skipPast("?>")) return fail("unterminated declaration");
+            }
+            else if (marker == '!')
+            {
+                bool const comment = end - pos >= 4 &&
+                                     std::memcmp(pos, "<!--", 4) == 0;
+                if (!skipPast(comment ? "-->" : ">"))
+                    return fail("unterminated markup declaration");
+            }
+            else if (marker == '/')
+            {
+                pos += 2;
+                current_name = readName();
+                skipSpace();
+                if (pos == end || *pos != '>') return fail("malformed end tag");
+                ++pos;
+                return EndElement;
+            }
+            else
+                return readStartTag();
+        }
+        return EndOfInput;
+    }
+
+    // Element name for StartElement and EndElement.
+    XmlSlice const &name() const { return current_name; }
+    // Raw character data for Text.
+    XmlSlice const &text() const { return current_text; }
+
+    // Attributes of the last StartElement.
+    std::size_t attributeCount() const { return attributes.size(); }
+    XmlSlice const &attributeName(std::size_t index) const
+    {
+        return attributes[index].first;
+    }
+    XmlSlice const &attributeValue(std::size_t index) const
+    {
+        return attributes[index].second;
+    }
+    // Not present() if the element has no such attribute.
+    XmlSlice attribute(char const *attribute_name) const
+    {
+        for (auto const &attr : attributes)
+            if (attr.first == attribute_name) return attr.second;
+        return XmlSlice();
+    }
+
+    // Byte offset reached in the input, and why the last Error occurred.
+    std::size_t offset() const { return static_cast<std::size_t>(pos - begin); }
+    char const *error() const { return error_message; }
+
+   private:
+    char const *begin;
+    char const *pos;
+    char const *end;
+    bool pending_end;
+    char const *error_message;
+    XmlSlice current_name;
+    XmlSlice current_text;
+    std::vector<std::pair<XmlSlice, XmlSlice>> attributes;
+
+    static bool isSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+    static bool endsName(char c)
+    {
+        return isSpace(c) || c == '=' || c == '/' || c == '>';
+    }
+
+    Event fail(char const *message)
+    {
+        error_message = message;
+        return Error;
+    }
+    void skipSpace()
+    {
+        while (pos < end && isSpace(*pos)) ++pos;
+    }
+    XmlSlice readName()
+    {
+        char const *start = pos;
+        while (pos < end && !endsName(*pos)) ++pos;
+        return XmlSlice(start, static_cast<std::size_t>(pos - start));
+    }
+    bool skipPast(char const *terminator)
+    {
+        std::size_t const length = std::strlen(terminator);
+        for (char const *p = pos + 2; p + length <= end; ++p)
+            if (std::memcmp(p, terminator, length) == 0)
+            {
+                pos = p + length;
+                return true;
+            }
+        return false;
+    }
+    Event readStartTag()
+    {
+        ++pos;
+        current_name = readName();
+        if (current_name.empty()) return fail("missing element name");
+        for (;;)
+        {
+            skipSpace();
+            if (pos == end) return fail("unterminated start tag");
+            if (*pos == '>')
+            {
+                ++pos;
+                return StartElement;
+            }
+            if (*pos == '/')
+            {
+                if (pos + 1 == end || pos[1] != '>')
+                    return fail("malformed empty element");
+                pos += 2;
+                pending_end = true;
+                return StartElement;
+            }
+
+            XmlSlice attribute_name = readName();
+            skipSpace();
+            if (attribute_name.empty() || pos == end || *pos != '=')
+                return fail("malformed attribute");
+            ++pos;
+            skipSpace();
+            if (pos == end || (*pos != '"' && *pos != '\''))
+                return fail("unquoted attribute value");
+            char const *value = pos + 1;
+            char const *quote = static_cast<char const *>(std::memchr(
+                value, *pos, static_cast<std::size_t>(end - value)));
+            if (!quote) return fail("unterminated attribute value");
+            attributes.push_back(std::make_pair(
+                attribute_name,
+                XmlSlice(value, static_cast<std::size_t>(quote - value))));
+            pos = quote + 1;
+        }
+    }
+};
+
+// Read-only view of a whole file, memory mapped where the platform allows
+//  it and read into memory otherwise.
+class MappedFile
+{
+   public:
+    explicit MappedFile(std::string const &file_name)
+        : mapped(nullptr), length(0)
+    {
+#if defined(_WIN32)
+        readAll(file_name);
+#else
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            error_message = std::strerror(errno);
+            return;
+        }
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            void *view = ::mmap(nullptr, static_cast<std::size_t>(info.st_size),
+                                PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view != MAP_FAILED)
+            {
+                mapped = static_cast<char const *>(view);
+                length = static_cast<std::size_t>(info.st_size);
+            }
+        }
+        ::close(fd);
+        // Not a regular file, or mapping refused: fall back to reading.
+        if (!mapped) readAll(file_name);
+#endif
+    }
+    ~MappedFile()
+    {
+#if !defined(_WIN32)
+        if (mapped) ::munmap(const_cast<char *>(mapped), length);
+#endif
+    }
+    MappedFile(MappedFile const &) = delete;
+    MappedFile &operator=(MappedFile const &) = delete;
+
+    bool isOpen() const { return error_message.empty(); }
+    std::string const &error() const { return error_message; }
+    char const *data() const { return mapped ? mapped : contents.data(); }
+    std::size_t size() const { return mapped ? length : contents.size(); }
+
+   private:
+    char const *mapped;
+    std::size_t length;
+    std::string contents;
+    std::string error_message;
+
+    void readAll(std::string const &file_name)
+    {
+        std::ifstream ifs(file_name.c_str(), std::ios::binary);
+        if (!ifs.good())
+        {
+            error_message = "cannot open " + file_name;
+            return;
+        }
+        std::ostringstream ss;
+        ss << ifs.rdbuf();
+        contents = ss.str();
+    }
+};
+
+namespace detail
+{
+// Parses a decimal number at p and moves p past it.  Numbers of up to 15
+//  significant digits, which covers everything "%g" writes, are converted
+//  exactly with one rounding; longer ones go through strtod.
+inline bool parseNumber(char const *&p, char const *end, double &value)
+{
+    static double const powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                    1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                    1e18, 1e19, 1e20, 1e21, 1e22};
+    char const *start = p;
+    char const *q = p;
+    bool negative = false;
+    if (q < end && (*q == '-' || *q == '+')) negative = *q++ == '-';
+
+    std::uint64_t mantissa = 0;
+    int significant = 0;
+    int exponent = 0;
+    bool digits = false;
+    for (; q < end && *q >= '0' && *q <= '9'; ++q, digits = true)
+    {
+        mantissa = mantissa * 10 + static_cast<unsigned>(*q - '0');
+        if (mantissa) ++significant;
+    }
+    if (q < end && *q == '.')
+        for (++q; q < end && *q >= '0' && *q <= '9'; ++q, digits = true)
+        {
+            mantissa = mantissa * 10 + static_cast<unsigned>(*q - '0');
+            if (mantissa) ++significant;
+            --exponent;
+        }
+    if (!digits) return false;
+
+    if (q < end && (*q == 'e' || *q == 'E'))
+    {
+        char const *e = q + 1;
+        bool negative_exponent = false;
+        if (e < end && (*e == '-' || *e == '+'))
+            negative_exponent = *e++ == '-';
+        if (e < end && *e >= '0' && *e <= '9')
+        {
+            int written = 0;
+            for (; e < end && *e >= '0' && *e <= '9'; ++e)
+                if (written < 10000) written = written * 10 + (*e - '0');
+            exponent += negative_exponent ? -written : written;
+            q = e;
+        }
+    }
+    p = q;
+
+    if (significant > 15 || exponent > 22 || exponent < -22)
+    {
+        value = std::strtod(std::string(start, q).c_str(), nullptr);
+        return true;
+    }
+    double magnitude = exponent < 0
+                           ? static_cast<double>(mantissa) / powers[-exponent]
+                           : static_cast<double>(mantissa) * powers[exponent];
+    value = negative ? -magnitude : magnitude;
+    return true;
+}
+
+inline bool parseNumber(XmlSlice const &slice, double &value)
+{
+    char const *p = slice.data;
+    char const *end = p + slice.size;
+    while (p < end && *p == ' ') ++p;
+    return p != end && parseNumber(p, end, value);
+}
+
+inline void skipSeparators(char const *&p, char const *end)
+{
+    while (p < end && (*p == ' ' || *p == ',' || *p == '\t' || *p == '\n' ||
+                       *p == '\r'))
+        ++p;
+}
+
+// "x,y x,y ..." as in points="...".
+inline bool parsePointList(XmlSlice const &slice, std::vector<Point> &points)
+{
+    char const *p = slice.data;
+    char const *end = p + slice.size;
+    for (;;)
+    {
+        skipSeparators(p, end);
+        if (p == end) return true;
+
+        Point point;
+        if (!parseNumber(p, end, point.x)) return false;
+        skipSeparators(p, end);
+        if (!parseNumber(p, end, point.y)) return false;
+        points.push_back(point);
+    }
+}
+
+inline LayoutTransform identityTransform()
+{
+    LayoutTransform m;
+    m.a = m.d = 1;
+    m.e = m.f = 0;
+    return m;
+}
+// m with inner applied first, as in transform="outer inner".
+inline LayoutTransform combineTransforms(LayoutTransform const &m,
+                                         LayoutTransform const &inner)
+{
+    LayoutTransform ret;
+    ret.a = m.a * inner.a;
+    ret.d = m.d * inner.d;
+    ret.e = m.a * inner.e + m.e;
+    ret.f = m.d * inner.f + m.f;
+    return ret;
+}
+
+// A transform list of matrix(), translate() and scale() without rotation
+//  or skew, as in transform="...".  False for anything else.
+inline bool parseTransform(XmlSlice const &slice, LayoutTransform &m)
+{
+    char const *p = slice.data;
+    char const *end = p + slice.size;
+    m = identityTransform();
+    for (;;)
+    {
+        skipSeparators(p, end);
+        if (p == end) return true;
+
+        char const *name = p;
+        while (p < end && *p >= 'a' && *p <= 'z') ++p;
+        XmlSlice const function(name, static_cast<std::size_t>(p - name));
+        while (p < end && *p == ' ') ++p;
+        if (p == end || *p++ != '(') return false;
+        double args[6];
+        std::size_t count = 0;
+        for (;;)
+        {
+            skipSeparators(p, end);
+            if (p < end && *p == ')') break;
+            if (count == 6 || !parseNumber(p, end, args[count++]))
+                return false;
+        }
+        ++p;
+
+        LayoutTransform t;
+        if (function == "matrix" && count == 6 && args[1] == 0 &&
+            args[2] == 0)
+        {
+            t.a = args[0];
+            t.d = args[3];
+            t.e = args[4];
+            t.f = args[5];
+        }
+        else if (function == "translate" && (count == 1 || count == 2))
+        {
+            t.a = t.d = 1;
+            t.e = args[0];
+            t.f = count == 2 ? args[1] : 0;
+        }
+        else if (function == "scale" && (count == 1 || count == 2))
+        {
+            t.a = args[0];
+            t.d = count == 2 ? args[1] : args[0];
+            t.e = t.f = 0;
+        }
+        else
+            return false;
+        m = combineTransforms(m, t);
+    }
+}
+
+struct PathData
+{
+    std::vector<std::vector<Point>> subpaths;
+    std::vector<bool> closed;
+    // As in Path, the index of the first control point of each cubic.
+    std::vector<std::vector<std::size_t>> curves;
+};
+
+// Path data of straight lines and cubic Beziers: M, L, H, V, C and Z,
+//  absolute and relative.  False for other curves and arcs.
+inline bool parsePathData(XmlSlice const &slice, PathData &path)
+{
+    char const *p = slice.data;
+    char const *end = p + slice.size;
+    char command = 0;
+    Point current(0, 0);
+    Point start(0, 0);
+    for (;;)
+    {
+        skipSeparators(p, end);
+        if (p == end) return true;
+
+        char c = *p;
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+        {
+            ++p;
+            command = c;
+            if (c == 'z' || c == 'Z')
+            {
+                if (!path.closed.empty()) path.closed.back() = true;
+                current = start;
+                command = 0;
+            }
+            continue;
+        }
+
+        bool const relative = command >= 'a';
+        double first, second = 0;
+        if (!parseNumber(p, end, first)) return false;
+        switch (command)
+        {
+            case 'M':
+            case 'm':
+            case 'L':
+            case 'l':
+                skipSeparators(p, end);
+                if (!parseNumber(p, end, second)) return false;
+                current = relative ? Point(current.x + first,
+                                           current.y + second)
+                                   : Point(first, second);
+                if (command == 'M' || command == 'm')
+                {
+                    path.subpaths.push_back(std::vector<Point>());
+                    path.closed.push_back(false);
+                    path.curves.push_back(std::vector<std::size_t>());
+                    start = current;
+                    // Further pairs are implicit line-tos.
+                    command = relative ? 'l' : 'L';
+                }
+                break;
+            case 'H':
+            case 'h':
+                current.x = relative ? current.x + first : first;
+                break;
+            case 'V':
+            case 'v':
+                current.y = relative ? current.y + first : first;
+                break;
+            case 'C':
+            case 'c':
+            {
+                double rest[5];
+                for (int i = 0; i < 5; ++i)
+                {
+                    skipSeparators(p, end);
+                    if (!parseNumber(p, end, rest[i])) return false;
+                }
+                if (path.subpaths.empty()) return false;
+                Point const base = relative ? current : Point(0, 0);
+                std::vector<Point> &subpath = path.subpaths.back();
+                path.curves.back().push_back(subpath.size());
+                subpath.push_back(Point(base.x + first, base.y + rest[0]));
+                subpath.push_back(Point(base.x + rest[1], base.y + rest[2]));
+                current = Point(base.x + rest[3], base.y + rest[4]);
+                break;
+            }
+            default:
+                return false;
+        }
+        if (path.subpaths.empty()) return false;
+        path.subpaths.back().push_back(current);
+    }
+}
+
+inline int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// "none", "#rgb", "#rrggbb" or "rgb(r,g,b)", with opacity in [0, 1].
+inline bool parseColor(XmlSlice const &value, XmlSlice const &opacity,
+                       Color &color)
+{
+    int rgb[3];
+    if (value == "none")
+    {
+        color = Color(Color::Transparent);
+        return true;
+    }
+    if ((value.size == 4 || value.size == 7) && value.data[0] == '#')
+    {
+        std::size_t const width = value.size == 4 ? 1 : 2;
+        for (std::size_t i = 0; i < 3; ++i)
+        {
+            int high = hexDigit(value.data[1 + i * width]);
+            int low = hexDigit(value.data[1 + i * width + width - 1]);
+            if (high < 0 || low < 0) return false;
+            rgb[i] = high * 16 + low;
+        }
+    }
+    else if (value.size > 4 && std::memcmp(value.data, "rgb(", 4) == 0)
+    {
+        char const *p = value.data + 4;
+        char const *end = value.data + value.size;
+        for (std::size_t i = 0; i < 3; ++i)
+        {
+            skipSeparators(p, end);
+            double channel;
+            if (!parseNumber(p, end, channel)) return false;
+            rgb[i] = static_cast<int>(channel);
+        }
+    }
+    else
+        return false;
+
+    double alpha = 1;
+    if (opacity.present() && !parseNumber(opacity, alpha)) alpha = 1;
+    color = Color(rgb[0], rgb[1], rgb[2],
+                  static_cast<int>(std::lround(alpha * 255)));
+    return true;
+}
+
+inline void appendUtf8(std::string &out, unsigned long code)
+{
+    if (code < 0x80)
+        out += static_cast<char>(code);
+    else if (code < 0x800)
+    {
+        out += static_cast<char>(0xC0 | (code >> 6));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    }
+    else if (code < 0x10000)
+    {
+        out += static_cast<char>(0xE0 | (code >> 12));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    }
+    else
+    {
+        out += static_cast<char>(0xF0 | (code >> 18));
+        out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    }
+}
+}  // namespace detail
+
+// The inverse of appendXmlEscaped, also decoding numeric references.
+//  Unknown entities are kept as they are.
+inline void appendXmlUnescaped(std::string &out, char const *text,
+                               std::size_t size)
+{
+    static char const *const names[] = {"lt;", "gt;", "amp;", "quot;",
+                                        "apos;"};
+    static char const characters[] = {'<', '>', '&', '"', '\''};
+    char const *end = text + size;
+    while (text < end)
+    {
+        char const *amp = static_cast<char const *>(
+            std::memchr(text, '&', static_cast<std::size_t>(end - text)));
+        if (!amp)
+        {
+            out.append(text, end);
+            return;
+        }
+        out.append(text, amp);
+        text = amp + 1;
+
+        char const *semicolon = static_cast<char const *>(
+            std::memchr(text, ';', static_cast<std::size_t>(end - text)));
+        std::size_t const length =
+            semicolon ? static_cast<std::size_t>(semicolon - text) + 1 : 0;
+        bool decoded = false;
+        if (length > 2 && text[0] == '#')
+        {
+            bool const hex = text[1] == 'x' || text[1] == 'X';
+            unsigned long code = 0;
+            decoded = true;
+            for (char const *p = text + (hex ? 2 : 1); p < semicolon; ++p)
+            {
+                int digit = hex ? detail::hexDigit(*p)
+                                : (*p >= '0' && *p <= '9' ? *p - '0' : -1);
+                if (digit < 0 || code > 0x10FFFF) decoded = false;
+                code = code * (hex ? 16 : 10) + static_cast<unsigned>(digit);
+            }
+            if (decoded) detail::appendUtf8(out, code);
+        }
+        else
+            for (std::size_t i = 0; i < 5 && !decoded; ++i)
+                if (std::strlen(names[i]) == length &&
+                    std::memcmp(text, names[i], length) == 0)
+                {
+                    out += characters[i];
+                    decoded = true;
+                }
+
+        if (decoded)
+            text += length;
+        else
+            out += '&';
+    }
+}
+
+struct LoadResult
+{
+    LoadResult() : ok(false), skipped(0) {}
+    bool ok;
+    std::string error;
+    // Top left origin at scale 1 in the size of the loaded document, so that
+    //  the shapes render where they were read from.
+    Layout layout;
+    ShapeColl shapes;
+    // Elements that are not shapes this library writes, e.g. arcs or
+    //  <use>, and the contents of <defs>.  Groups are loaded as their
+    //  contents with the group transform applied; a group or shape
+    //  transformed by more than a translation and a uniform scale, and
+    //  mirrored text, are skipped whole.
+    std::size_t skipped;
+};
+
+// Rebuilds shapes from SVG in the form this library writes, for example to
+//  merge cached documents or render them again with a different layout.
+//  Coordinates are those of the SVG viewport, with the transforms in the
+//  file applied, so delegated transforms load too.  Straight paths whose subpaths are
+//  not all closed (clipped polylines) come back as one Polyline per subpath.
+class SvgLoader
+{
+   public:
+    SvgLoader(char const *data, std::size_t size)
+        : parser(data, size),
+          skip_depth(0),
+          transform(detail::identityTransform()),
+          transformed(false)
+    {
+    }
+
+    LoadResult load()
+    {
+        LoadResult result;
+        result.layout = Layout(Dimensions(), Layout::TopLeft);
+        for (;;)
+        {
+            switch (parser.next())
+            {
+                case SvgPullParser::StartElement:
+                    open_elements.push_back(parser.name());
+                    if (skip_depth == 0) startElement(result);
+                    if (!result.error.empty()) return result;
+                    break;
+                case SvgPullParser::EndElement:
+                    if (!endElement(result)) return result;
+                    break;
+                case SvgPullParser::Text:
+                    break;
+                case SvgPullParser::EndOfInput:
+                    if (depth() != 0)
+                    {
+                        std::ostringstream ss;
+                        ss << "unclosed element at byte " << parser.offset();
+                        result.error = ss.str();
+                        return result;
+                    }
+                    result.ok = true;
+                    return result;
+                case SvgPullParser::Error:
+                {
+                    std::ostringstream ss;
+                    ss << parser.error() << " at byte " << parser.offset();
+                    result.error = ss.str();
+                    return result;
+                }
+            }
+        }
+    }
+
+   private:
+    SvgPullParser parser;
+    // Names of the elements from the root to the current one, which end
+    //  tags must match.
+    std::vector<XmlSlice> open_elements;
+    // Depth of an element whose contents are ignored, 0 if none.
+    std::size_t skip_depth;
+    // Maps the coordinates of the element being loaded to the viewport:
+    //  its own transform and those of the groups around it.
+    LayoutTransform transform;
+    bool transformed;
+    // The depth of each open group and the transform inside it.
+    std::vector<std::pair<std::size_t, LayoutTransform>> groups;
+
+    std::size_t depth() const { return open_elements.size(); }
+    // Closes the current element for an EndElement event; false, with the
+    //  error set, if the end tag does not match it.
+    bool endElement(LoadResult &result)
+    {
+        XmlSlice const &name = parser.name();
+        if (open_elements.empty() ||
+            open_elements.back().size != name.size ||
+            std::memcmp(open_elements.back().data, name.data, name.size) != 0)
+        {
+            std::ostringstream ss;
+            ss << "end tag </" << name.str() << '>';
+            if (open_elements.empty())
+                ss << " without an open element";
+            else
+                ss << " does not match <" << open_elements.back().str()
+                   << '>';
+            ss << " at byte " << parser.offset();
+            result.error = ss.str();
+            return false;
+        }
+        if (skip_depth == depth()) skip_depth = 0;
+        if (!groups.empty() && groups.back().first == depth())
+            groups.pop_back();
+        open_elements.pop_back();
+        return true;
+    }
+
+    double number(char const *name, double fallback = 0) const
+    {
+        double value;
+        return detail::parseNumber(parser.attribute(name), value) ? value
+                                                                  : fallback;
+    }
+    Fill fill() const
+    {
+        Color color(Color::Transparent);
+        detail::parseColor(parser.attribute("fill"),
+                           parser.attribute("fill-opacity"), color);
+        return Fill(color);
+    }
+    Stroke stroke() const
+    {
+        double width;
+        if (!detail::parseNumber(parser.attribute("stroke-width"), width))
+            return Stroke();
+        Color color(Color::Transparent);
+        detail::parseColor(parser.attribute("stroke"),
+                           parser.attribute("stroke-opacity"), color);
+        bool const non_scaling =
+            parser.attribute("vector-effect") == "non-scaling-stroke";
+        return Stroke(non_scaling ? width : length(width), color,
+                      non_scaling);
+    }
+    Point map(Point const &point) const
+    {
+        if (!transformed) return point;
+        return Point(transform.a * point.x + transform.e,
+                     transform.d * point.y + transform.f);
+    }
+    void map(std::vector<Point> &points) const
+    {
+        if (transformed)
+            for (auto &point : points) point = map(point);
+    }
+    // Transforms are uniform in scale.
+    double length(double value) const
+    {
+        return transformed ? std::fabs(transform.a) * value : value;
+    }
+
+    // Sets transform for the current element; false if it is not supported.
+    bool enterTransform()
+    {
+        transform = groups.empty() ? detail::identityTransform()
+                                   : groups.back().second;
+
+        XmlSlice const own = parser.attribute("transform");
+        if (own.present())
+        {
+            LayoutTransform local;
+            // Only a uniform scale keeps circles, strokes and fonts as such.
+            if (!detail::parseTransform(own, local) ||
+                std::fabs(local.a) != std::fabs(local.d))
+                return false;
+            transform = detail::combineTransforms(transform, local);
+        }
+        transformed = transform.a != 1 || transform.d != 1 ||
+                      transform.e != 0 || transform.f != 0;
+        return true;
+    }
+
+    void startElement(LoadResult &result)
+    {
+        XmlSlice const &name = parser.name();
+        if (!enterTransform())
+        {
+            ++result.skipped;
+            skip_depth = depth();
+        }
+        else if (name == "svg")
+        {
+            result.layout.dimensions =
+                Dimensions(number("width"), number("height"));
+        }
+        else if (name == "circle")
+        {
+            result.shapes << Circle(map(Point(number("cx"), number("cy"))),
+                                    2 * length(number("r")), fill(),
+                                    stroke());
+        }
+        else if (name == "ellipse")
+        {
+            result.shapes << Elipse(map(Point(number("cx"), number("cy"))),
+                                    2 * length(number("rx")),
+                                    2 * length(number("ry")), fill(),
+                                    stroke());
+        }
+        else if (name == "rect")
+        {
+            // A flipped axis moves the top left corner to the other side.
+            Point corner = map(Point(number("x"), number("y")));
+            double const width = length(number("width"));
+            double const height = length(number("height"));
+            if (transform.a < 0) corner.x -= width;
+            if (transform.d < 0) corner.y -= height;
+            result.shapes << Rectangle(corner, width, height, fill(),
+                                       stroke());
+        }
+        else if (name == "line")
+        {
+            result.shapes << Line(map(Point(number("x1"), number("y1"))),
+                                  map(Point(number("x2"), number("y2"))),
+                                  stroke());
+        }
+        else if (name == "polyline" || name == "polygon")
+        {
+            std::vector<Point> points;
+            if (!detail::parsePointList(parser.attribute("points"), points))
+                ++result.skipped;
+            else
+            {
+                map(points);
+                if (name == "polyline")
+                    result.shapes << Polyline(points, fill(), stroke());
+                else
+                {
+                    Polygon polygon(fill(), stroke());
+                    for (auto const &point : points) polygon << point;
+                    result.shapes << polygon;
+                }
+            }
+        }
+        else if (name == "path")
+            loadPath(result);
+        else if (name == "text")
+            loadText(result);
+        else if (name == "g")
+        {
+            // Its children are loaded with its transform.
+            groups.push_back(std::make_pair(depth(), transform));
+        }
+        else
+        {
+            // Including <defs>, whose contents are never drawn directly.
+            ++result.skipped;
+            skip_depth = depth();
+        }
+    }
+
+    void loadPath(LoadResult &result)
+    {
+        detail::PathData data;
+        if (!detail::parsePathData(parser.attribute("d"), data))
+        {
+            ++result.skipped;
+            return;
+        }
+
+        for (auto &subpath : data.subpaths) map(subpath);
+        bool all_closed = true;
+        bool curved = false;
+        for (std::size_t i = 0; i < data.closed.size(); ++i)
+        {
+            all_closed = all_closed && data.closed[i];
+            curved = curved || !data.curves[i].empty();
+        }
+        if (all_closed || curved)
+        {
+            Path path(fill(), stroke());
+            for (std::size_t i = 0; i < data.subpaths.size(); ++i)
+            {
+                path.startNewSubPath(data.closed[i]);
+                appendSubPath(path, data.subpaths[i], data.curves[i]);
+            }
+            result.shapes << path;
+        }
+        else
+            for (auto const &subpath : data.subpaths)
+                result.shapes << Polyline(subpath, fill(), stroke());
+    }
+
+    static void appendSubPath(Path &path, std::vector<Point> const &points,
+                              std::vector<std::size_t> const &curves)
+    {
+        std::size_t next_curve = 0;
+        for (std::size_t i = 0; i < points.size(); ++i)
+            if (next_curve < curves.size() && curves[next_curve] == i)
+            {
+                path.curveTo(points[i], points[i + 1], points[i + 2]);
+                i += 2;
+                ++next_curve;
+            }
+            else
+                path << points[i];
+    }
+
+    // Text positions are written at the baseline, which a top left layout
+    //  moves down by the font size.  Text is always written upright, so
+    //  text that a transform mirrors is skipped.
+    void loadText(LoadResult &result)
+    {
+        if (transform.a < 0 || transform.d < 0)
+        {
+            ++result.skipped;
+            skip_depth = depth();
+            return;
+        }
+        Fill const text_fill = fill();
+        Stroke const text_stroke = stroke();
+        double const size = length(number("font-size", 12));
+        std::string family;
+        XmlSlice const family_value = parser.attribute("font-family");
+        if (family_value.present())
+            appendXmlUnescaped(family, family_value.data, family_value.size);
+        else
+            family = "Verdana";
+        Point const baseline = map(Point(number("x"), number("y")));
+        Point const origin(baseline.x, baseline.y - size);
+
+        std::string content;
+        SvgPullParser::Event event;
+        while ((event = parser.next()) == SvgPullParser::Text)
+            appendXmlUnescaped(content, parser.text().data,
+                               parser.text().size);
+        // Markup inside text (e.g. <tspan>) is not supported.
+        if (event != SvgPullParser::EndElement)
+        {
+            ++result.skipped;
+            skip_depth = depth();
+            if (event == SvgPullParser::StartElement)
+                open_elements.push_back(parser.name());
+            return;
+        }
+        if (!endElement(result)) return;
+        result.shapes << Text(origin, content, text_fill,
+                              Font(size, family), text_stroke);
+    }
+};
+
+inline LoadResult loadSvg(char const *data, std::size_t size)
+{
+    return SvgLoader(data, size).load();
+}
+inline LoadResult loadSvgFile(std::string const &file_name)
+{
+    MappedFile file(file_name);
+    if (!file.isOpen())
+    {
+        LoadResult result;
+        result.error = file.error();
+        return result;
+    }
+    return loadSvg(file.data(), file.size());
+}
+
+// Binary display list: a scene stored in user space, so that it can be
+//  turned into SVG for any Layout without the data it was built from.
+//
+//  "SSDL", a version byte, the style table (fill and stroke), the font
+//  table, then the records, each a type byte followed by its fields.
+//  Integers are LEB128 varints, signed ones zigzag coded.  A coordinate is
+//  a byte d followed by the varint n for the value n / 10^d when that is
+//  exact for d <= 6, and 0xFF followed by the raw little endian double
+//  otherwise.  Point lists share one d and store differences to the
+//  previous point.
+//  A curved path stores, for each subpath, the number of cubic segments
+//  times two plus one if it is closed, its points, then the distance from
+//  the end of the previous segment (or the first point) to each segment.
+// Written by DisplayListWriter; DisplayList reads this and earlier
+//  versions.
+unsigned const displayListVersion = 2;
+
+namespace detail
+{
+enum DisplayListRecord
+{
+    RecordCircle = 1,
+    RecordElipse,
+    RecordRectangle,
+    RecordLine,
+    RecordPolygon,
+    RecordPolyline,
+    RecordPath,
+    RecordText,
+    // Paths with cubic segments or open subpaths, since version 2.
+    RecordCurvedPath
+};
+
+unsigned char const displayListRawDouble = 0xFF;
+
+inline double const *decimalPowers()
+{
+    static double const powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6};
+    return powers;
+}
+
+// Fewest decimal places d <= 6 with value == n / 10^d for an integer n, or
+//  -1.  Differences of such n fit comfortably in 64 bits.
+inline int decimalPlaces(double value)
+{
+    if (value == 0 && std::signbit(value)) return -1;
+    double const *powers = decimalPowers();
+    for (int d = 0; d <= 6; ++d)
+    {
+        double scaled = value * powers[d];
+        if (!(std::fabs(scaled) < 4503599627370496.0)) return -1;  // 2^52
+        if (static_cast<double>(std::llround(scaled)) / powers[d] == value)
+            return d;
+    }
+    return -1;
+}
+
+inline std::uint64_t zigzag(std::int64_t value)
+{
+    return (static_cast<std::uint64_t>(value) << 1) ^
+           static_cast<std::uint64_t>(value >> 63);
+}
+inline std::int64_t unzigzag(std::uint64_t value)
+{
+    return static_cast<std::int64_t>(value >> 1) ^
+           -static_cast<std::int64_t>(value & 1);
+}
+
+// Bounds-checked reading; after the first overrun every read returns 0 and
+//  ok is false.
+struct DisplayListCursor
+{
+    DisplayListCursor(char const *data, char const *end)
+        : p(reinterpret_cast<unsigned char const *>(data)),
+          end(reinterpret_cast<unsigned char const *>(end)),
+          ok(true)
+    {
+    }
+
+    unsigned byte()
+    {
+        if (p == end)
+        {
+            ok = false;
+            return 0;
+        }
+        return *p++;
+    }
+    std::uint64_t varint()
+    {
+        std::uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            if (p == end) break;
+            unsigned char b = *p++;
+            value |= static_cast<std::uint64_t>(b & 0x7F) << shift;
+            if (!(b & 0x80)) return value;
+        }
+        ok = false;
+        return 0;
+    }
+    double rawDouble()
+    {
+        if (end - p < 8)
+        {
+            ok = false;
+            p = end;
+            return 0;
+        }
+        std::uint64_t bits = 0;
+        for (unsigned i = 0; i < 8; ++i)
+            bits |= static_cast<std::uint64_t>(*p++) << (8 * i);
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    double scalar()
+    {
+        unsigned places = byte();
+        if (places == displayListRawDouble) return rawDouble();
+        if (places > 6)
+        {
+            ok = false;
+            return 0;
+        }
+        return static_cast<double>(unzigzag(varint())) /
+               decimalPowers()[places];
+    }
+    // Replaces the contents of points.
+    void pointList(std::vector<Point> &points)
+    {
+        std::uint64_t count = varint();
+        unsigned places = byte();
+        points.clear();
+        // Each point takes at least two bytes; refuses absurd counts.
+        if (!ok || count > static_cast<std::uint64_t>(end - p) / 2 ||
+            (places > 6 && places != displayListRawDouble))
+        {
+            ok = false;
+            return;
+        }
+        points.reserve(static_cast<std::size_t>(count));
+        if (places == displayListRawDouble)
+        {
+            for (std::uint64_t i = 0; i < count; ++i)
+            {
+                double x = rawDouble();
+                points.push_back(Point(x, rawDouble()));
+            }
+            return;
+        }
+        double const power = decimalPowers()[places];
+        std::int64_t x = 0, y = 0;
+        for (std::uint64_t i = 0; i < count; ++i)
+        {
+            x += unzigzag(varint());
+            y += unzigzag(varint());
+            points.push_back(Point(static_cast<double>(x) / power,
+                                   static_cast<double>(y) / power));
+        }
+    }
+    std::string text()
+    {
+        std::uint64_t size = varint();
+        if (!ok || size > static_cast<std::uint64_t>(end - p))
+        {
+            ok = false;
+            return std::string();
+        }
+        std::string ret(reinterpret_cast<char const *>(p),
+                        static_cast<std::size_t>(size));
+        p += size;
+        return ret;
+    }
+
+    unsigned char const *p;
+    unsigned char const *end;
+    bool ok;
+};
+
+struct DisplayListStyle
+{
+    DisplayListStyle() : fill(Color::Transparent), stroke() {}
+    Fill fill;
+    Stroke stroke;
+};
+}  // namespace detail
+
+// Encodes shapes into a display list.  ShapeColl contents are added in
+//  order; shapes that have no record type (charts, marker batches,
+//  heatmaps) are left out and counted in skipped().
+class DisplayListWriter
+{
+   public:
+    DisplayListWriter() : records(0), skipped_shapes(0) {}
+
+    DisplayListWriter &operator<<(Serializeable const &element)
+    {
+        add(element);
+        return *this;
+    }
+
+    // The complete display list.
+    std::string bytes() const
+    {
+        std::string out("SSDL");
+        out += static_cast<char>(displayListVersion);
+        putVarint(out, style_keys.size());
+        for (auto const &style : style_keys) out += style;
+        putVarint(out, font_keys.size());
+        for (auto const &font : font_keys) out += font;
+        putVarint(out, records);
+        return out + body;
+    }
+    bool save(std::string const &file_name) const
+    {
+        std::ofstream ofs(file_name.c_str(), std::ios::binary);
+        if (!ofs.good()) return false;
+        std::string const data = bytes();
+        ofs.write(data.data(), static_cast<std::streamsize>(data.size()));
+        ofs.close();
+        return ofs.good();
+    }
+
+    std::size_t recordCount() const { return records; }
+    std::size_t skipped() const { return skipped_shapes; }
+
+   private:
+    std::string body;
+    std::size_t records;
+    std::size_t skipped_shapes;
+    std::vector<std::string> style_keys;
+    std::map<std::string, std::size_t> style_index;
+    std::vector<std::string> font_keys;
+    std::map<std::string, std::size_t> font_index;
+
+    void add(Serializeable const &element)
+    {
+        if (ShapeColl const *coll = dynamic_cast<ShapeColl const *>(&element))
+        {
+            for (std::size_t i = 0; i < coll->size(); ++i) add(*(*coll)[i]);
+        }
+        else if (Circle const *circle = dynamic_cast<Circle const *>(&element))
+        {
+            startRecord(detail::RecordCircle, circle->fill, circle->stroke);
+            putScalar(circle->center.x);
+            putScalar(circle->center.y);
+            putScalar(circle->radius);
+        }
+        else if (Elipse const *elipse = dynamic_cast<Elipse const *>(&element))
+        {
+            startRecord(detail::RecordElipse, elipse->fill, elipse->stroke);
+            putScalar(elipse->center.x);
+            putScalar(elipse->center.y);
+            putScalar(elipse->radius_width);
+            putScalar(elipse->radius_height);
+        }
+        else if (Rectangle const *rect =
+                     dynamic_cast<Rectangle const *>(&element))
+        {
+            startRecord(detail::RecordRectangle, rect->fill, rect->stroke);
+            putScalar(rect->edge.x);
+            putScalar(rect->edge.y);
+            putScalar(rect->width);
+            putScalar(rect->height);
+        }
+        else if (Line const *line = dynamic_cast<Line const *>(&element))
+        {
+            startRecord(detail::RecordLine, line->fill, line->stroke);
+            putScalar(line->start_point.x);
+            putScalar(line->start_point.y);
+            putScalar(line->end_point.x);
+            putScalar(line->end_point.y);
+        }
+        else if (Polygon const *polygon =
+                     dynamic_cast<Polygon const *>(&element))
+        {
+            startRecord(detail::RecordPolygon, polygon->fill, polygon->stroke);
+            putPoints(polygon->points);
+        }
+        else if (Polyline const *polyline =
+                     dynamic_cast<Polyline const *>(&element))
+        {
+            startRecord(detail::RecordPolyline, polyline->fill,
+                        polyline->stroke);
+            putPoints(polyline->points);
+        }
+        else if (Path const *path = dynamic_cast<Path const *>(&element))
+            addPath(*path);
+        else if (Text const *text = dynamic_cast<Text const *>(&element))
+        {
+            startRecord(detail::RecordText, text->fill, text->stroke);
+            putVarint(body, fontIndex(text->font));
+            putScalar(text->origin.x);
+            putScalar(text->origin.y);
+            putText(body, text->content);
+        }
+        else
+            ++skipped_shapes;
+    }
+
+    void addPath(Path const &path)
+    {
+        bool straight = true;
+        for (std::size_t i = 0; i < path.paths.size(); ++i)
+            if (!path.paths[i].empty())
+                straight = straight && path.closed[i] && path.curves[i].empty();
+        if (!straight)
+        {
+            startRecord(detail::RecordCurvedPath, path.fill, path.stroke);
+            std::size_t subpaths = 0;
+            for (auto const &subpath : path.paths)
+                if (!subpath.empty()) ++subpaths;
+            putVarint(body, subpaths);
+            for (std::size_t i = 0; i < path.paths.size(); ++i)
+            {
+                if (path.paths[i].empty()) continue;
+
+                std::vector<std::size_t> const &curves = path.curves[i];
+                putVarint(body, curves.size() * 2 + (path.closed[i] ? 1 : 0));
+                putPoints(path.paths[i]);
+                std::size_t previous_end = 1;
+                for (std::size_t start : curves)
+                {
+                    putVarint(body, start - previous_end);
+                    previous_end = start + 3;
+                }
+            }
+        }
+        else
+        {
+            startRecord(detail::RecordPath, path.fill, path.stroke);
+            std::size_t subpaths = 0;
+            for (auto const &subpath : path.paths)
+                if (!subpath.empty()) ++subpaths;
+            putVarint(body, subpaths);
+            for (auto const &subpath : path.paths)
+                if (!subpath.empty()) putPoints(subpath);
+        }
+    }
+
+    void startRecord(detail::DisplayListRecord type, Fill const &fill,
+                     Stroke const &stroke)
+    {
+        ++records;
+        body += static_cast<char>(type);
+
+        std::string key;
+        putUint32(key, fill.getColor().packed());
+        putUint32(key, stroke.getColor().packed());
+        putRawDouble(key, stroke.getWidth());
+        key += static_cast<char>(stroke.isNonScaling() ? 1 : 0);
+        putVarint(body, intern(key, style_keys, style_index));
+    }
+    std::size_t fontIndex(Font const &font)
+    {
+        std::string key;
+        putRawDouble(key, font.getSize());
+        putText(key, font.getFamily());
+        return intern(key, font_keys, font_index);
+    }
+    static std::size_t intern(std::string const &key,
+                              std::vector<std::string> &keys,
+                              std::map<std::string, std::size_t> &index)
+    {
+        auto found = index.find(key);
+        if (found != index.end()) return found->second;
+        index[key] = keys.size();
+        keys.push_back(key);
+        return keys.size() - 1;
+    }
+
+    void putScalar(double value)
+    {
+        int places = detail::decimalPlaces(value);
+        if (places < 0)
+        {
+            body += static_cast<char>(detail::displayListRawDouble);
+            putRawDouble(body, value);
+            return;
+        }
+        body += static_cast<char>(places);
+        putVarint(body, detail::zigzag(
+                            std::llround(value * detail::decimalPowers()[places])));
+    }
+    void putPoints(std::vector<Point> const &points)
+    {
+        putVarint(body, points.size());
+        int places = 0;
+        for (auto const &point : points)
+        {
+            int x = detail::decimalPlaces(point.x);
+            int y = detail::decimalPlaces(point.y);
+            if (x < 0 || y < 0)
+            {
+                places = -1;
+                break;
+            }
+            places = std::max(places, std::max(x, y));
+        }
+        if (places < 0)
+        {
+            body += static_cast<char>(detail::displayListRawDouble);
+            for (auto const &point : points)
+            {
+                putRawDouble(body, point.x);
+                putRawDouble(body, point.y);
+            }
+            return;
+        }
+
+        body += static_cast<char>(places);
+        double const power = detail::decimalPowers()[places];
+        std::int64_t previous_x = 0, previous_y = 0;
+        for (auto const &point : points)
+        {
+            std::int64_t x = std::llround(point.x * power);
+            std::int64_t y = std::llround(point.y * power);
+            putVarint(body, detail::zigzag(x - previous_x));
+            putVarint(body, detail::zigzag(y - previous_y));
+            previous_x = x;
+            previous_y = y;
+        }
+    }
+
+    static void putVarint(std::string &out, std::uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out += static_cast<char>((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        out += static_cast<char>(value);
+    }
+    static void putUint32(std::string &out, std::uint32_t value)
+    {
+        for (unsigned i = 0; i < 4; ++i)
+            out += static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+    static void putRawDouble(std::string &out, double value)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        for (unsigned i = 0; i < 8; ++i)
+            out += static_cast<char>((bits >> (8 * i)) & 0xFF);
+    }
+    static void putText(std::string &out, std::string const &text)
+    {
+        putVarint(out, text.size());
+        out += text;
+    }
+};
+
+// Reads a display list in place, e.g. from a MappedFile; the data must
+//  outlive it.  Only the header and the style and font tables are read up
+//  front.  Records are decoded while they are converted.
+class DisplayList
+{
+   public:
+    DisplayList(char const *data, std::size_t size)
+        : end(data + size),
+          records(nullptr),
+          record_count(0),
+          format_version(0)
+    {
+        if (size < 5 || std::memcmp(data, "SSDL", 4) != 0)
+        {
+            error_message = "not a display list";
+            return;
+        }
+        format_version = static_cast<unsigned char>(data[4]);
+        if (format_version < 1 || format_version > displayListVersion)
+        {
+            std::ostringstream ss;
+            ss << "unsupported display list version " << format_version;
+            error_message = ss.str();
+            return;
+        }
+
+        detail::DisplayListCursor cursor(data + 5, end);
+        std::uint64_t const style_count = cursor.varint();
+        for (std::uint64_t i = 0; i < style_count && cursor.ok; ++i)
+        {
+            std::uint32_t fill = readUint32(cursor);
+            std::uint32_t stroke = readUint32(cursor);
+            double width = cursor.rawDouble();
+            bool non_scaling = cursor.byte() != 0;
+            detail::DisplayListStyle style;
+            style.fill = Fill(unpack(fill));
+            style.stroke = Stroke(width, unpack(stroke), non_scaling);
+            styles.push_back(style);
+        }
+        std::uint64_t const font_count = cursor.varint();
+        for (std::uint64_t i = 0; i < font_count && cursor.ok; ++i)
+        {
+            double font_size = cursor.rawDouble();
+            fonts.push_back(Font(font_size, cursor.text()));
+        }
+        record_count = static_cast<std::size_t>(cursor.varint());
+        if (!cursor.ok)
+        {
+            error_message = "truncated display list header";
+            return;
+        }
+        records = reinterpret_cast<char const *>(cursor.p);
+    }
+
+    bool isValid() const { return error_message.empty(); }
+    std::string const &error() const { return error_message; }
+    unsigned version() const { return format_version; }
+    std::size_t recordCount() const { return record_count; }
+
+    // Appends the SVG elements for layout, the same bytes as the shapes
+    //  that were encoded would produce.  False, with what was decoded
+    //  appended, if a record is damaged.
+    bool appendTo(std::string &out, Layout const &layout) const
+    {
+        if (!isValid()) return false;
+        if (detail::needsGeometryPass(layout))
+        {
+            AppendSvg sink(out, layout);
+            return decode(sink);
+        }
+
+        // Without clipping or quantization the common records are written
+        //  directly, each style formatted once.
+        std::vector<std::string> style_strings;
+        for (auto const &style : styles)
+            style_strings.push_back(style.fill.toString(layout) +
+                                    style.stroke.toString(layout));
+
+        AppendSvg sink(out, layout);
+        std::vector<Point> points;
+        detail::DisplayListCursor cursor(records, end);
+        for (std::size_t i = 0; i < record_count && cursor.ok; ++i)
+        {
+            unsigned type = cursor.byte();
+            std::size_t style = readStyle(cursor);
+            if (!cursor.ok) break;
+            if (type == detail::RecordCircle)
+            {
+                double x = cursor.scalar();
+                double y = cursor.scalar();
+                double radius = cursor.scalar();
+                out += "\t<circle cx=\"";
+                appendNumber(out, translateX(x, layout));
+                out += "\" cy=\"";
+                appendNumber(out, translateY(y, layout));
+                out += "\" r=\"";
+                appendNumber(out, translateScale(radius, layout));
+                out += "\" ";
+                out += style_strings[style];
+                out += "/>\n";
+            }
+            else if (type == detail::RecordPolygon ||
+                     type == detail::RecordPolyline)
+            {
+                cursor.pointList(points);
+                out += type == detail::RecordPolygon ? "\t<polygon points=\""
+                                                     : "\t<polyline points=\"";
+                detail::appendTranslatedPoints(out, points, layout);
+                out += "\" ";
+                out += style_strings[style];
+                out += "/>\n";
+            }
+            else if (type == detail::RecordPath)
+            {
+                std::uint64_t subpaths = cursor.varint();
+                out += "\t<path d=\"";
+                for (std::uint64_t s = 0; s < subpaths && cursor.ok; ++s)
+                {
+                    cursor.pointList(points);
+                    out += 'M';
+                    detail::appendTranslatedPoints(out, points, layout);
+                    out += "z ";
+                }
+                out += "\" fill-rule=\"evenodd\" ";
+                out += style_strings[style];
+                out += "/>\n";
+            }
+            else
+                decodeRecord(cursor, type, style, points, sink);
+        }
+        return cursor.ok;
+    }
+    std::string toString(Layout const &layout) const
+    {
+        std::string ret;
+        appendTo(ret, layout);
+        return ret;
+    }
+
+    // The encoded shapes as objects again.
+    ShapeColl toShapes() const
+    {
+        ShapeColl shapes;
+        AppendShape sink(shapes);
+        if (isValid()) decode(sink);
+        return shapes;
+    }
+
+   private:
+    char const *end;
+    char const *records;
+    std::size_t record_count;
+    unsigned format_version;
+    std::string error_message;
+    std::vector<detail::DisplayListStyle> styles;
+    std::vector<Font> fonts;
+
+    struct AppendSvg
+    {
+        AppendSvg(std::string &out, Layout const &layout)
+            : out(out), layout(layout)
+        {
+        }
+        template <typename T>
+        void operator()(T const &shape)
+        {
+            out += shape.toString(layout);
+        }
+        std::string &out;
+        Layout const &layout;
+    };
+    struct AppendShape
+    {
+        explicit AppendShape(ShapeColl &shapes) : shapes(shapes) {}
+        template <typename T>
+        void operator()(T const &shape)
+        {
+            shapes << shape;
+        }
+        ShapeColl &shapes;
+    };
+
+    static Color unpack(std::uint32_t rgba)
+    {
+        return Color(rgba >> 24, (rgba >> 16) & 0xFF, (rgba >> 8) & 0xFF,
+                     rgba & 0xFF);
+    }
+    static std::uint32_t readUint32(detail::DisplayListCursor &cursor)
+    {
+        std::uint32_t value = 0;
+        for (unsigned i = 0; i < 4; ++i) value |= cursor.byte() << (8 * i);
+        return value;
+    }
+    std::size_t readStyle(detail::DisplayListCursor &cursor) const
+    {
+        std::uint64_t style = cursor.varint();
+        if (style >= styles.size()) cursor.ok = false;
+        return cursor.ok ? static_cast<std::size_t>(style) : 0;
+    }
+
+    template <typename Sink>
+    bool decode(Sink &sink) const
+    {
+        std::vector<Point> points;
+        detail::DisplayListCursor cursor(records, end);
+        for (std::size_t i = 0; i < record_count && cursor.ok; ++i)
+        {
+            unsigned type = cursor.byte();
+            std::size_t style = readStyle(cursor);
+            if (cursor.ok) decodeRecord(cursor, type, style, points, sink);
+        }
+        return cursor.ok;
+    }
+    // Builds the shape for one record and hands it to sink.
+    template <typename Sink>
+    void decodeRecord(detail::DisplayListCursor &cursor, unsigned type,
+                      std::size_t style, std::vector<Point> &points,
+                      Sink &sink) const
+    {
+        Fill const &fill = styles[style].fill;
+        Stroke const &stroke = styles[style].stroke;
+        switch (type)
+        {
+            case detail::RecordCircle:
+            {
+                double x = cursor.scalar();
+                double y = cursor.scalar();
+                double radius = cursor.scalar();
+                if (cursor.ok) sink(Circle(Point(x, y), 2 * radius, fill, stroke));
+                break;
+            }
+            case detail::RecordElipse:
+            {
+                double x = cursor.scalar();
+                double y = cursor.scalar();
+                double radius_width = cursor.scalar();
+                double radius_height = cursor.scalar();
+                if (cursor.ok)
+                    sink(Elipse(Point(x, y), 2 * radius_width,
+                                2 * radius_height, fill, stroke));
+                break;
+            }
+            case detail::RecordRectangle:
+            {
+                double x = cursor.scalar();
+                double y = cursor.scalar();
+                double width = cursor.scalar();
+                double height = cursor.scalar();
+                if (cursor.ok)
+                    sink(Rectangle(Point(x, y), width, height, fill, stroke));
+                break;
+            }
+            case detail::RecordLine:
+            {
+                double x1 = cursor.scalar();
+                double y1 = cursor.scalar();
+                double x2 = cursor.scalar();
+                double y2 = cursor.scalar();
+                if (cursor.ok) sink(Line(Point(x1, y1), Point(x2, y2), stroke));
+                break;
+            }
+            case detail::RecordPolygon:
+            {
+                cursor.pointList(points);
+                Polygon polygon(fill, stroke);
+                for (auto const &point : points) polygon << point;
+                if (cursor.ok) sink(polygon);
+                break;
+            }
+            case detail::RecordPolyline:
+            {
+                cursor.pointList(points);
+                if (cursor.ok) sink(Polyline(points, fill, stroke));
+                break;
+            }
+            case detail::RecordPath:
+            {
+                std::uint64_t subpaths = cursor.varint();
+                Path path(fill, stroke);
+                for (std::uint64_t s = 0; s < subpaths && cursor.ok; ++s)
+                {
+                    cursor.pointList(points);
+                    path.startNewSubPath();
+                    for (auto const &point : points) path << point;
+                }
+                if (cursor.ok) sink(path);
+                break;
+            }
+            case detail::RecordCurvedPath:
+            {
+                std::uint64_t subpaths = cursor.varint();
+                Path path(fill, stroke);
+                for (std::uint64_t s = 0; s < subpaths && cursor.ok; ++s)
+                {
+                    std::uint64_t const header = cursor.varint();
+                    cursor.pointList(points);
+                    path.startNewSubPath((header & 1) != 0);
+                    std::size_t i = 0;
+                    if (!points.empty()) path << points[i++];
+                    for (std::uint64_t curves = header >> 1;
+                         curves && cursor.ok; --curves)
+                    {
+                        std::uint64_t const gap = cursor.varint();
+                        if (gap > points.size() - i ||
+                            points.size() - i - gap < 3)
+                        {
+                            cursor.ok = false;
+                            break;
+                        }
+                        for (std::uint64_t g = 0; g < gap; ++g)
+                            path << points[i++];
+                        path.curveTo(points[i], points[i + 1], points[i + 2]);
+                        i += 3;
+                    }
+                    for (; i < points.size(); ++i) path << points[i];
+                }
+                if (cursor.ok) sink(path);
+                break;
+            }
+            case detail::RecordText:
+            {
+                std::uint64_t font = cursor.varint();
+                double x = cursor.scalar();
+                double y = cursor.scalar();
+                std::string content = cursor.text();
+                if (font >= fonts.size()) cursor.ok = false;
+                if (cursor.ok)
+                    sink(Text(Point(x, y), content, fill,
+                              fonts[static_cast<std::size_t>(font)], stroke));
+                break;
+            }
+            default:
+                cursor.ok = false;
+        }
+    }
+};
+
+struct FragmentCacheStats
+{
+    FragmentCacheStats()
+        : hits(0), misses(0), insertions(0), evictions(0), entries(0), bytes(0)
+    {
+    }
+    double hitRate() const
+    {
+        return hits + misses ? static_cast<double>(hits) / (hits + misses) : 0;
+    }
+
+    std::uint64_t hits;
+    std::uint64_t misses;
+    std::uint64_t insertions;
+    std::uint64_t evictions;
+    std::size_t entries;
+    std::size_t bytes;
+};
+
+// Serialized SVG of shapes, keyed by their content (geometry and style, in
+//  the display list encoding) and the Layout, with least recently used
+//  entries evicted beyond a memory budget.  Thread-safe.
+//
+//  global() is off until it is given a budget.  Once on, Document looks up
+//  every shape added to it and ShapeColl the collections and charts it
+//  contains, so repeated sub-scenes such as chart axes or legends are
+//  serialized once per process.  Charts, collections and the primitive
+//  shapes can be cached; a collection holding anything else cannot.
+class FragmentCache
+{
+   public:
+    explicit FragmentCache(std::size_t budget = 0)
+        : budget_bytes(budget), used_bytes(0)
+    {
+    }
+    FragmentCache(FragmentCache const &) = delete;
+    FragmentCache &operator=(FragmentCache const &) = delete;
+
+    static FragmentCache &global()
+    {
+        static FragmentCache cache;
+        return cache;
+    }
+
+    // Bytes of SVG, plus some overhead per entry, to keep at most.  0
+    //  turns the cache off and empties it.
+    void setBudget(std::size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget_bytes = bytes;
+        evictDownTo(bytes);
+    }
+    std::size_t budget() const { return budget_bytes; }
+    bool enabled() const { return budget_bytes != 0; }
+
+    // The key for element rendered with layout; empty if it cannot be
+    //  cached.  Layouts that count removed points bypass the cache, since a
+    //  hit would not count them.  Building it encodes element as a display
+    //  list, which is cheaper than formatting it but still a pass over all
+    //  of its points, so a lookup is not free.  Entries only keep a digest
+    //  of their key.
+    static std::string makeKey(Serializeable const &element,
+                               Layout const &layout)
+    {
+        std::string key;
+        if (layout.removed_points) return key;
+
+        appendLayout(key, layout);
+        if (layout.delegated)
+        {
+            key += 'D';
+            appendLayout(key, outerLayout(layout));
+        }
+
+        DisplayListWriter writer;
+        if (LineChart const *chart = dynamic_cast<LineChart const *>(&element))
+        {
+            key += 'C';
+            appendRaw(key, chart->margin.width);
+            appendRaw(key, chart->margin.height);
+            appendRaw(key, chart->scale);
+            appendRaw(key, chart->axis_stroke.getWidth());
+            appendRaw(key, chart->axis_stroke.getColor().packed());
+            appendRaw(key, chart->axis_stroke.isNonScaling());
+            for (auto const &polyline : chart->polylines) writer << polyline;
+        }
+        else
+        {
+            key += 'S';
+            writer << element;
+            if (writer.skipped()) return std::string();
+        }
+        return key + writer.bytes();
+    }
+
+    // Appends the cached SVG for key to out.  False on a miss.
+    bool find(std::string const &key, std::string &out)
+    {
+        Digest const digest = digestKey(key);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto range = index.equal_range(digest.hash);
+        for (auto it = range.first; it != range.second; ++it)
+            if (it->second->digest == digest)
+            {
+                entries.splice(entries.begin(), entries, it->second);
+                out += it->second->svg;
+                ++counters.hits;
+                return true;
+            }
+        ++counters.misses;
+        return false;
+    }
+    void insert(std::string const &key, std::string const &svg)
+    {
+        std::size_t const cost = entryCost(svg);
+        Digest const digest = digestKey(key);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cost > budget_bytes) return;
+
+        // Another thread may have been first.
+        auto range = index.equal_range(digest.hash);
+        for (auto it = range.first; it != range.second; ++it)
+            if (it->second->digest == digest) return;
+
+        evictDownTo(budget_bytes - cost);
+        entries.push_front(Entry());
+        entries.front().digest = digest;
+        entries.front().svg = svg;
+        index.insert(std::make_pair(digest.hash, entries.begin()));
+        used_bytes += cost;
+        ++counters.insertions;
+    }
+
+    // element.toString(layout), rendered only on a miss.
+    std::string toString(Serializeable const &element, Layout const &layout)
+    {
+        std::string key = makeKey(element, layout);
+        std::string svg;
+        if (key.empty() || !find(key, svg))
+        {
+            svg = element.toString(layout);
+            if (!key.empty()) insert(key, svg);
+        }
+        return svg;
+    }
+
+    FragmentCacheStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        FragmentCacheStats ret = counters;
+        ret.entries = entries.size();
+        ret.bytes = used_bytes;
+        return ret;
+    }
+    void resetStats()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        counters = FragmentCacheStats();
+    }
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        evictDownTo(0);
+    }
+
+   private:
+    // Keys are long (a whole display list), so entries identify theirs by
+    //  two unrelated 64-bit hashes and the length instead.
+    struct Digest
+    {
+        std::uint64_t hash;
+        std::uint64_t check;
+        std::size_t size;
+        bool operator==(Digest const &other) const
+        {
+            return hash == other.hash && check == other.check &&
+                   size == other.size;
+        }
+    };
+    struct Entry
+    {
+        Digest digest;
+        std::string svg;
+    };
+
+    mutable std::mutex mutex;
+    std::atomic<std::size_t> budget_bytes;
+    std::size_t used_bytes;
+    // Most recently used first.
+    std::list<Entry> entries;
+    std::unordered_multimap<std::uint64_t, std::list<Entry>::iterator> index;
+    FragmentCacheStats counters;
+
+    template <typename T>
+    static void appendRaw(std::string &out, T const &value)
+    {
+        out.append(reinterpret_cast<char const *>(&value), sizeof(value));
+    }
+    static void appendLayout(std::string &key, Layout const &layout)
+    {
+        appendRaw(key, layout.dimensions.width);
+        appendRaw(key, layout.dimensions.height);
+        appendRaw(key, layout.scale);
+        appendRaw(key, static_cast<int>(layout.origin));
+        appendRaw(key, layout.origin_offset.x);
+        appendRaw(key, layout.origin_offset.y);
+        appendRaw(key, layout.clip);
+        appendRaw(key, layout.quantum);
+    }
+    static Digest digestKey(std::string const &key)
+    {
+        Digest digest;
+        digest.hash = detail::hashBytes(key.data(), key.size());
+        // The check mixes 8 bytes at a time with multiply-rotate steps, so
+        //  that it does not collide together with FNV-1a.
+        std::uint64_t check = key.size();
+        for (std::size_t i = 0; i < key.size(); i += 8)
+        {
+            std::uint64_t word = 0;
+            std::memcpy(&word, key.data() + i,
+                        key.size() - i < 8 ? key.size() - i : 8);
+            check ^= word * 0x9e3779b97f4a7c15ull;
+            check = (check << 31 | check >> 33) * 0xbf58476d1ce4e5b9ull;
+        }
+        digest.check = check ^ (check >> 29);
+        digest.size = key.size();
+        return digest;
+    }
+    static std::size_t entryCost(std::string const &svg)
+    {
+        // Plus a rough allowance for the list node and index entry.
+        return svg.size() + sizeof(Entry) + 64;
+    }
+    void evictDownTo(std::size_t bytes)
+    {
+        while (used_bytes > bytes && !entries.empty())
+        {
+            Entry const &last = entries.back();
+            auto range = index.equal_range(last.digest.hash);
+            for (auto it = range.first; it != range.second; ++it)
+                if (it->second == std::prev(entries.end()))
+                {
+                    index.erase(it);
+                    break;
+                }
+            used_bytes -= entryCost(last.svg);
+            entries.pop_back();
+            ++counters.evictions;
+        }
+    }
+};
+
+namespace detail
+{
+inline bool findFragment(Serializeable const &element, Layout const &layout,
+                         bool nested, std::string &key, std::string &out)
+{
+    FragmentCache &cache = FragmentCache::global();
+    if (!cache.enabled()) return false;
+    if (nested && !dynamic_cast<ShapeColl const *>(&element) &&
+        !dynamic_cast<LineChart const *>(&element))
+        return false;
+
+    key = FragmentCache::makeKey(element, layout);
+    return !key.empty() && cache.find(key, out);
+}
+inline void storeFragment(std::string const &key, std::string const &svg)
+{
+    if (!key.empty()) FragmentCache::global().insert(key, svg);
+}
+}  // namespace detail
 }  // namespace svg
 #endif
@@ -11,12 +11,44 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
 #include <sstream>
+#include <thread>
 
 #include "../simple_svg_1.0.0.hpp"
 
 using namespace svg;
 
+// Counts global operator new calls for the allocation budget tests.
+static std::atomic<std::size_t> g_allocations(0);
+
+// GCC sees the malloc/free inside the replacements after inlining and takes
+//  them for a mismatch with new/delete.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void *operator new(std::size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+void *operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { std::free(ptr); }
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
 // SVGTest
 // -----------------------------------------------------------------------------------------
 
@@ -44,7 +76,7 @@ TEST_F(SVGTest, ShapeCollTest)
                       Font(12, "Arial"));
 
     std::string expectedStr =
-        "\t<text x=\"10\" y=\"32\" fill=\"rgb(0,0,0)\" font-size=\"12\" "
+        "\t<text x=\"10\" y=\"32\" fill=\"#000\" font-size=\"12\" "
         "font-family=\"Arial\" >Hello, SVG!</text>\n";
     sercollStr = ShapeColl.toString(layout);
     // std::cout << "* ShapeCollTest sercollStr: " << sercollStr << std::endl;
@@ -61,8 +93,8 @@ TEST_F(SVGTest, Shape2Test)
     EXPECT_TRUE(circleStr.find("cx=\"50\"") != std::string::npos);
     EXPECT_TRUE(circleStr.find("cy=\"50\"") != std::string::npos);
     EXPECT_TRUE(circleStr.find("r=\"10\"") != std::string::npos);
-    EXPECT_TRUE(circleStr.find("fill=\"rgb(255,0,0)\"") != std::string::npos);
-    EXPECT_TRUE(circleStr.find("stroke=\"rgb(0,0,255)\"") != std::string::npos);
+    EXPECT_TRUE(circleStr.find("fill=\"#f00\"") != std::string::npos);
+    EXPECT_TRUE(circleStr.find("stroke=\"#00f\"") != std::string::npos);
 }
 
 TEST_F(SVGTest, PolygonTest)
@@ -72,8 +104,8 @@ TEST_F(SVGTest, PolygonTest)
     std::string polygonStr = polygon.toString(layout);
     EXPECT_TRUE(polygonStr.find("points=\"0,0 100,0 100,100 0,100 \"") !=
                 std::string::npos);
-    EXPECT_TRUE(polygonStr.find("fill=\"rgb(0,128,0)\"") != std::string::npos);
-    EXPECT_TRUE(polygonStr.find("stroke=\"rgb(0,0,0)\"") != std::string::npos);
+    EXPECT_TRUE(polygonStr.find("fill=\"#008000\"") != std::string::npos);
+    EXPECT_TRUE(polygonStr.find("stroke=\"#000\"") != std::string::npos);
 }
 
 TEST_F(SVGTest, TextTest)
@@ -103,8 +135,8 @@ TEST_F(SVGTest, LineChartTest)
     chart << line2;
 
     std::string chartStr = chart.toString(layout);
-    EXPECT_TRUE(chartStr.find("stroke=\"rgb(0,0,255)\"") != std::string::npos);
-    EXPECT_TRUE(chartStr.find("stroke=\"rgb(255,0,0)\"") != std::string::npos);
+    EXPECT_TRUE(chartStr.find("stroke=\"#00f\"") != std::string::npos);
+    EXPECT_TRUE(chartStr.find("stroke=\"#f00\"") != std::string::npos);
     EXPECT_TRUE(chartStr.find("points=\"0,0 10,10 20,20 \"") !=
                 std::string::npos);
     EXPECT_TRUE(chartStr.find("points=\"0,20 10,10 20,0 \"") !=
@@ -126,7 +158,7 @@ TEST_F(SVGTest, DocumentTest)
                 std::string::npos);
     EXPECT_TRUE(docStr.find("<circle cx=\"100\" cy=\"100\" r=\"25\"") !=
                 std::string::npos);
-    EXPECT_TRUE(docStr.find("<text x=\"10\" y=\"180\" fill=\"rgb(0,0,0)\"") !=
+    EXPECT_TRUE(docStr.find("<text x=\"10\" y=\"180\" fill=\"#000\"") !=
                 std::string::npos);
 }
 
@@ -146,15 +178,29 @@ TEST_F(SVGTest, PathTest)
     EXPECT_TRUE(docStr.find("<path") != std::string::npos);
     EXPECT_TRUE(docStr.find("d=\"M0,300 100,300 100,200 z M0,200 0,300 z \"") !=
                 std::string::npos);
-    EXPECT_TRUE(docStr.find("fill=\"rgb(255,255,0)\"") != std::string::npos);
-    EXPECT_TRUE(docStr.find("stroke=\"rgb(128,0,128)\"") != std::string::npos);
+    EXPECT_TRUE(docStr.find("fill=\"#ff0\"") != std::string::npos);
+    EXPECT_TRUE(docStr.find("stroke=\"#800080\"") != std::string::npos);
     EXPECT_TRUE(docStr.find("stroke-width=\"2\"") != std::string::npos);
 }
 
 TEST_F(SVGTest, ColorTest2)
 {
     Color color(128, 64, 32);
-    EXPECT_EQ(color.toString(layout), "rgb(128,64,32)");
+    EXPECT_EQ(color.toString(layout), "#804020");
+    EXPECT_EQ(Color(0x11, 0x22, 0x33).toString(layout), "#123");
+    EXPECT_EQ(Color(Color::Transparent).toString(layout), "none");
+    EXPECT_EQ(Color(Color::Orange).toString(layout), "#ffa500");
+    EXPECT_EQ(Color(300, -5, 255).toString(layout), "#f0f");
+}
+
+TEST_F(SVGTest, ColorAlphaTest)
+{
+    EXPECT_EQ(Fill(Color(255, 0, 0)).toString(layout), "fill=\"#f00\" ");
+    EXPECT_EQ(Fill(Color(255, 0, 0, 51)).toString(layout),
+              "fill=\"#f00\" fill-opacity=\"0.2\" ");
+    EXPECT_EQ(Stroke(1, Color(0, 0, 255, 102)).toString(layout),
+              "stroke-width=\"1\" stroke=\"#00f\" stroke-opacity=\"0.4\" ");
+    EXPECT_EQ(Fill(Color(0, 0, 0, 0)).toString(layout), "fill=\"none\" ");
 }
 
 TEST_F(SVGTest, LayoutTest)
@@ -213,8 +259,8 @@ TEST(SimpleSvgTest, CircleTest)
 
     EXPECT_TRUE(docStr.find("<circle cx=\"100\" cy=\"200\" r=\"25\"") !=
                 std::string::npos);  // WHY cy="200"?
-    EXPECT_TRUE(docStr.find("fill=\"rgb(255,0,0)\"") != std::string::npos);
-    EXPECT_TRUE(docStr.find("stroke=\"rgb(0,0,255)\"") != std::string::npos);
+    EXPECT_TRUE(docStr.find("fill=\"#f00\"") != std::string::npos);
+    EXPECT_TRUE(docStr.find("stroke=\"#00f\"") != std::string::npos);
     EXPECT_TRUE(docStr.find("stroke-width=\"2\"") != std::string::npos);
 }
 
@@ -233,8 +279,8 @@ TEST(SimpleSvgTest, PolygonTest)
     EXPECT_TRUE(
         docStr.find("<polygon points=\"0,300 100,300 100,200 0,200 \"") !=
         std::string::npos);
-    EXPECT_TRUE(docStr.find("fill=\"rgb(0,128,0)\"") != std::string::npos);
-    EXPECT_TRUE(docStr.find("stroke=\"rgb(0,0,0)\"") != std::string::npos);
+    EXPECT_TRUE(docStr.find("fill=\"#008000\"") != std::string::npos);
+    EXPECT_TRUE(docStr.find("stroke=\"#000\"") != std::string::npos);
 }
 
 TEST(SimpleSvgTest, LineChartTest)
@@ -249,8 +295,8 @@ TEST(SimpleSvgTest, LineChartTest)
     doc << chart;
     std::string docStr = doc.toString();
     EXPECT_TRUE(docStr.find("<polyline") != std::string::npos);
-    EXPECT_TRUE(docStr.find("stroke=\"rgb(0,0,255)\"") != std::string::npos);
-    EXPECT_TRUE(docStr.find("stroke=\"rgb(255,0,0)\"") != std::string::npos);
+    EXPECT_TRUE(docStr.find("stroke=\"#00f\"") != std::string::npos);
+    EXPECT_TRUE(docStr.find("stroke=\"#f00\"") != std::string::npos);
     EXPECT_TRUE(docStr.find("<circle") != std::string::npos);  // Vertices
 }
 
@@ -270,7 +316,7 @@ TEST(SimpleSvgTest, StrokeTest)
     EXPECT_TRUE(docStr.find("height=\"100\"") != std::string::npos);
     EXPECT_TRUE(docStr.find("fill=\"none\"") != std::string::npos);
     EXPECT_TRUE(docStr.find("stroke-width=\"3\"") != std::string::npos);
-    EXPECT_TRUE(docStr.find("stroke=\"rgb(0,0,255)\"") != std::string::npos);
+    EXPECT_TRUE(docStr.find("stroke=\"#00f\"") != std::string::npos);
 }
 
 TEST(SimpleSvgTest, PointTest)
@@ -287,6 +333,1771 @@ TEST(SimpleSvgTest, PointTest)
     EXPECT_EQ(diff.y, 12);
 }
 
+TEST(SimpleSvgTest, XmlEscapeTest)
+{
+    EXPECT_EQ(escapeXml("plain label"), "plain label");
+    EXPECT_EQ(escapeXml("a<b & c>\"d'"),
+              "a&lt;b &amp; c&gt;&quot;d&apos;");
+
+    // Specials inside and after whole SIMD blocks.
+    std::string longText(40, 'x');
+    longText[17] = '&';
+    longText[39] = '<';
+    std::string expected(17, 'x');
+    expected += "&amp;" + std::string(21, 'x') + "&lt;";
+    EXPECT_EQ(escapeXml(longText), expected);
+
+    Document doc;
+    doc << Text(Point(0, 0), "1 < 2 & 3", Fill(Color::Black),
+                Font(12, "Times \"New\""));
+    std::string docStr = doc.toString();
+    EXPECT_TRUE(docStr.find(">1 &lt; 2 &amp; 3</text>") != std::string::npos);
+    EXPECT_TRUE(docStr.find("font-family=\"Times &quot;New&quot;\"") !=
+                std::string::npos);
+}
+
+TEST(SimpleSvgTest, RenderStatsTest)
+{
+    std::uint64_t fake_allocations = 0;
+    setAllocationCounter([&] { return fake_allocations += 2; });
+
+    Document doc("render_stats_test.svg");
+    ShapeColl nested;
+    nested << Circle(Point(1, 1), 2) << Circle(Point(2, 2), 2);
+    ShapeColl coll;
+    coll << nested << Text(Point(0, 0), "label");
+    doc << coll;
+    Polyline polyline(Stroke(1, Color::Blue));
+    polyline << Point(0, 0) << Point(1, 1) << Point(2, 0);
+    doc << polyline;
+
+    RenderStats const stats = doc.stats();
+    ASSERT_EQ(stats.shapes.count("Circle"), 1u);
+    EXPECT_EQ(stats.shapes.at("Circle").elements, 2u);
+    EXPECT_EQ(stats.shapes.at("Circle").points, 2u);
+    EXPECT_EQ(stats.shapes.at("Circle").allocations, 4u);
+    EXPECT_EQ(stats.shapes.at("Text").elements, 1u);
+    EXPECT_EQ(stats.shapes.at("Polyline").points, 3u);
+    EXPECT_EQ(stats.shapes.count("ShapeColl"), 0u);
+    EXPECT_EQ(stats.allocations, 8u);
+
+    std::string docStr = doc.toString();
+    ShapeStats total = stats.total();
+    EXPECT_EQ(total.elements, 4u);
+    EXPECT_GT(total.bytes, 0u);
+    EXPECT_LT(total.bytes, docStr.size());
+
+    int callbacks = 0;
+    doc.setStatsCallback(
+        [&](RenderStats const &saved)
+        {
+            ++callbacks;
+            EXPECT_EQ(saved.bytes_written, docStr.size());
+        });
+    EXPECT_TRUE(doc.save());
+    EXPECT_EQ(callbacks, 1);
+    std::remove("render_stats_test.svg");
+
+    // Copies start from the stats of the original and then keep their own.
+    Document copy(doc);
+    copy << Circle(Point(3, 3), 2);
+    EXPECT_EQ(copy.stats().shapes.at("Circle").elements, 3u);
+    EXPECT_EQ(doc.stats().shapes.at("Circle").elements, 2u);
+    Document assigned;
+    assigned = copy;
+    assigned.resetStats();
+    EXPECT_EQ(copy.stats().shapes.at("Circle").elements, 3u);
+
+    doc.resetStats();
+    EXPECT_TRUE(doc.stats().shapes.empty());
+    EXPECT_EQ(copy.stats().shapes.at("Circle").elements, 3u);
+    copy.setStatsCallback(nullptr);
+    EXPECT_TRUE(doc.save());
+    EXPECT_EQ(callbacks, 2);
+    std::remove("render_stats_test.svg");
+    setAllocationCounter(nullptr);
+}
+
+// Run under ThreadSanitizer with -DSIMPLE_SVG_TSAN=ON.
+TEST(SimpleSvgTest, RenderStatsConcurrentSaveTest)
+{
+    Document doc("render_stats_concurrent_test.svg");
+    doc << Circle(Point(1, 1), 2);
+    Document const &shared = doc;
+    std::size_t const size = doc.toString().size();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+        threads.emplace_back([&shared] { EXPECT_TRUE(shared.save()); });
+    for (auto &thread : threads) thread.join();
+    EXPECT_EQ(doc.stats().bytes_written, 4 * size);
+    std::remove("render_stats_concurrent_test.svg");
+}
+
+TEST(SimpleSvgTest, SaveAsyncTest)
+{
+    Document doc("save_async_test.svg", Layout(Dimensions(200, 200)));
+    for (int i = 0; i < 200; ++i)
+        doc << Circle(Point(i, i), 5, Fill(Color::Red), Stroke(1, Color::Blue));
+    std::string const expected = doc.toString();
+
+    std::atomic<int> callbacks(0);
+    doc.setStatsCallback([&](RenderStats const &) { ++callbacks; });
+
+    // Tiny buffers force many hand-overs between the two threads.  The
+    //  nodes are shared with the writer rather than copied, so the call
+    //  does not allocate per node.
+    std::size_t const before = g_allocations.load();
+    SaveHandle handle = doc.saveAsync(100, 3);
+    EXPECT_LT(g_allocations.load() - before, 50u);
+    doc << Text(Point(0, 0), "added after saveAsync");
+    ASSERT_TRUE(handle.valid());
+    EXPECT_TRUE(handle.ok());
+    EXPECT_TRUE(handle.ready());
+    EXPECT_TRUE(handle.error().empty());
+
+    // The writer records the save once it has finished.
+    EXPECT_EQ(callbacks.load(), 1);
+    EXPECT_EQ(doc.stats().bytes_written, expected.size());
+    EXPECT_GT(doc.stats().io_nanoseconds, 0u);
+
+    std::ifstream ifs("save_async_test.svg");
+    std::stringstream saved;
+    saved << ifs.rdbuf();
+    EXPECT_EQ(saved.str(), expected);
+    ifs.close();
+    std::remove("save_async_test.svg");
+
+    Document bad("no_such_directory/save_async_test.svg");
+    SaveHandle failed = bad.saveAsync();
+    EXPECT_FALSE(failed.ok());
+    EXPECT_FALSE(failed.error().empty());
+}
+
+TEST(SimpleSvgTest, DocumentReaderTest)
+{
+    ShapeColl shapes;
+    shapes << Circle(Point(10, 10), 4, Fill(Color::Red))
+           << LineChart()  // serializes to nothing
+           << Text(Point(5, 5), "a & b")
+           << Rectangle(Point(1, 2), 3, 4, Fill(Color::Blue));
+    Layout layout(Dimensions(50, 50));
+    Document doc("", layout);
+    doc << shapes;
+
+    auto readAll = [](DocumentReader &reader, std::size_t max_bytes)
+    {
+        std::string out;
+        std::vector<char> buffer(max_bytes);
+        while (std::size_t count = reader.nextChunk(buffer.data(), max_bytes))
+        {
+            EXPECT_LE(count, max_bytes);
+            out.append(buffer.data(), count);
+        }
+        return out;
+    };
+
+    DocumentReader doc_reader(doc);
+    EXPECT_FALSE(doc_reader.done());
+    EXPECT_EQ(readAll(doc_reader, 7), doc.toString());
+    EXPECT_TRUE(doc_reader.done());
+
+    DocumentReader shape_reader(shapes, layout);
+    EXPECT_EQ(readAll(shape_reader, 1), doc.toString());
+    DocumentReader large_reader(shapes, layout);
+    EXPECT_EQ(readAll(large_reader, 1 << 16), doc.toString());
+}
+
+static std::string readFile(std::string const &file_name)
+{
+    std::ifstream ifs(file_name.c_str(), std::ios::binary);
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    return ss.str();
+}
+
+TEST(SimpleSvgTest, AppendModeTest)
+{
+    char const *file_name = "append_mode_test.svg";
+    std::remove(file_name);
+    {
+        Document doc(file_name, Layout(Dimensions(100, 100)));
+        doc << Circle(Point(1, 1), 2);
+        ASSERT_TRUE(doc.beginAppend(2));
+        std::string content = readFile(file_name);
+        EXPECT_EQ(content, doc.toString());
+
+        doc << Circle(Point(2, 2), 2);
+        EXPECT_EQ(readFile(file_name), content);  // batch not full yet
+        doc << Circle(Point(3, 3), 2);
+        content = readFile(file_name);
+        EXPECT_TRUE(content.find("cx=\"3\"") != std::string::npos);
+        EXPECT_EQ(content.substr(content.size() - 7), "</svg>\n");
+
+        doc << Circle(Point(4, 4), 2);
+        EXPECT_TRUE(doc.flush());
+        EXPECT_TRUE(readFile(file_name).find("cx=\"4\"") !=
+                    std::string::npos);
+        EXPECT_TRUE(doc.endAppend());
+    }
+
+    // Simulate a process dying halfway through writing a shape.
+    std::string complete = readFile(file_name);
+    {
+        std::string torn = complete.substr(0, complete.size() - 7) +
+                           "\t<circle cx=\"9";
+        std::ofstream ofs(file_name, std::ios::binary);
+        ofs << torn;
+    }
+    {
+        Document doc(file_name, Layout(Dimensions(100, 100)));
+        ASSERT_TRUE(doc.beginAppend());
+        EXPECT_EQ(readFile(file_name), complete);
+        doc << Circle(Point(5, 5), 2);
+    }  // pending shapes are written when the last copy goes away
+    std::string content = readFile(file_name);
+    EXPECT_EQ(content.find("cx=\"9"), std::string::npos);
+    EXPECT_TRUE(content.find("cx=\"5\"") != std::string::npos);
+    EXPECT_EQ(content.substr(content.size() - 7), "</svg>\n");
+    EXPECT_EQ(content.find("</svg>"), content.size() - 7);
+    std::remove(file_name);
+}
+
+TEST(SimpleSvgTest, AppendModeSaveTest)
+{
+    char const *file_name = "append_mode_save_test.svg";
+    std::remove(file_name);
+    {
+        Document doc(file_name, Layout(Dimensions(100, 100)));
+        doc << Circle(Point(1, 1), 2);
+        ASSERT_TRUE(doc.beginAppend(4));
+        doc << Circle(Point(2, 2), 2) << Circle(Point(3, 3), 2);
+
+        // Everything goes through the append file instead of replacing it.
+        ASSERT_TRUE(doc.save());
+        std::string const content = readFile(file_name);
+        EXPECT_TRUE(content.find("cx=\"3\"") != std::string::npos);
+        EXPECT_EQ(doc.toString(), content);
+        DocumentReader reader(doc);
+        std::string read;
+        char buffer[7];
+        while (std::size_t count = reader.nextChunk(buffer, sizeof(buffer)))
+            read.append(buffer, count);
+        EXPECT_EQ(read, content);
+        EXPECT_TRUE(reader.done());
+        EXPECT_TRUE(doc.saveAsync().ok());
+
+        EXPECT_TRUE(reader.ok());
+
+        doc << Circle(Point(4, 4), 2);
+        EXPECT_TRUE(doc.endAppend());
+    }
+    std::string const content = readFile(file_name);
+    for (char const *cx : {"cx=\"1\"", "cx=\"2\"", "cx=\"3\"", "cx=\"4\""})
+    {
+        EXPECT_NE(content.find(cx), std::string::npos) << cx;
+        EXPECT_EQ(content.find(cx), content.rfind(cx)) << cx;
+    }
+    EXPECT_EQ(content.find("</svg>"), content.size() - 7);
+    std::remove(file_name);
+}
+
+TEST(SimpleSvgTest, AppendModeReadFailureTest)
+{
+    char const *file_name = "append_mode_read_failure_test.svg";
+    std::remove(file_name);
+    Document doc(file_name, Layout(Dimensions(100, 100)));
+    ASSERT_TRUE(doc.beginAppend());
+    doc << Circle(Point(1, 1), 2);
+
+    // The file stays open for writing, but can no longer be read back.
+    std::remove(file_name);
+    DocumentReader reader(doc);
+    char buffer[16];
+    EXPECT_EQ(reader.nextChunk(buffer, sizeof(buffer)), 0u);
+    EXPECT_FALSE(reader.ok());
+    EXPECT_FALSE(reader.done());
+    EXPECT_NE(reader.error().find(file_name), std::string::npos);
+    doc.endAppend();
+    std::remove(file_name);
+}
+
+TEST(SimpleSvgTest, AppendNumberTest)
+{
+    double const values[] = {0,       -0.0,     1,         -42,      999999,
+                             1000000, -999999,  0.5,       1.0 / 3,  -2.75,
+                             1e-7,    123456.7, 1234567.0, 6.02e23, 1e100};
+    for (double value : values)
+    {
+        std::stringstream ss;
+        ss << value;
+        std::string formatted;
+        appendNumber(formatted, value);
+        EXPECT_EQ(formatted, ss.str());
+    }
+}
+
+TEST_F(SVGTest, MarkerBatchTest)
+{
+    std::vector<double> xs = {10, 20.5, 30};
+    std::vector<double> ys = {5, 15, 25, 99};  // extra value ignored
+    MarkerBatch batch(xs, ys, 4, Fill(Color::Red), Stroke(1, Color::Black));
+    ASSERT_EQ(batch.size(), 3u);
+
+    ShapeColl circles;
+    for (std::size_t i = 0; i < 3; ++i)
+        circles << Circle(Point(xs[i], ys[i]), 4, Fill(Color::Red),
+                          Stroke(1, Color::Black));
+    EXPECT_EQ(batch.toString(layout), circles.toString(layout));
+
+    batch.setColors({Color(0, 0, 255), Color(0, 0, 255), Color(0, 255, 0)});
+    batch.setMode(MarkerBatch::SinglePath);
+    std::string pathStr = batch.toString(layout);
+    EXPECT_EQ(pathStr.find("<path d=\"M8,5a2,2 0 1,0 4,0a2,2 0 1,0 -4,0zM"), 1u);
+    EXPECT_EQ(std::count(pathStr.begin(), pathStr.end(), 'M'), 3);
+    EXPECT_TRUE(pathStr.find("fill=\"#00f\"") != std::string::npos);
+    EXPECT_TRUE(pathStr.find("fill=\"#0f0\"") != std::string::npos);
+
+    batch.setMode(MarkerBatch::UseInstances);
+    std::string useStr = batch.toString(layout);
+    EXPECT_TRUE(useStr.find("<defs><circle id=\"marker") != std::string::npos);
+    EXPECT_TRUE(useStr.find("x=\"20.5\" y=\"15\" fill=\"#00f\"") !=
+                std::string::npos);
+    EXPECT_EQ(useStr.find("\t<use", useStr.rfind("\t<use") + 1),
+              std::string::npos);
+    // The id depends on the markers only, not on other batches made since.
+    MarkerBatch same(xs, ys, 4, Fill(Color::Red), Stroke(1, Color::Black),
+                     MarkerBatch::UseInstances);
+    same.setColors({Color(0, 0, 255), Color(0, 0, 255), Color(0, 255, 0)});
+    EXPECT_EQ(same.toString(layout), useStr);
+    MarkerBatch other(xs, ys, 4, Fill(Color::Red), Stroke(),
+                      MarkerBatch::UseInstances);
+    std::size_t const id = useStr.find("id=\"marker");
+    std::string const batch_id =
+        useStr.substr(id, useStr.find('"', id + 4) - id);
+    EXPECT_EQ(other.toString(layout).find(batch_id), std::string::npos);
+
+    // Within a document every definition gets an id of its own, also for a
+    //  batch added twice, an identical one or one from another producer.
+    auto ids = [](std::string const &svg)
+    {
+        std::vector<std::string> found;
+        for (std::size_t at = svg.find("id=\""); at != std::string::npos;
+             at = svg.find("id=\"", at + 1))
+            found.push_back(svg.substr(at, svg.find('"', at + 4) - at));
+        return found;
+    };
+    Document doc("", layout);
+    doc << batch << batch << same;
+    DocumentBuilder builder(layout);
+    builder.producer(0, 0) << same;
+    builder.producer(0, 1) << same;
+    builder.mergeInto(doc);
+    std::string const docStr = doc.toString();
+    std::vector<std::string> doc_ids = ids(docStr);
+    ASSERT_EQ(doc_ids.size(), 5u);
+    std::sort(doc_ids.begin(), doc_ids.end());
+    EXPECT_EQ(std::unique(doc_ids.begin(), doc_ids.end()), doc_ids.end());
+    for (std::string const &doc_id : doc_ids)
+        EXPECT_NE(docStr.find("#" + doc_id.substr(4)), std::string::npos);
+
+    batch.setDiameters({2, 4, 6});  // <use> cannot resize, so circles
+    EXPECT_TRUE(batch.toString(layout).find("<circle cx=\"30\" cy=\"25\" "
+                                            "r=\"3\"") != std::string::npos);
+}
+
+TEST_F(SVGTest, HeatmapTest)
+{
+    ColorMap colors({Color(0, 0, 255), Color(255, 0, 0)}, 0, 1, 2);
+    EXPECT_EQ(colors.level(0.2), 0u);
+    EXPECT_EQ(colors.level(0.7), 1u);
+    EXPECT_EQ(colors.color(0), Color(0, 0, 255));
+    EXPECT_EQ(colors.color(1), Color(255, 0, 0));
+
+    // Left half low, right half high: two blocks regardless of grid size.
+    std::size_t const columns = 4, rows = 3;
+    std::vector<double> values;
+    for (std::size_t row = 0; row < rows; ++row)
+        for (std::size_t column = 0; column < columns; ++column)
+            values.push_back(column < 2 ? 0.1 : 0.9);
+
+    Heatmap rects(Point(10, 20), columns, rows, 5, 2, values, colors,
+                  Heatmap::Rectangles);
+    ShapeColl expected;
+    expected << Rectangle(Point(10, 20), 10, 6, Fill(Color(0, 0, 255)))
+             << Rectangle(Point(20, 20), 10, 6, Fill(Color(255, 0, 0)));
+    EXPECT_EQ(rects.toString(layout), expected.toString(layout));
+    Layout bottomRight(Dimensions(100, 100), Layout::BottomRight);
+    EXPECT_EQ(rects.toString(bottomRight), expected.toString(bottomRight));
+
+    Heatmap paths(Point(0, 0), columns, rows, 1, 1, values, colors);
+    EXPECT_EQ(paths.toString(layout),
+              "\t<path d=\"M0,0h2v3h-2z\" fill=\"#00f\" />\n"
+              "\t<path d=\"M2,0h2v3h-2z\" fill=\"#f00\" />\n");
+
+    // A checkerboard cannot merge; NaN cells are skipped.
+    std::vector<double> checker = {0, 1, 0, 1, 0, std::nan("")};
+    Heatmap board(Point(0, 0), 3, 2, 1, 1, checker, colors,
+                  Heatmap::Rectangles);
+    std::string boardStr = board.toString(layout);
+    EXPECT_EQ(std::count(boardStr.begin(), boardStr.end(), '\n'), 5);
+
+    // Large grids are split across threads with the same result.
+    std::vector<double> field(300 * 300);
+    for (std::size_t i = 0; i < field.size(); ++i)
+        field[i] = (i / 300 / 7 + i % 300 / 11) % 5 / 4.0;
+    ColorMap five({Color(0, 0, 0), Color(255, 255, 255)}, 0, 1, 5);
+    Heatmap serial(Point(0, 0), 300, 300, 1, 1, field, five);
+    serial.setThreadCount(1);
+    Heatmap parallel(Point(0, 0), 300, 300, 1, 1, field, five);
+    parallel.setThreadCount(4);
+    EXPECT_EQ(serial.toString(layout), parallel.toString(layout));
+}
+
+TEST_F(SVGTest, ClipTest)
+{
+    Layout clipped = layout;
+    clipped.clip = true;
+
+    // Entirely visible geometry is written exactly as without clipping.
+    Polyline inside(Stroke(1, Color::Blue));
+    inside << Point(10, 10) << Point(20.5, 30) << Point(90, 50);
+    EXPECT_EQ(inside.toString(clipped), inside.toString(layout));
+    Polygon square(Fill(Color::Red), Stroke());
+    square << Point(10, 10) << Point(20, 10) << Point(20, 20);
+    EXPECT_EQ(square.toString(clipped), square.toString(layout));
+
+    // Margin is 2 * stroke width + 1 = 3 around the 100x100 viewport.
+    Polyline crossing(Stroke(1, Color::Blue));
+    crossing << Point(-1000, 50) << Point(50, 50) << Point(50, 1000);
+    EXPECT_TRUE(crossing.toString(clipped).find(
+                    "<polyline points=\"-3,50 50,50 50,103 \"") !=
+                std::string::npos);
+
+    // Leaving and re-entering splits the line into subpaths.
+    Polyline zigzag(Stroke(1, Color::Blue));
+    zigzag << Point(10, 10) << Point(10, 500) << Point(20, 500)
+           << Point(20, 10);
+    std::string zigzagStr = zigzag.toString(clipped);
+    EXPECT_TRUE(zigzagStr.find("<path d=\"M10,10 10,103 M20,103 20,10 \"") !=
+                std::string::npos);
+    EXPECT_TRUE(zigzagStr.find("stroke=\"#00f\"") != std::string::npos);
+
+    Polyline outside(Stroke(1, Color::Blue));
+    outside << Point(200, 200) << Point(300, 300);
+    EXPECT_EQ(outside.toString(clipped), "");
+
+    Polygon big(Fill(Color::Red), Stroke());
+    big << Point(-500, -500) << Point(50, -500) << Point(50, 50)
+        << Point(-500, 50);
+    EXPECT_TRUE(big.toString(clipped).find(
+                    "points=\"-1,-1 50,-1 50,50 -1,50 \"") !=
+                std::string::npos);
+
+    Path path(Fill(Color::Yellow), Stroke());
+    path << Point(200, 200) << Point(300, 200) << Point(300, 300);
+    path.startNewSubPath();
+    path << Point(0, 0) << Point(10, 0) << Point(10, 10);
+    EXPECT_TRUE(path.toString(clipped).find("d=\"M0,0 10,0 10,10 z \"") !=
+                std::string::npos);
+
+    EXPECT_EQ(Circle(Point(150, 50), 10).toString(clipped), "");
+    EXPECT_NE(Circle(Point(104, 50), 10).toString(clipped), "");
+}
+
+TEST_F(SVGTest, QuantizeTest)
+{
+    std::atomic<std::uint64_t> removed(0);
+    Layout quantized = layout;
+    quantized.quantum = 0.5;
+    quantized.removed_points = &removed;
+
+    Polyline line(Stroke(1, Color::Blue));
+    line << Point(0, 0) << Point(0.1, 0.1)  // same grid point as 0,0
+         << Point(1, 1) << Point(2, 2)      // straight continuations
+         << Point(3, 3.1) << Point(3, 5)    // corner is kept
+         << Point(3, 4);                    // so is turning back
+    EXPECT_TRUE(line.toString(quantized).find(
+                    "points=\"0,0 3,3 3,5 3,4 \"") != std::string::npos);
+    EXPECT_EQ(removed.load(), 3u);
+
+    Polygon polygon(Fill(Color::Red), Stroke());
+    polygon << Point(10.26, 10) << Point(20, 10) << Point(30, 10)
+            << Point(30, 20.24);
+    EXPECT_TRUE(polygon.toString(quantized).find(
+                    "points=\"10.5,10 30,10 30,20 \"") != std::string::npos);
+    EXPECT_EQ(removed.load(), 4u);
+
+    Path path(Fill(Color::Yellow), Stroke());
+    path << Point(0, 0) << Point(0, 0.2) << Point(4, 0);
+    EXPECT_TRUE(path.toString(quantized).find("d=\"M0,0 4,0 z \"") !=
+                std::string::npos);
+    EXPECT_EQ(removed.load(), 5u);
+
+    // Points already on the grid and not in line are written unchanged.
+    Layout whole = layout;
+    whole.quantum = 1;
+    Polyline exact(Stroke(1, Color::Blue));
+    exact << Point(1, 2) << Point(3, 7) << Point(8, 1);
+    EXPECT_EQ(exact.toString(whole), exact.toString(layout));
+}
+
+TEST(SimpleSvgTest, PullParserTest)
+{
+    std::string const input =
+        "<?xml version=\"1.0\"?><!-- note --><a x='1' y=\"&lt;2\">"
+        "t&amp;t<b/></a>";
+    SvgPullParser parser(input.data(), input.size());
+
+    ASSERT_EQ(parser.next(), SvgPullParser::StartElement);
+    EXPECT_TRUE(parser.name() == "a");
+    ASSERT_EQ(parser.attributeCount(), 2u);
+    EXPECT_EQ(parser.attribute("x").str(), "1");
+    EXPECT_EQ(parser.attribute("y").str(), "&lt;2");
+    EXPECT_FALSE(parser.attribute("z").present());
+
+    ASSERT_EQ(parser.next(), SvgPullParser::Text);
+    std::string text;
+    appendXmlUnescaped(text, parser.text().data, parser.text().size);
+    EXPECT_EQ(text, "t&t");
+
+    ASSERT_EQ(parser.next(), SvgPullParser::StartElement);
+    EXPECT_TRUE(parser.name() == "b");
+    EXPECT_EQ(parser.next(), SvgPullParser::EndElement);
+    ASSERT_EQ(parser.next(), SvgPullParser::EndElement);
+    EXPECT_TRUE(parser.name() == "a");
+    EXPECT_EQ(parser.next(), SvgPullParser::EndOfInput);
+
+    std::string const broken = "<a x=\"1></a>";
+    SvgPullParser failing(broken.data(), broken.size());
+    EXPECT_EQ(failing.next(), SvgPullParser::Error);
+    EXPECT_STREQ(failing.error(), "unterminated attribute value");
+    EXPECT_EQ(failing.next(), SvgPullParser::Error);
+}
+
+TEST(SimpleSvgTest, UnescapeTest)
+{
+    std::string text;
+    std::string const input = "&quot;&apos;&#65;&#x263A;&unknown; & end";
+    appendXmlUnescaped(text, input.data(), input.size());
+    EXPECT_EQ(text, "\"'A\xE2\x98\xBA&unknown; & end");
+}
+
+TEST(SimpleSvgTest, LoadRoundTripTest)
+{
+    Layout source_layout(Dimensions(300, 200), Layout::BottomLeft, 1.5,
+                         Point(3, -2));
+    Document source("", source_layout);
+    source << Circle(Point(10.25, 20), 7, Fill(Color(10, 20, 30, 128)),
+                     Stroke(1.5, Color::Black, true))
+           << Elipse(Point(50, 60), 20, 10, Fill(Color::Yellow))
+           << Rectangle(Point(5, 5), 30.5, 12, Fill(Color(1, 2, 3)),
+                        Stroke(2, Color(200, 100, 50, 64)))
+           << Line(Point(0, 0), Point(100, 33.3333), Stroke(0.5, Color::Red))
+           << Text(Point(20, 100), "a < b & \"c\"", Fill(Color::Blue),
+                   Font(14, "Times & Co"));
+
+    Polygon polygon(Fill(Color::Lime), Stroke(1, Color::Black));
+    polygon << Point(1, 2) << Point(30, 4.5) << Point(12, 40);
+    Polyline polyline(Stroke(2, Color::Purple));
+    polyline << Point(0.1, 0.2) << Point(1e-3, 150) << Point(-12, 7);
+    Path path(Fill(Color::Orange), Stroke());
+    path << Point(0, 0) << Point(10, 0) << Point(10, 10);
+    path.startNewSubPath();
+    path << Point(2, 2) << Point(4, 2) << Point(4, 4);
+    source << polygon << polyline << path;
+
+    std::string const original = source.toString();
+    LoadResult loaded = loadSvg(original.data(), original.size());
+    ASSERT_TRUE(loaded.ok) << loaded.error;
+    EXPECT_EQ(loaded.skipped, 0u);
+    EXPECT_EQ(loaded.shapes.size(), 8u);
+    EXPECT_EQ(loaded.layout.dimensions.width, 300);
+    EXPECT_EQ(loaded.layout.dimensions.height, 200);
+
+    Document reloaded("", loaded.layout);
+    reloaded << loaded.shapes;
+    EXPECT_EQ(reloaded.toString(), original);
+}
+
+TEST(SimpleSvgTest, LoadDelegatedTest)
+{
+    // A delegated document loads into the shapes it has without delegation.
+    //  Text positions are chosen to survive the 6 digits written for them.
+    Layout const layouts[] = {
+        Layout(Dimensions(300, 200), Layout::BottomLeft, 2, Point(3, -2)),
+        Layout(Dimensions(300, 200), Layout::TopLeft, 0.5, Point(-4, 8)),
+        Layout(Dimensions(300, 200), Layout::BottomRight, 4)};
+    for (Layout const &layout : layouts)
+    {
+        Document plain("", layout);
+        Document delegated("", layout, true);
+        Polyline polyline(Stroke(2, Color::Purple));
+        polyline << Point(0.5, 0.25) << Point(10, 150) << Point(-12, 7);
+        Path path(Fill(Color::Orange), Stroke(1, Color::Black, true));
+        path << Point(0, 0) << Point(10, 0) << Point(10, 10);
+        for (Document *doc : {&plain, &delegated})
+            *doc << Circle(Point(10.25, 20), 7, Fill(Color::Red),
+                           Stroke(1.5, Color::Black))
+                 << Rectangle(Point(5, 5), 30.5, 12, Fill(Color::Blue))
+                 << Line(Point(0, 0), Point(100, 33.5), Stroke(0.5))
+                 << Text(Point(20, 100), "label", Fill(Color::Blue),
+                         Font(14, "Verdana"))
+                 << polyline << path;
+
+        std::string const svg = delegated.toString();
+        LoadResult loaded = loadSvg(svg.data(), svg.size());
+        ASSERT_TRUE(loaded.ok) << loaded.error;
+        EXPECT_EQ(loaded.skipped, 0u);
+        Document reloaded("", loaded.layout);
+        reloaded << loaded.shapes;
+        EXPECT_EQ(reloaded.toString(), plain.toString());
+    }
+
+    // Rotated groups and mirrored text cannot be loaded as such.
+    std::string const svg =
+        "<svg width=\"10\" height=\"10\">"
+        "<g transform=\"rotate(45)\"><circle r=\"1\"/></g>"
+        "<g transform=\"translate(1 2) scale(2)\">"
+        "<circle cx=\"1\" cy=\"1\" r=\"1\"/>"
+        "<text x=\"1\" y=\"1\" transform=\"scale(-1,1)\">a</text>"
+        "</g></svg>";
+    LoadResult loaded = loadSvg(svg.data(), svg.size());
+    ASSERT_TRUE(loaded.ok) << loaded.error;
+    EXPECT_EQ(loaded.skipped, 2u);
+    ASSERT_EQ(loaded.shapes.size(), 1u);
+    EXPECT_EQ(loaded.shapes[0]->toString(loaded.layout),
+              "\t<circle cx=\"3\" cy=\"4\" r=\"2\" fill=\"none\" />\n");
+}
+
+TEST(SimpleSvgTest, LoadPartialTest)
+{
+    Layout layout(Dimensions(100, 100), Layout::TopLeft);
+    layout.clip = true;
+    Document source("", layout);
+
+    // Clipped into two open pieces.
+    Polyline zigzag(Stroke(1, Color::Blue));
+    zigzag << Point(10, 10) << Point(10, 500) << Point(20, 500)
+           << Point(20, 10);
+    source << zigzag;
+    // Arcs and <use> are not read.
+    MarkerBatch arcs(4, Fill(Color::Red));
+    arcs.setMode(MarkerBatch::SinglePath);
+    arcs << Point(10, 10) << Point(20, 20);
+    MarkerBatch uses(4, Fill(Color::Red));
+    uses.setMode(MarkerBatch::UseInstances);
+    uses << Point(10, 10) << Point(20, 20);
+    source << arcs << uses << Circle(Point(50, 50), 10, Fill(Color::Red));
+
+    std::string const original = source.toString();
+    LoadResult loaded = loadSvg(original.data(), original.size());
+    ASSERT_TRUE(loaded.ok) << loaded.error;
+    // The path, the <defs> and both <use> elements.
+    EXPECT_EQ(loaded.skipped, 4u);
+    ASSERT_EQ(loaded.shapes.size(), 3u);
+    EXPECT_EQ(loaded.shapes[0]->toString(loaded.layout),
+              "\t<polyline points=\"10,10 10,103 \" fill=\"none\" "
+              "stroke-width=\"1\" stroke=\"#00f\" />\n");
+    EXPECT_TRUE(dynamic_cast<Circle *>(loaded.shapes[2].get()) != nullptr);
+
+    std::string const truncated = original.substr(0, 200);
+    EXPECT_FALSE(loadSvg(truncated.data(), truncated.size()).ok);
+    // Cut between elements, so only the closing tag is missing.
+    std::string const unclosed = original.substr(0, original.rfind("</svg>"));
+    LoadResult open_svg = loadSvg(unclosed.data(), unclosed.size());
+    EXPECT_FALSE(open_svg.ok);
+    EXPECT_EQ(open_svg.error.find("unclosed element"), 0u);
+
+    // End tags must close the element that is open.
+    std::string const mismatched = "<svg><g></svg>";
+    LoadResult crossed = loadSvg(mismatched.data(), mismatched.size());
+    EXPECT_FALSE(crossed.ok);
+    EXPECT_EQ(crossed.error, "end tag </svg> does not match <g> at byte 14");
+    std::string const stray = "<svg></svg></x>";
+    LoadResult extra = loadSvg(stray.data(), stray.size());
+    EXPECT_FALSE(extra.ok);
+    EXPECT_EQ(extra.error, "end tag </x> without an open element at byte 15");
+    std::string const in_text = "<svg><text>a</g></svg>";
+    LoadResult text_end = loadSvg(in_text.data(), in_text.size());
+    EXPECT_FALSE(text_end.ok);
+    EXPECT_EQ(text_end.error.find("end tag </g> does not match <text>"), 0u);
+}
+
+TEST(SimpleSvgTest, LoadFileTest)
+{
+    std::string const file_name = "simple_svg_load_test.svg";
+    Document source(file_name, Layout(Dimensions(64, 48)));
+    source << Rectangle(Point(1, 2), 3, 4, Fill(Color::Green));
+    ASSERT_TRUE(source.save());
+
+    LoadResult loaded = loadSvgFile(file_name);
+    ASSERT_TRUE(loaded.ok) << loaded.error;
+    ASSERT_EQ(loaded.shapes.size(), 1u);
+    Document reloaded("", loaded.layout);
+    reloaded << loaded.shapes;
+    EXPECT_EQ(reloaded.toString(), source.toString());
+    std::remove(file_name.c_str());
+
+    EXPECT_FALSE(loadSvgFile("does/not/exist.svg").ok);
+}
+
+TEST(SimpleSvgTest, DisplayListTest)
+{
+    ShapeColl scene;
+    scene << Circle(Point(10.25, 20), 7, Fill(Color(10, 20, 30, 128)),
+                    Stroke(1.5, Color::Black, true))
+          << Elipse(Point(50, 60), 20, 10, Fill(Color::Yellow))
+          << Rectangle(Point(5, 5), 30.5, 12, Fill(Color(1, 2, 3)))
+          << Line(Point(0, 0), Point(100, 1.0 / 3), Stroke(0.5, Color::Red))
+          << Text(Point(20, 100), "a < b", Fill(Color::Blue),
+                  Font(14, "Times"));
+    Polygon polygon(Fill(Color::Lime), Stroke(1, Color::Black));
+    polygon << Point(1, 2) << Point(30, 4.5) << Point(-12, 40);
+    Polyline polyline(Stroke(2, Color::Purple));
+    polyline << Point(0.125, 0.2) << Point(1e-3, 150) << Point(-0.0, 1e300);
+    Path path(Fill(Color::Orange), Stroke());
+    path << Point(0, 0) << Point(10, 0) << Point(10, 10);
+    path.startNewSubPath();
+    path << Point(2, 2) << Point(4, 2) << Point(4, 4);
+    ShapeColl nested;
+    nested << polygon << polyline;
+    scene << nested << path << LineChart();
+
+    DisplayListWriter writer;
+    writer << scene;
+    EXPECT_EQ(writer.recordCount(), 8u);
+    EXPECT_EQ(writer.skipped(), 1u);  // the LineChart
+    std::string const bytes = writer.bytes();
+
+    DisplayList list(bytes.data(), bytes.size());
+    ASSERT_TRUE(list.isValid()) << list.error();
+    EXPECT_EQ(list.version(), displayListVersion);
+    EXPECT_EQ(list.recordCount(), 8u);
+
+    Layout top_left(Dimensions(100, 100), Layout::TopLeft);
+    Layout bottom_right(Dimensions(640, 480), Layout::BottomRight, 2.5,
+                        Point(-3, 7));
+    Layout clipped(Dimensions(50, 50), Layout::BottomLeft);
+    clipped.clip = true;
+    clipped.quantum = 0.5;
+    for (Layout const &layout : {top_left, bottom_right, clipped})
+    {
+        EXPECT_EQ(list.toString(layout), scene.toString(layout));
+        EXPECT_EQ(list.toShapes().toString(layout), scene.toString(layout));
+    }
+
+    // Whole-pixel point data costs a few bytes per point, not ~8 of text.
+    Polyline series(Stroke(1, Color::Blue));
+    for (int i = 0; i < 1000; ++i) series << Point(i, 500 + (i * 7) % 13);
+    DisplayListWriter series_writer;
+    series_writer << series;
+    EXPECT_LT(series_writer.bytes().size(), 2100u);
+
+    std::string future = bytes;
+    future[4] = static_cast<char>(displayListVersion + 1);
+    DisplayList unsupported(future.data(), future.size());
+    EXPECT_FALSE(unsupported.isValid());
+    EXPECT_EQ(unsupported.error(), "unsupported display list version 3");
+    std::string previous = bytes;
+    previous[4] = 1;
+    EXPECT_TRUE(DisplayList(previous.data(), previous.size()).isValid());
+
+    std::string const truncated = bytes.substr(0, bytes.size() - 10);
+    DisplayList damaged(truncated.data(), truncated.size());
+    ASSERT_TRUE(damaged.isValid());
+    std::string partial;
+    EXPECT_FALSE(damaged.appendTo(partial, top_left));
+    EXPECT_FALSE(DisplayList("SVG", 3).isValid());
+}
+
+TEST(SimpleSvgTest, FragmentCacheTest)
+{
+    Layout layout(Dimensions(100, 100), Layout::TopLeft);
+    Circle circle(Point(10, 10), 4, Fill(Color::Red));
+    Circle moved(Point(11, 10), 4, Fill(Color::Red));
+    Circle recolored(Point(10, 10), 4, Fill(Color::Blue));
+    std::string const key = FragmentCache::makeKey(circle, layout);
+    ASSERT_FALSE(key.empty());
+    EXPECT_EQ(FragmentCache::makeKey(Circle(circle), layout), key);
+    EXPECT_NE(FragmentCache::makeKey(moved, layout), key);
+    EXPECT_NE(FragmentCache::makeKey(recolored, layout), key);
+    EXPECT_NE(FragmentCache::makeKey(circle, Layout(Dimensions(100, 100))),
+              key);
+    EXPECT_TRUE(FragmentCache::makeKey(MarkerBatch(2), layout).empty());
+
+    // Room for about two entries.
+    FragmentCache cache(400);
+    EXPECT_EQ(cache.toString(circle, layout), circle.toString(layout));
+    EXPECT_EQ(cache.toString(circle, layout), circle.toString(layout));
+    cache.toString(moved, layout);
+    cache.toString(circle, layout);  // now more recent than moved
+    cache.toString(recolored, layout);
+    FragmentCacheStats stats = cache.stats();
+    EXPECT_EQ(stats.hits, 2u);
+    EXPECT_EQ(stats.misses, 3u);
+    EXPECT_EQ(stats.evictions, 1u);
+    EXPECT_EQ(stats.entries, 2u);
+    EXPECT_LE(stats.bytes, 400u);
+    EXPECT_DOUBLE_EQ(stats.hitRate(), 0.4);
+
+    std::string out;
+    EXPECT_TRUE(cache.find(FragmentCache::makeKey(circle, layout), out));
+    EXPECT_FALSE(cache.find(FragmentCache::makeKey(moved, layout), out));
+    cache.setBudget(0);
+    EXPECT_FALSE(cache.enabled());
+    EXPECT_EQ(cache.stats().entries, 0u);
+}
+
+TEST(SimpleSvgTest, GlobalFragmentCacheTest)
+{
+    Layout layout(Dimensions(200, 100));
+    LineChart chart(Dimensions(5, 5));
+    Polyline series(Stroke(1, Color::Blue));
+    series << Point(0, 0) << Point(10, 20) << Point(20, 5);
+    chart << series;
+    ShapeColl legend;
+    legend << Rectangle(Point(150, 80), 10, 10, Fill(Color::Blue))
+           << Text(Point(165, 80), "series");
+    ShapeColl scene;
+    scene << chart << legend << Circle(Point(1, 1), 2);
+
+    Document uncached("", layout);
+    uncached << scene << chart;
+
+    FragmentCache &cache = FragmentCache::global();
+    cache.setBudget(1 << 20);
+    cache.resetStats();
+    Document first("", layout);
+    first << scene << chart;
+    Document second("", layout);
+    second << scene << chart;
+    FragmentCacheStats stats = cache.stats();
+    cache.setBudget(0);
+
+    EXPECT_EQ(first.toString(), uncached.toString());
+    EXPECT_EQ(second.toString(), uncached.toString());
+    // The scene holds a chart, so only the chart and the legend inside it
+    //  are cached: first misses both, then hits the chart as a shape of its
+    //  own; second hits all three.
+    EXPECT_EQ(stats.misses, 2u);
+    EXPECT_EQ(stats.hits, 4u);
+
+    // Render stats count hits as if the shapes had been rendered.
+    ShapeStats const expected = uncached.stats().total();
+    EXPECT_EQ(uncached.stats().cache_hits, 0u);
+    EXPECT_EQ(first.stats().cache_hits, 1u);
+    EXPECT_EQ(second.stats().cache_hits, 3u);
+    for (Document const *doc : {&first, &second})
+    {
+        ShapeStats const total = doc->stats().total();
+        EXPECT_EQ(total.elements, expected.elements);
+        EXPECT_EQ(total.points, expected.points);
+        EXPECT_EQ(total.bytes, expected.bytes);
+    }
+    EXPECT_EQ(second.stats().shapes.at("Rectangle").elements, 1u);
+    EXPECT_EQ(second.stats().shapes.at("LineChart").elements, 2u);
+}
+
+TEST(SimpleSvgTest, FragmentCacheThreadsTest)
+{
+    Layout layout(Dimensions(100, 100));
+    std::vector<ShapeColl> scenes(8);
+    for (std::size_t i = 0; i < scenes.size(); ++i)
+        for (int j = 0; j < 20; ++j)
+            scenes[i] << Circle(Point(static_cast<double>(i), j), 3);
+
+    FragmentCache cache(4096);  // forces eviction while threads run
+    std::vector<std::string> results(4);
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < results.size(); ++t)
+        threads.emplace_back(
+            [&, t]
+            {
+                for (int round = 0; round < 50; ++round)
+                    for (auto const &scene : scenes)
+                        results[t] += cache.toString(scene, layout);
+            });
+    for (auto &thread : threads) thread.join();
+
+    std::string expected;
+    for (int round = 0; round < 50; ++round)
+        for (auto const &scene : scenes) expected += scene.toString(layout);
+    for (auto const &result : results) EXPECT_EQ(result, expected);
+    FragmentCacheStats stats = cache.stats();
+    EXPECT_EQ(stats.hits + stats.misses, 4u * 50 * 8);
+    EXPECT_LE(stats.bytes, 4096u);
+}
+
+TEST(SimpleSvgTest, DocumentBuilderTest)
+{
+    Layout layout(Dimensions(200, 200), Layout::TopLeft);
+    DocumentBuilder builder(layout);
+    DocumentBuilder::Producer &labels = builder.producer(2, 0);
+    DocumentBuilder::Producer &odd = builder.producer(1, 1);
+    DocumentBuilder::Producer &even = builder.producer(1, 0);
+    labels << Text(Point(0, 0), "title");
+    odd.add(Circle(Point(1, 1), 2), 1).add(Circle(Point(3, 3), 2), 3);
+    even.add(Circle(Point(0, 0), 2), 0).add(Circle(Point(2, 2), 2), 2);
+
+    Document merged("", layout);
+    builder.mergeInto(merged);
+    Document expected("", layout);
+    expected << Circle(Point(0, 0), 2) << Circle(Point(1, 1), 2)
+             << Circle(Point(2, 2), 2) << Circle(Point(3, 3), 2)
+             << Text(Point(0, 0), "title");
+    EXPECT_EQ(merged.toString(), expected.toString());
+    EXPECT_EQ(labels.size(), 0u);
+
+    // With default sequence numbers, producers of a layer take turns in
+    //  stream order, whichever was created first.
+    DocumentBuilder::Producer &second = builder.producer(0, 7);
+    DocumentBuilder::Producer &first = builder.producer(0, 3);
+    second << Circle(Point(1, 0), 2) << Circle(Point(3, 0), 2);
+    first << Circle(Point(0, 0), 2) << Circle(Point(2, 0), 2)
+          << Circle(Point(4, 0), 2);
+    Document turns("", layout);
+    builder.mergeInto(turns);
+    Document expected_turns("", layout);
+    for (int i = 0; i < 5; ++i) expected_turns << Circle(Point(i, 0), 2);
+    EXPECT_EQ(turns.toString(), expected_turns.toString());
+}
+
+// Run under ThreadSanitizer with -DSIMPLE_SVG_TSAN=ON.
+TEST(SimpleSvgTest, DocumentBuilderStressTest)
+{
+    Layout layout(Dimensions(1000, 1000));
+    int const layers = 8;
+    int const shapes_per_layer = 2000;
+    std::vector<std::string> outputs;
+    for (int run = 0; run < 3; ++run)
+    {
+        DocumentBuilder builder(layout);
+        std::vector<std::thread> threads;
+        for (int layer = layers - 1; layer >= 0; --layer)
+            threads.emplace_back(
+                [&builder, layer, shapes_per_layer]
+                {
+                    // Two producers per layer take turns in the sequence.
+                    DocumentBuilder::Producer &first =
+                        builder.producer(layer, 0);
+                    DocumentBuilder::Producer &second =
+                        builder.producer(layer, 1);
+                    for (int i = 0; i < shapes_per_layer; ++i)
+                    {
+                        Circle circle(Point(layer, i), 1 + i % 5);
+                        (i % 2 ? second : first).add(circle, i);
+                        std::this_thread::yield();
+                    }
+                });
+        for (auto &thread : threads) thread.join();
+
+        Document document("", layout);
+        builder.mergeInto(document);
+        outputs.push_back(document.toString());
+    }
+
+    Document expected("", layout);
+    for (int layer = 0; layer < layers; ++layer)
+        for (int i = 0; i < shapes_per_layer; ++i)
+            expected << Circle(Point(layer, i), 1 + i % 5);
+    for (auto const &output : outputs) EXPECT_EQ(output, expected.toString());
+}
+
+TEST(SimpleSvgTest, StaticLayoutTest)
+{
+    std::vector<Point> points;
+    points.push_back(Point(0, -0.0));
+    points.push_back(Point(-0.0, 0));
+    points.push_back(Point(1.5, -2.25));
+    points.push_back(Point(1e-7, 123456789.5));
+
+    Layout::Origin const origins[] = {Layout::TopLeft, Layout::BottomLeft,
+                                      Layout::TopRight, Layout::BottomRight};
+    for (Layout::Origin origin : origins)
+    {
+        Layout identity(Dimensions(640, 480), origin);
+        Layout scaled(Dimensions(640, 480), origin, 0.3, Point(7, -0.5));
+        Layout negative_zero(Dimensions(640, 480), origin, 1,
+                             Point(-0.0, -0.0));
+        EXPECT_TRUE(isIdentityLayout(identity));
+        EXPECT_FALSE(isIdentityLayout(scaled));
+        EXPECT_FALSE(isIdentityLayout(negative_zero));
+
+        for (Layout const &layout : {identity, scaled, negative_zero})
+        {
+            std::vector<Point> translated =
+                detail::toSvgSpace(points, layout);
+            std::string expected;
+            for (std::size_t i = 0; i < points.size(); ++i)
+            {
+                double x = translateX(points[i].x, layout);
+                double y = translateY(points[i].y, layout);
+                EXPECT_EQ(translated[i].x, x);
+                EXPECT_EQ(translated[i].y, y);
+                EXPECT_EQ(std::signbit(translated[i].x), std::signbit(x));
+                EXPECT_EQ(std::signbit(translated[i].y), std::signbit(y));
+                std::ostringstream ss;
+                ss << x << "," << y << " ";
+                expected += ss.str();
+            }
+            std::string written;
+            detail::appendTranslatedPoints(written, points, layout);
+            EXPECT_EQ(written, expected);
+
+            // Rectangle and Text move their corner by the runtime origin.
+            bool const right = origin == Layout::TopRight ||
+                               origin == Layout::BottomRight;
+            bool const top =
+                origin == Layout::TopLeft || origin == Layout::TopRight;
+            for (Point const &point : points)
+            {
+                double const w = translateScale(4.5, layout);
+                double const h = translateScale(2, layout);
+                double x = translateX(point.x, layout);
+                double y = translateY(point.y, layout);
+                std::ostringstream rect;
+                rect << "\t<rect x=\"" << (right ? x - w : x) << "\" y=\""
+                     << (top ? y : y - h) << "\" width=\"" << w
+                     << "\" height=\"" << h << "\" "
+                     << Fill(Color::Red).toString(layout) << "/>\n";
+                EXPECT_EQ(Rectangle(point, 4.5, 2, Fill(Color::Red))
+                              .toString(layout),
+                          rect.str());
+
+                Font const font(9);
+                std::ostringstream text;
+                text << "\t<text x=\"" << (right ? x - 2 * 9 / 1.5 : x)
+                     << "\" y=\"" << (top ? y + 9 : y) << "\" "
+                     << Fill(Color::Black).toString(layout)
+                     << font.toString(layout) << ">ab</text>\n";
+                EXPECT_EQ(Text(point, "ab", Fill(Color::Black), font)
+                              .toString(layout),
+                          text.str());
+            }
+        }
+    }
+}
+
+TEST(SimpleSvgTest, StreamingLineChartTest)
+{
+    StreamingLineChart chart(16, Dimensions(5, 7));
+    Layout layout(Dimensions(400, 300), Layout::BottomLeft, 1.5);
+    Layout clipped(Dimensions(40, 30), Layout::TopLeft);
+    clipped.clip = true;
+    EXPECT_EQ(chart.toString(layout), "");
+
+    std::size_t first = chart.addSeries(Stroke(1, Color::Blue));
+    std::size_t second =
+        chart.addSeries(Stroke(2, Color::Red), Fill(Color::Yellow));
+    std::size_t const empty = chart.addSeries(Stroke(1, Color::Green));
+    EXPECT_EQ(empty, 2u);
+
+    unsigned state = 12345;
+    auto next = [&state]()
+    {
+        state = state * 1103515245u + 12345u;
+        return static_cast<double>((state >> 8) % 1000) / 10 - 50;
+    };
+    Point const *storage = &chart.point(first, 0);
+    std::string out;
+    for (int i = 0; i < 100; ++i)
+    {
+        chart.push(first, Point(i, next()));
+        if (i % 3 == 0) chart.push(second, Point(next(), next()));
+
+        // Bounds of a sliding window must match a chart built from scratch.
+        std::string expected = chart.toLineChart().toString(layout);
+        out.clear();
+        chart.appendTo(out, layout);
+        ASSERT_EQ(out, expected) << "after " << i;
+        ASSERT_EQ(chart.toString(clipped),
+                  chart.toLineChart().toString(clipped));
+    }
+    EXPECT_EQ(chart.windowSize(first), 16u);
+    EXPECT_EQ(chart.windowSize(second), 16u);
+    EXPECT_EQ(chart.windowSize(empty), 0u);
+    EXPECT_EQ(chart.pointCount(), 32u);
+    EXPECT_EQ(chart.point(first, 0).x, 84);
+    EXPECT_EQ(chart.point(first, 15).x, 99);
+    // The ring is allocated once.
+    EXPECT_EQ(&chart.point(first, 0) - storage, 100 % 16);
+
+    // Once out has grown, pushing and redrawing does not allocate.
+    std::size_t const before = g_allocations.load();
+    for (int i = 100; i < 200; ++i)
+    {
+        chart.push(first, Point(i, next()));
+        chart.push(second, Point(next(), next()));
+        out.clear();
+        chart.appendTo(out, layout);
+    }
+    EXPECT_EQ(0u, g_allocations.load() - before);
+    EXPECT_EQ(out, chart.toLineChart().toString(layout));
+
+    chart.offset(Point(3, -4));
+    EXPECT_EQ(chart.toString(layout), chart.toLineChart().toString(layout));
+}
+
+TEST(SimpleSvgTest, CurvedPathTest)
+{
+    Layout layout(Dimensions(20, 20), Layout::TopLeft);
+    Path path(Fill(Color::Transparent), Stroke(1, Color::Black));
+    path << Point(0, 0);
+    path.curveTo(Point(1, 1), Point(2, 1), Point(3, 0));
+    path << Point(4, 0) << Point(5, 0);
+    path.curveTo(Point(6, 1), Point(7, 1), Point(8, 0));
+    path.curveTo(Point(9, 1), Point(10, 1), Point(11, 0));
+    path.startNewSubPath(false);
+    path << Point(0, 5) << Point(1, 6);
+    EXPECT_EQ(path.curveCount(), 3u);
+    EXPECT_EQ(path.toString(layout),
+              "\t<path d=\"M0,0 C1,1 2,1 3,0 L4,0 5,0 C6,1 7,1 8,0 9,1 10,1 "
+              "11,0 z M0,5 1,6 \" fill-rule=\"evenodd\" fill=\"none\" "
+              "stroke-width=\"1\" stroke=\"#000\" />\n");
+
+    // Read back and through a display list unchanged.
+    Document source("", layout);
+    source << path;
+    std::string const original = source.toString();
+    LoadResult loaded = loadSvg(original.data(), original.size());
+    ASSERT_TRUE(loaded.ok) << loaded.error;
+    EXPECT_EQ(loaded.skipped, 0u);
+    ASSERT_EQ(loaded.shapes.size(), 1u);
+    EXPECT_EQ(loaded.shapes[0]->toString(layout), path.toString(layout));
+
+    DisplayListWriter writer;
+    writer << path;
+    std::string const bytes = writer.bytes();
+    DisplayList list(bytes.data(), bytes.size());
+    ASSERT_TRUE(list.isValid()) << list.error();
+    EXPECT_EQ(list.toString(layout), path.toString(layout));
+
+    // Clipping flattens the curves.
+    Layout clipped = layout;
+    clipped.clip = true;
+    std::string const flat = path.toString(clipped);
+    EXPECT_EQ(flat.find('C'), std::string::npos);
+    EXPECT_EQ(list.toString(clipped), flat);
+}
+
+// Distance from p to the segment a-b.
+static double segmentDistance(Point const &p, Point const &a, Point const &b)
+{
+    double const dx = b.x - a.x, dy = b.y - a.y;
+    double const length = dx * dx + dy * dy;
+    double t = length > 0 ? ((p.x - a.x) * dx + (p.y - a.y) * dy) / length : 0;
+    t = std::min(1.0, std::max(0.0, t));
+    return std::hypot(a.x + t * dx - p.x, a.y + t * dy - p.y);
+}
+
+TEST(SimpleSvgTest, CurveFitTest)
+{
+    Polyline samples(Stroke(1, Color::Blue));
+    for (int i = 0; i <= 2000; ++i)
+        samples << Point(i * 0.25, 100 + 80 * std::sin(i * 0.005) +
+                                      10 * std::sin(i * 0.031));
+    // A corner and a repeated point.
+    samples << Point(500, 0) << Point(500, 0) << Point(520, 40);
+
+    double const tolerance = 0.25;
+    Path fitted = samples.fitCurves(tolerance);
+    EXPECT_GT(fitted.curveCount(), 1u);
+    EXPECT_LT(fitted.curveCount(), samples.points.size() / 20);
+
+    Layout layout(Dimensions(600, 300), Layout::BottomLeft);
+    std::string const curves = fitted.toString(layout);
+    EXPECT_LT(curves.size() * 10, samples.toString(layout).size());
+
+    // Every sample lies within tolerance of the curve, measured on a much
+    //  finer flattening of it.
+    std::string const svg = curves.substr(curves.find("d=\"") + 3);
+    std::vector<Point> controls;
+    std::vector<Point> line;
+    std::istringstream ss(svg.substr(0, svg.find('"')));
+    std::string token;
+    while (ss >> token)
+    {
+        if (token[0] == 'M' || token[0] == 'C') token = token.substr(1);
+        Point point;
+        char comma;
+        std::istringstream(token) >> point.x >> comma >> point.y;
+        point.y = 300 - point.y;
+        if (line.empty())
+            line.push_back(point);
+        else if (controls.size() < 2)
+            controls.push_back(point);
+        else
+        {
+            detail::flattenCubic(line, line.back(), controls[0], controls[1],
+                                 point, tolerance / 100);
+            controls.clear();
+        }
+    }
+    EXPECT_TRUE(controls.empty());
+    for (auto const &sample : samples.points)
+    {
+        double distance = 1e300;
+        for (std::size_t i = 1; i < line.size(); ++i)
+            distance = std::min(distance,
+                                segmentDistance(sample, line[i - 1], line[i]));
+        // Allows for the six digits written.
+        ASSERT_LE(distance, tolerance + 1e-3)
+            << sample.x << "," << sample.y;
+    }
+
+    EXPECT_EQ(Polyline(Stroke()).fitCurves(1).pointCount(), 0u);
+    Polyline single((Stroke()));
+    single << Point(1, 2) << Point(1, 2);
+    EXPECT_EQ(single.fitCurves(1).pointCount(), 1u);
+}
+
+TEST(SimpleSvgTest, StyleMergerTest)
+{
+    Layout layout(Dimensions(100, 100), Layout::TopLeft);
+    Stroke const thin(1, Color::Black);
+    ShapeColl scene;
+    scene << Line(Point(0, 0), Point(10, 10), thin)
+          << Line(Point(10, 10), Point(20, 0), thin)
+          << Rectangle(Point(30, 30), 5, 5, Fill(Color::Transparent), thin);
+    Polyline open_line(Fill(Color::Transparent), thin);
+    open_line << Point(1, 2) << Point(3, 4) << Point(5, 2);
+    scene << open_line;
+    // Breaks the run; a run of one is left as it is.
+    scene << Circle(Point(50, 50), 10, Fill(Color::Red))
+          << Line(Point(0, 0), Point(1, 1), thin);
+
+    StyleMerger merger;
+    ShapeColl merged = merger.merge(scene);
+    ASSERT_EQ(merged.size(), 3u);
+    EXPECT_EQ(merged[0]->toString(layout),
+              "\t<path d=\"M0,0 10,10 M10,10 20,0 M30,30 35,30 35,35 30,35 z "
+              "M1,2 3,4 5,2 \" fill-rule=\"evenodd\" fill=\"none\" "
+              "stroke-width=\"1\" stroke=\"#000\" />\n");
+    EXPECT_EQ(merged[1]->toString(layout), scene[4]->toString(layout));
+    EXPECT_EQ(merged[2]->toString(layout), scene[5]->toString(layout));
+    EXPECT_EQ(merger.stats().shapes, 6u);
+    EXPECT_EQ(merger.stats().merged, 4u);
+    EXPECT_EQ(merger.stats().paths, 1u);
+    EXPECT_EQ(merger.stats().elements(), 3u);
+
+    // Filled shapes and translucent strokes merge only while they do not
+    //  overlap; the third rectangle touches the first and starts a new run.
+    ShapeColl filled;
+    filled << Rectangle(Point(0, 0), 10, 10, Fill(Color::Blue))
+           << Rectangle(Point(20, 0), 10, 10, Fill(Color::Blue))
+           << Rectangle(Point(10, 5), 5, 5, Fill(Color::Blue))
+           << Rectangle(Point(50, 50), 10, 10, Fill(Color::Blue));
+    Stroke const glass(1, Color(0, 0, 0, 128));
+    filled << Line(Point(0, 0), Point(10, 0), glass)
+           << Line(Point(0, 5), Point(10, 5), glass)
+           << Line(Point(0, 6), Point(10, 6), glass);
+    Polygon star(Fill(Color::Blue));
+    star << Point(0, 0) << Point(10, 0) << Point(0, 10) << Point(10, 10);
+    filled << star << star;
+
+    merger.resetStats();
+    merged = merger.merge(filled);
+    ASSERT_EQ(merged.size(), 6u);
+    EXPECT_EQ(merged[0]->toString(layout),
+              "\t<path d=\"M0,0 10,0 10,10 0,10 z M20,0 30,0 30,10 20,10 z "
+              "\" fill-rule=\"evenodd\" fill=\"#00f\" />\n");
+    EXPECT_EQ(merged[1]->toString(layout),
+              "\t<path d=\"M10,5 15,5 15,10 10,10 z M50,50 60,50 60,60 50,60 "
+              "z \" fill-rule=\"evenodd\" fill=\"#00f\" />\n");
+    // 1 + 2 * 2 apart: the first two lines, then the third alone.
+    EXPECT_EQ(merged[3]->toString(layout), filled[6]->toString(layout));
+    EXPECT_EQ(merged[4]->toString(layout), star.toString(layout));
+    EXPECT_EQ(merger.stats().merged, 6u);
+    EXPECT_EQ(merger.stats().paths, 3u);
+
+    // Nested collections are merged in place.
+    ShapeColl outer;
+    outer << scene << Line(Point(0, 0), Point(3, 3), thin);
+    merged = merger.merge(outer);
+    ASSERT_EQ(merged.size(), 2u);
+    EXPECT_EQ(merged[0]->toString(layout),
+              merger.merge(scene).toString(layout));
+}
+
+TEST(SimpleSvgTest, OverdrawCullerTest)
+{
+    Layout layout(Dimensions(200, 200), Layout::BottomLeft);
+    ShapeColl scene;
+    Polyline under(Stroke(2, Color::Red));
+    under << Point(20, 20) << Point(40, 60);
+    scene << under << Circle(Point(150, 150), 10, Fill(Color::Blue))
+          << Rectangle(Point(10.5, 10.5), 5, 5, Fill(Color::Green));
+    ShapeColl nested;
+    nested << Line(Point(30, 30), Point(50, 50), Stroke(1, Color::Black))
+           << Text(Point(30, 30), "kept");
+    scene << nested
+          << Rectangle(Point(10, 10), 100, 100, Fill(Color::White),
+                       Stroke(1, Color(0, 0, 0, 100)))
+          << Rectangle(Point(0, 0), 200, 5, Fill(Color(0, 0, 0, 200)));
+    // Translucent: covers the bar above without hiding it.
+    scene << Rectangle(Point(0, 0), 100, 3, Fill(Color::Black));
+
+    OverdrawCuller culler;
+    ShapeColl culled = culler.cull(scene, layout);
+    EXPECT_EQ(culler.stats().shapes, 8u);
+    EXPECT_EQ(culler.stats().removed, 2u);
+    EXPECT_EQ(culler.stats().bytes_saved,
+              under.toString(layout).size() +
+                  nested[0]->toString(layout).size());
+    ASSERT_EQ(culled.size(), 6u);
+    EXPECT_EQ(culled[0]->toString(layout), scene[1]->toString(layout));
+    // Too close to the edge of the white panel.
+    EXPECT_EQ(culled[1]->toString(layout), scene[2]->toString(layout));
+    // The nested collection keeps its Text.
+    EXPECT_EQ(culled[2]->toString(layout), nested[1]->toString(layout));
+
+    // A shape inside the interior of a later convex polygon or circle is
+    //  dropped, inside a star or too close to an edge it is kept.
+    Circle dot(Point(100, 100), 4, Fill(Color::Red));
+    Polygon diamond(Fill(Color::Black));
+    diamond << Point(100, 60) << Point(140, 100) << Point(100, 140)
+            << Point(60, 100);
+    Polygon star(Fill(Color::Black));
+    for (int i = 0; i < 5; ++i)
+    {
+        double const angle = i * 4 * std::acos(-1.0) / 5;
+        star << Point(100 + 80 * std::sin(angle), 100 + 80 * std::cos(angle));
+    }
+    ShapeColl layered;
+    layered << dot << diamond;
+    EXPECT_EQ(culler.cull(layered, layout).size(), 1u);
+    layered = ShapeColl();
+    layered << dot << Circle(Point(100, 100), 60, Fill(Color::Black));
+    EXPECT_EQ(culler.cull(layered, layout).size(), 1u);
+    layered = ShapeColl();
+    layered << dot << star;
+    EXPECT_EQ(culler.cull(layered, layout).size(), 2u);
+    layered = ShapeColl();
+    layered << Circle(Point(100, 100), 79, Fill(Color::Red))
+            << Rectangle(Point(60, 60), 80, 80, Fill(Color::Black));
+    EXPECT_EQ(culler.cull(layered, layout).size(), 2u);
+}
+
+TEST(SimpleSvgTest, CoordinateTypeTest)
+{
+    EXPECT_EQ(sizeof(BasicPoint<float>), sizeof(Point) / 2);
+    EXPECT_EQ(sizeof(BasicPoint<std::int16_t>), sizeof(Point) / 4);
+    EXPECT_EQ(BasicPoint<std::int32_t>(Point(2.5, -2.5)).x, 3);
+    EXPECT_EQ(BasicPoint<std::int32_t>(Point(2.5, -2.5)).y, -3);
+
+    // Values every type stores exactly write the same SVG.
+    Layout layout(Dimensions(300, 200), Layout::BottomLeft, 1.5);
+    Layout clipped(Dimensions(40, 30), Layout::TopLeft);
+    clipped.clip = true;
+    Polyline reference(Stroke(1, Color::Blue));
+    BasicPolyline<float> single(Stroke(1, Color::Blue));
+    BasicPolyline<std::int16_t> pixels(Stroke(1, Color::Blue));
+    BasicPolygon<float> polygon(Fill(Color::Red));
+    Polygon reference_polygon(Fill(Color::Red));
+    for (int i = 0; i < 50; ++i)
+    {
+        Point const point(i * 2, (i * 37) % 101 - 20);
+        reference << point;
+        single << point;
+        pixels << point;
+        polygon << point;
+        reference_polygon << point;
+    }
+    for (Layout const &target : {layout, clipped})
+    {
+        EXPECT_EQ(single.toString(target), reference.toString(target));
+        EXPECT_EQ(pixels.toString(target), reference.toString(target));
+        EXPECT_EQ(polygon.toString(target),
+                  reference_polygon.toString(target));
+    }
+
+    // Integer storage rounds offsets and fitted control points.
+    pixels.offset(Point(0.75, -0.25));
+    EXPECT_EQ(pixels.points[1].x, 3);
+    EXPECT_EQ(pixels.points[1].y, 17);
+    BasicPath<float> curves = single.fitCurves(0.5);
+    Path reference_curves = reference.fitCurves(0.5);
+    EXPECT_EQ(curves.curveCount(), reference_curves.curveCount());
+    EXPECT_EQ(BasicPolyline<double>(single).toString(layout),
+              reference.toString(layout));
+
+    BasicLineChart<float> chart(Dimensions(5, 5));
+    chart << single;
+    LineChart reference_chart(Dimensions(5, 5));
+    reference_chart << reference;
+    EXPECT_EQ(chart.toString(layout), reference_chart.toString(layout));
+}
+
+// After warm-up, rendering into a reused buffer does not allocate at all;
+//  toString() and Document only pay for the strings they return or keep.
+TEST(SimpleSvgTest, AllocationBudgetTest)
+{
+    Layout layout(Dimensions(400, 300), Layout::BottomLeft);
+    Polygon polygon(Fill(Color::Red), Stroke(1, Color::Black));
+    Path path(Fill(Color(0, 0, 255, 128)), Stroke(1, Color::Black));
+    Polyline polyline(Fill(), Stroke(1.5, Color(0, 0, 255, 128), true));
+    for (int i = 0; i < 50; ++i)
+    {
+        polygon << Point(i * 4, i % 7 * 3.5);
+        path << Point(i * 4, i % 5 * 2.25);
+        polyline << Point(i * 4.5, i % 3 * 11);
+    }
+    ShapeColl coll;
+    coll << Circle(Point(20, 20), 10, Fill(Color::Lime))
+         << Rectangle(Point(30, 30), 5, 8, Fill(Color::Silver));
+
+    Polyline second(Stroke(1, Color::Red));
+    second << Point(0, 1) << Point(3, 2);
+    LineChart chart(Dimensions(5, 5));
+    chart << polyline << second;
+    StreamingLineChart streaming(16, Dimensions(5, 5));
+    streaming.addSeries(Stroke(1, Color::Blue));
+    streaming.addSeries(Stroke(1, Color::Red), Fill(Color(0, 0, 255, 128)));
+    for (int i = 0; i < 40; ++i)
+        streaming.push(i % 2, Point(i * 2.5, i % 9 * 1.5));
+    std::vector<double> xs, ys;
+    std::vector<Color> colors;
+    for (int i = 0; i < 30; ++i)
+    {
+        xs.push_back(i * 3.5);
+        ys.push_back(i % 4 * 7);
+        colors.push_back(i / 10 ? Color(Color::Red) : Color(0, 128, 0, 200));
+    }
+    MarkerBatch circles(xs, ys, 4, Fill(Color::Blue), Stroke(1, Color::Black));
+    MarkerBatch uses(xs, ys, 4, Fill(Color::Blue), Stroke(1, Color::Black),
+                     MarkerBatch::UseInstances);
+    MarkerBatch colored_uses(uses);
+    colored_uses.setColors(colors);
+    MarkerBatch paths(xs, ys, 4, Fill(), Stroke(), MarkerBatch::SinglePath);
+    paths.setColors(colors);
+
+    std::vector<std::shared_ptr<Shape>> shapes = {
+        std::make_shared<Circle>(Point(10, 20), 8, Fill(Color(255, 0, 0, 100)),
+                                 Stroke(2, Color::Black, true)),
+        std::make_shared<Elipse>(Point(50, 60), 20, 10, Fill(Color::Yellow)),
+        std::make_shared<Rectangle>(Point(5, 5), 40.5, 20,
+                                    Fill(Color::Aqua), Stroke(1, Color::Blue)),
+        std::make_shared<Line>(Point(0, 0), Point(100.25, 50),
+                               Stroke(0.5, Color::Green)),
+        std::make_shared<Polygon>(polygon),
+        std::make_shared<Path>(path),
+        std::make_shared<Polyline>(polyline),
+        std::make_shared<Text>(Point(5, 80), "a < b & c",
+                               Fill(Color::Black), Font(10, "Helvetica")),
+        std::make_shared<ShapeColl>(coll),
+        std::make_shared<LineChart>(chart),
+        std::make_shared<StreamingLineChart>(streaming),
+        std::make_shared<MarkerBatch>(circles),
+        std::make_shared<MarkerBatch>(uses),
+        std::make_shared<MarkerBatch>(colored_uses),
+        std::make_shared<MarkerBatch>(paths)};
+
+    std::string buffer;
+    for (auto const &shape : shapes)
+    {
+        buffer.clear();
+        shape->appendTo(buffer, layout);
+        EXPECT_EQ(shape->toString(layout), buffer) << shape->shapeName();
+
+        std::size_t before = g_allocations.load();
+        for (int i = 0; i < 100; ++i)
+        {
+            buffer.clear();
+            shape->appendTo(buffer, layout);
+        }
+        EXPECT_EQ(0u, g_allocations.load() - before) << shape->shapeName();
+
+        // A few for the growth of the returned string.
+        before = g_allocations.load();
+        std::string const svg = shape->toString(layout);
+        EXPECT_LE(g_allocations.load() - before, 8u) << shape->shapeName();
+    }
+
+    // Heatmap allocates for its merge pass, but writes the same output.
+    std::vector<double> values;
+    for (int i = 0; i < 64; ++i) values.push_back(i % 8 < 4 ? i / 16 : 3);
+    for (Heatmap::Output output : {Heatmap::PathPerColor, Heatmap::Rectangles})
+    {
+        Heatmap heatmap(Point(0, 0), 8, 8, 2, 3, values,
+                        ColorMap({Color(Color::Blue), Color(Color::Red)}, 0, 3,
+                                 4),
+                        output);
+        buffer = "<g>";
+        heatmap.appendTo(buffer, layout);
+        EXPECT_EQ("<g>" + heatmap.toString(layout), buffer);
+    }
+
+    // One allocation per stored node, plus the occasional growth of the
+    //  node list.
+    Document doc("allocation_budget.svg", layout);
+    Circle circle(Point(10, 20), 8, Fill(Color::Red));
+    doc << circle;
+    std::size_t before = g_allocations.load();
+    for (int i = 0; i < 1000; ++i) doc << circle;
+    EXPECT_LE(g_allocations.load() - before, 1000u + 16u);
+}
+
+TEST(SimpleSvgTest, BatchRendererTest)
+{
+    Layout small(Dimensions(120, 30), Layout::BottomLeft);
+    Layout scaled(Dimensions(200, 100), Layout::TopLeft, 2);
+    Polyline spark(Stroke(1, Color::Blue));
+    for (int i = 0; i < 40; ++i) spark << Point(i * 3, 15 + (i * 7) % 11);
+    ShapeColl labelled;
+    labelled << spark << Text(Point(2, 2), "max & min", Fill(Color::Black));
+    Circle dot(Point(10, 10), 4, Fill(Color(255, 0, 0, 128)));
+
+    std::vector<Shape const *> scenes = {&spark, &labelled, &dot};
+    std::vector<std::string> outputs(60);
+    std::vector<RenderJob> jobs;
+    for (std::size_t i = 0; i < outputs.size(); ++i)
+        jobs.emplace_back(*scenes[i % 3], i % 2 ? scaled : small, &outputs[i]);
+    jobs.emplace_back(labelled, scaled, "batch_renderer_test.svg");
+    jobs.emplace_back(dot, small, "no_such_directory/batch_renderer.svg");
+
+    BatchRenderer renderer(3);
+    EXPECT_EQ(3u, renderer.threadCount());
+    for (int round = 0; round < 2; ++round)
+    {
+        BatchStats stats = renderer.render(jobs);
+        EXPECT_EQ(jobs.size(), stats.jobs);
+        EXPECT_EQ(1u, stats.failed);
+        EXPECT_LE(stats.p50_nanoseconds, stats.p99_nanoseconds);
+        EXPECT_LE(stats.p99_nanoseconds, stats.max_nanoseconds);
+        EXPECT_GT(stats.jobsPerSecond(), 0);
+
+        std::uint64_t bytes = 0;
+        for (std::size_t i = 0; i < outputs.size(); ++i)
+        {
+            Document doc("unused.svg", jobs[i].layout);
+            doc << *jobs[i].scene;
+            EXPECT_EQ(doc.toString(), outputs[i]) << i;
+            bytes += outputs[i].size();
+        }
+
+        Document doc("unused.svg", scaled);
+        doc << labelled;
+        std::ifstream ifs("batch_renderer_test.svg");
+        std::stringstream written;
+        written << ifs.rdbuf();
+        EXPECT_EQ(doc.toString(), written.str());
+        EXPECT_EQ(bytes + written.str().size(), stats.bytes);
+    }
+    std::remove("batch_renderer_test.svg");
+
+    EXPECT_EQ(0u, renderer.render(std::vector<RenderJob>()).jobs);
+}
+
+TEST(SimpleSvgTest, TransformDelegationTest)
+{
+    // The group transform maps points as translateX() and translateY() do.
+    Layout::Origin const origins[] = {Layout::TopLeft, Layout::BottomLeft,
+                                      Layout::TopRight, Layout::BottomRight};
+    for (Layout::Origin origin : origins)
+    {
+        Layout layout(Dimensions(300, 200), origin, 2.5, Point(5, -10));
+        LayoutTransform m = layoutTransform(layout);
+        for (double v : {-7.0, 0.0, 3.25, 120.0})
+        {
+            EXPECT_DOUBLE_EQ(translateX(v, layout), m.a * v + m.e);
+            EXPECT_DOUBLE_EQ(translateY(v, layout), m.d * v + m.f);
+        }
+    }
+
+    Layout layout(Dimensions(300, 300), Layout::BottomLeft, 2, Point(5, 10));
+    Document doc("transform_delegation_test.svg", layout, true);
+    Polyline line(Stroke(1.5, Color::Blue));
+    line << Point(1, 2) << Point(3, 4);
+    doc << line;
+    doc << Polyline(Stroke(1, Color::Red, true)) << Circle(Point(8, 9), 4);
+    doc << Rectangle(Point(3, 4), 5, 6, Fill(Color::Black));
+    doc << Text(Point(3, 4), "label", Fill(Color::Black));
+
+    std::string const svg = doc.toString();
+    std::string const group = "<g transform=\"matrix(2 0 0 -2 10 280)\">\n";
+    EXPECT_EQ(documentProlog(layout) + group, doc.prolog());
+    EXPECT_EQ(0u, svg.find(doc.prolog()));
+    EXPECT_EQ(svg.size() - 12, svg.rfind("</g>\n</svg>\n"));
+
+    // Raw user coordinates; scaling strokes are scaled by the group,
+    //  non-scaling ones keep their width in pixels.
+    EXPECT_NE(std::string::npos,
+              svg.find("<polyline points=\"1,2 3,4 \" fill=\"none\" "
+                       "stroke-width=\"1.5\" "));
+    EXPECT_NE(std::string::npos,
+              svg.find("stroke-width=\"2\" stroke=\"#f00\" "
+                       "vector-effect=\"non-scaling-stroke\" "));
+    EXPECT_NE(std::string::npos,
+              svg.find("<circle cx=\"8\" cy=\"9\" r=\"2\" "));
+    // The group flips y, so the rectangle needs no origin adjustment.
+    EXPECT_NE(std::string::npos,
+              svg.find("<rect x=\"3\" y=\"4\" width=\"5\" height=\"6\" "));
+    // Text is flipped back upright; (3, -4) ends up where it is without
+    //  delegation, at (16, 272), and the font is scaled by the group.
+    EXPECT_NE(std::string::npos,
+              svg.find("<text x=\"3\" y=\"-4\" transform=\"scale(1,-1)\" "
+                       "fill=\"#000\" font-size=\"12\" "));
+    Document plain("", layout);
+    plain << Text(Point(3, 4), "label", Fill(Color::Black));
+    EXPECT_NE(std::string::npos,
+              plain.toString().find("<text x=\"16\" y=\"272\" "));
+
+    // Without a flip there is no extra transform.
+    Layout top_left(Dimensions(100, 100), Layout::TopLeft, 2);
+    Document upright("", top_left, true);
+    upright << Text(Point(3, 4), "label");
+    std::string const upright_svg = upright.toString();
+    EXPECT_EQ(std::string::npos, upright_svg.find("scale("));
+    Document upright_plain("", top_left);
+    upright_plain << Text(Point(3, 4), "label");
+    // 2 * 4 + 12 without delegation, (20 - 0) / 2 with it.
+    EXPECT_NE(std::string::npos, upright_plain.toString().find("y=\"20\""));
+    EXPECT_NE(std::string::npos, upright_svg.find("y=\"10\""));
+
+    // The delegated layout keeps what it needs of the outer one by value.
+    Layout const detached = delegatedLayout(
+        Layout(Dimensions(100, 100), Layout::BottomLeft, 3));
+    EXPECT_EQ("stroke-width=\"6\" stroke=\"#f00\" "
+              "vector-effect=\"non-scaling-stroke\" ",
+              Stroke(2, Color::Red, true).toString(detached));
+
+    // Clipping is against the viewport in user units, here x in [-5, 45]
+    //  and y in [-10, 40], plus the stroke margin of 2 + 1 / 2.
+    Layout clipped(Dimensions(100, 100), Layout::BottomLeft, 2, Point(5, 10));
+    clipped.clip = true;
+    Document clipped_doc("", clipped, true);
+    Polyline tall(Stroke(1, Color::Blue));
+    tall << Point(0, 0) << Point(0, 100);
+    clipped_doc << Circle(Point(10, 10), 2) << Circle(Point(100, 10), 2)
+                << Circle(Point(10, -40), 2) << tall;
+    std::string const clipped_svg = clipped_doc.toString();
+    EXPECT_NE(std::string::npos, clipped_svg.find("cx=\"10\" cy=\"10\""));
+    EXPECT_EQ(std::string::npos, clipped_svg.find("cx=\"100\""));
+    EXPECT_EQ(std::string::npos, clipped_svg.find("cy=\"-40\""));
+    EXPECT_NE(std::string::npos, clipped_svg.find("points=\"0,0 0,42.5 \""));
+
+    // Readers and saving see the same document.
+    DocumentReader reader(doc);
+    std::string read;
+    char buffer[100];
+    while (std::size_t count = reader.nextChunk(buffer, sizeof(buffer)))
+        read.append(buffer, count);
+    EXPECT_EQ(svg, read);
+
+    ASSERT_TRUE(doc.save());
+    std::ifstream saved("transform_delegation_test.svg");
+    std::stringstream saved_svg;
+    saved_svg << saved.rdbuf();
+    EXPECT_EQ(svg, saved_svg.str());
+    std::remove("transform_delegation_test.svg");
+
+    // In append mode every batch is a group of its own.
+    char const *file_name = "transform_delegation_append.svg";
+    std::remove(file_name);
+    Document appended(file_name, layout, true);
+    appended << Circle(Point(1, 1), 2);
+    ASSERT_TRUE(appended.beginAppend(2));
+    appended << Circle(Point(2, 2), 2) << Circle(Point(3, 3), 2);
+    ASSERT_TRUE(appended.endAppend());
+    std::ifstream ifs(file_name);
+    std::stringstream appended_svg;
+    appended_svg << ifs.rdbuf();
+    Layout const shape_layout = delegatedLayout(layout);
+    EXPECT_EQ(documentProlog(layout) + group +
+                  Circle(Point(1, 1), 2).toString(shape_layout) + "</g>\n" +
+                  group + Circle(Point(2, 2), 2).toString(shape_layout) +
+                  Circle(Point(3, 3), 2).toString(shape_layout) +
+                  "</g>\n</svg>\n",
+              appended_svg.str());
+    std::remove(file_name);
+
+    Group group_shape("rotate(45)");
+    group_shape << Circle(Point(1, 1), 2) << Line(Point(0, 0), Point(1, 1));
+    EXPECT_EQ(2u, group_shape.size());
+    EXPECT_EQ("\t<g transform=\"rotate(45)\">\n" +
+                  Circle(Point(1, 1), 2).toString(top_left) +
+                  Line(Point(0, 0), Point(1, 1)).toString(top_left) +
+                  "\t</g>\n",
+              group_shape.toString(top_left));
+    EXPECT_EQ("\t<g>\n\t</g>\n", Group().toString(top_left));
+}
+
+#ifdef SVGPLOT_PATH
+// Runs the svgplot tool built with the tests and loads its output.
+static LoadResult runSvgplot(std::string const &arguments)
+{
+    std::string const command =
+        std::string(SVGPLOT_PATH) + " " + arguments + " svgplot_test.svg";
+    EXPECT_EQ(0, std::system(command.c_str())) << command;
+    LoadResult result = loadSvgFile("svgplot_test.svg");
+    std::remove("svgplot_test.svg");
+    return result;
+}
+
+// Polylines of shapes that leave the 200x100 canvas.
+static std::size_t polylinesOffCanvas(ShapeColl const &shapes)
+{
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < shapes.size(); ++i)
+        if (auto const *line = dynamic_cast<Polyline const *>(shapes[i].get()))
+            for (auto const &point : line->points)
+                if (point.x < 0 || point.x > 200 || point.y < 0 ||
+                    point.y > 100)
+                {
+                    ++count;
+                    break;
+                }
+    return count;
+}
+
+TEST(SimpleSvgTest, SvgplotTest)
+{
+    {
+        std::ofstream csv("svgplot_test.csv");
+        csv << "x,a,b\n";
+        for (int i = 0; i <= 100; ++i)
+            csv << i << ',' << i % 10 << ',' << 9 - i << '\n';
+        csv << "1,2\n" << "1,2,3,4\n";  // skipped
+        std::ofstream f64("svgplot_test.f64", std::ios::binary);
+        for (int i = 0; i <= 1000; ++i)
+        {
+            double const row[] = {i * 0.5, std::sin(i / 10.0)};
+            f64.write(reinterpret_cast<char const *>(row), sizeof(row));
+        }
+    }
+
+    // Every point of both series, in order, inside the plot margin of 10.
+    LoadResult all =
+        runSvgplot("--width=200 --height=100 --threads=3 svgplot_test.csv");
+    ASSERT_TRUE(all.ok) << all.error;
+    ASSERT_EQ(2u, all.shapes.size());
+    auto const *a = dynamic_cast<Polyline const *>(all.shapes[0].get());
+    auto const *b = dynamic_cast<Polyline const *>(all.shapes[1].get());
+    ASSERT_TRUE(a && b);
+    ASSERT_EQ(101u, a->points.size());
+    ASSERT_EQ(101u, b->points.size());
+    // b runs from the top left corner to the bottom right one.
+    EXPECT_EQ(10, b->points.front().x);
+    EXPECT_EQ(10, b->points.front().y);
+    EXPECT_EQ(190, b->points.back().x);
+    EXPECT_EQ(90, b->points.back().y);
+    EXPECT_EQ(0u, polylinesOffCanvas(all.shapes));
+    EXPECT_NE(std::string::npos,
+              all.shapes[1]->toString(all.layout).find("stroke=\"#f00\""));
+
+    // The chart axis fits as well.
+    LoadResult chart = runSvgplot(
+        "--format=f64 --columns=2 --width=200 --height=100 --decimate "
+        "--chart svgplot_test.f64");
+    ASSERT_TRUE(chart.ok) << chart.error;
+    EXPECT_GT(chart.shapes.size(), 2u);
+    EXPECT_EQ(0u, polylinesOffCanvas(chart.shapes));
+
+    std::remove("svgplot_test.csv");
+    std::remove("svgplot_test.f64");
+}
+#endif
+
 // Run the tests
 // -----------------------------------------------------------------------------------
 int main(int argc, char **argv)
@@ -0,0 +1,704 @@
+// svgplot: plots the columns of a large CSV or raw float64 file as SVG.
+//
+// usage: svgplot [options] <input> <output.svg>
+//
+//   --format=csv|f64  input format; default csv for *.csv, f64 otherwise
+//   --columns=<n>     values per row of f64 input, default 2
+//   --x=<column>      column holding x, or -1 to plot against the row number;
+//                     default 0 with two or more columns, else -1
+//   --width=<px>      size of the image, default 800x400
+//   --height=<px>
+//   --decimate        keep the first, last, lowest and highest point of each
+//                     series per pixel column
+//   --chart           draw the decimated series as a LineChart, with axis
+//                     and vertex markers
+//   --threads=<n>     parser threads, default one per hardware thread
+//
+// The input is memory mapped and parsed in chunks of a few megabytes, a
+// window of them at a time with one thread per chunk, so files larger than
+// memory are fine.  A first pass finds the bounds of the data; the second
+// either decimates it or writes every point to the output through an
+// AsyncFileWriter: the first series straight away, the others from
+// temporary files once it is complete.  Throughput of both passes is
+// reported on stderr.
+//
+// CSV rows are numbers separated by commas, semicolons, tabs or spaces.
+// Lines that do not start with a number, such as a header, and rows with
+// another number of values than the first one are skipped.  f64 input is
+// rows of native-endian doubles.  Non-finite values are skipped.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../simple_svg_1.0.0.hpp"
+
+using namespace svg;
+
+namespace
+{
+std::size_t const chunk_bytes = 4 << 20;
+std::size_t const max_columns = 64;
+double const plot_margin = 10;
+
+struct Options
+{
+    Options()
+        : csv(false),
+          columns(2),
+          x_column(-2),
+          width(800),
+          height(400),
+          decimate(false),
+          chart(false),
+          threads(std::thread::hardware_concurrency())
+    {
+    }
+
+    std::string input;
+    std::string output;
+    bool csv;
+    std::size_t columns;
+    // -1 plots against the row number, -2 picks the default.
+    int x_column;
+    double width;
+    double height;
+    bool decimate;
+    bool chart;
+    std::size_t threads;
+};
+
+// The mapped input split into chunks that end on row boundaries.
+class Input
+{
+   public:
+    Input(MappedFile const &file, bool csv, std::size_t columns)
+        : data(file.data()), size(file.size()), csv(csv), columns(columns)
+    {
+        if (csv) this->columns = firstRowColumns();
+
+        std::size_t row_bytes = csv ? 1 : columns * sizeof(double);
+        if (!csv) size -= size % row_bytes;
+        starts.push_back(0);
+        while (starts.back() < size)
+        {
+            std::size_t next = starts.back() + chunk_bytes;
+            if (next >= size)
+                next = size;
+            else if (csv)
+            {
+                char const *newline = static_cast<char const *>(
+                    std::memchr(data + next, '\n', size - next));
+                next = newline ? newline - data + 1 : size;
+            }
+            else
+                next -= next % row_bytes;
+            starts.push_back(next);
+        }
+    }
+
+    std::size_t columnCount() const { return columns; }
+    std::size_t chunkCount() const { return starts.size() - 1; }
+    std::size_t bytes() const { return size; }
+
+    // Calls visit(values) for every complete row of chunk, in order.
+    template <typename Visit>
+    void forEachRow(std::size_t chunk, Visit visit) const
+    {
+        char const *p = data + starts[chunk];
+        char const *const end = data + starts[chunk + 1];
+        double values[max_columns];
+        if (!csv)
+        {
+            for (; p < end; p += columns * sizeof(double))
+            {
+                std::memcpy(values, p, columns * sizeof(double));
+                visit(values);
+            }
+            return;
+        }
+        while (p < end)
+        {
+            char const *line_end =
+                static_cast<char const *>(std::memchr(p, '\n', end - p));
+            if (!line_end) line_end = end;
+            if (parseRow(p, line_end, values) == columns) visit(values);
+            p = line_end + 1;
+        }
+    }
+
+   private:
+    char const *data;
+    std::size_t size;
+    bool csv;
+    std::size_t columns;
+    std::vector<std::size_t> starts;
+
+    std::size_t parseRow(char const *p, char const *end, double *values) const
+    {
+        std::size_t count = 0;
+        while (count < max_columns)
+        {
+            while (p < end && (*p == ',' || *p == ';' || *p == '\t' ||
+                               *p == ' ' || *p == '\r'))
+                ++p;
+            if (p == end || !detail::parseNumber(p, end, values[count]))
+                break;
+            ++count;
+        }
+        return count;
+    }
+    std::size_t firstRowColumns() const
+    {
+        double values[max_columns];
+        for (char const *p = data, *end = data + size; p < end;)
+        {
+            char const *line_end =
+                static_cast<char const *>(std::memchr(p, '\n', end - p));
+            if (!line_end) line_end = end;
+            if (std::size_t count = parseRow(p, line_end, values))
+                return count;
+            p = line_end + 1;
+        }
+        return 0;
+    }
+};
+
+// Runs work(chunk, slot) on up to threads chunks at once, then
+//  merge(chunk, slot) for each of them in chunk order.  slot tells apart
+//  the chunks of one window, for per-thread buffers.
+template <typename Work, typename Merge>
+void runWindows(std::size_t chunks, std::size_t threads, Work work,
+                Merge merge)
+{
+    for (std::size_t first = 0; first < chunks; first += threads)
+    {
+        std::size_t const count = std::min(threads, chunks - first);
+        std::vector<std::thread> workers;
+        for (std::size_t slot = 1; slot < count; ++slot)
+            workers.emplace_back([&, slot] { work(first + slot, slot); });
+        work(first, 0);
+        for (auto &worker : workers) worker.join();
+        for (std::size_t slot = 0; slot < count; ++slot)
+            merge(first + slot, slot);
+    }
+}
+
+struct Bounds
+{
+    Bounds()
+        : rows(0),
+          x_min(std::numeric_limits<double>::infinity()),
+          x_max(-x_min),
+          y_min(x_min),
+          y_max(-x_min)
+    {
+    }
+    void add(Bounds const &other)
+    {
+        rows += other.rows;
+        x_min = std::min(x_min, other.x_min);
+        x_max = std::max(x_max, other.x_max);
+        y_min = std::min(y_min, other.y_min);
+        y_max = std::max(y_max, other.y_max);
+    }
+
+    std::size_t rows;
+    double x_min, x_max, y_min, y_max;
+};
+
+// The first, last, lowest and highest point of a series in one pixel column.
+struct Bin
+{
+    Bin() : used(false) {}
+    void add(Point const &point)
+    {
+        if (!used)
+        {
+            first = last = low = high = point;
+            used = true;
+            return;
+        }
+        last = point;
+        if (point.y < low.y) low = point;
+        if (point.y > high.y) high = point;
+    }
+    void add(Bin const &later)
+    {
+        if (!later.used) return;
+        if (!used)
+        {
+            *this = later;
+            return;
+        }
+        last = later.last;
+        if (later.low.y < low.y) low = later.low;
+        if (later.high.y > high.y) high = later.high;
+    }
+
+    bool used;
+    Point first, last, low, high;
+};
+
+Color seriesColor(std::size_t series)
+{
+    static Color::Defaults const palette[] = {
+        Color::Blue,   Color::Red,     Color::Green, Color::Orange,
+        Color::Purple, Color::Magenta, Color::Brown, Color::Black};
+    return Color(palette[series % (sizeof(palette) / sizeof(palette[0]))]);
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return detail::elapsedNanoseconds(start) / 1e9;
+}
+
+// The output file, counting what is written.
+struct Sink
+{
+    explicit Sink(std::string const &file_name)
+        : writer(file_name, 1 << 20, 4), bytes(0)
+    {
+    }
+    void write(char const *data, std::size_t size)
+    {
+        writer.write(data, size);
+        bytes += size;
+    }
+    void write(std::string const &text) { write(text.data(), text.size()); }
+    // Keeps the first error of what produces the output.
+    void fail(std::string const &message)
+    {
+        if (error.empty()) error = message;
+    }
+    bool finish()
+    {
+        if (!writer.finish()) fail(writer.error());
+        return error.empty();
+    }
+
+    AsyncFileWriter writer;
+    std::size_t bytes;
+    std::string error;
+};
+
+// Output that has to wait until what comes before it is written.
+class SpillFile
+{
+   public:
+    SpillFile() : file(std::tmpfile()) {}
+    ~SpillFile()
+    {
+        if (file) std::fclose(file);
+    }
+    SpillFile(SpillFile const &) = delete;
+    SpillFile &operator=(SpillFile const &) = delete;
+
+    bool write(std::string const &text)
+    {
+        return file && std::fwrite(text.data(), 1, text.size(), file) ==
+                           text.size();
+    }
+    // Copies everything written so far to sink.
+    bool copyTo(Sink &sink)
+    {
+        if (!file || std::fseek(file, 0, SEEK_SET) != 0) return false;
+        std::vector<char> block(1 << 20);
+        while (std::size_t count =
+                   std::fread(block.data(), 1, block.size(), file))
+            sink.write(block.data(), count);
+        return !std::ferror(file);
+    }
+
+   private:
+    std::FILE *file;
+};
+
+class Plotter
+{
+   public:
+    Plotter(Options const &options, Input const &input)
+        : options(options),
+          input(input),
+          layout(Dimensions(options.width, options.height)),
+          x_column(options.x_column)
+    {
+        if (x_column == -2) x_column = input.columnCount() > 1 ? 0 : -1;
+        for (std::size_t i = 0; i < input.columnCount(); ++i)
+            if (static_cast<int>(i) != x_column) series.push_back(i);
+    }
+
+    std::size_t seriesCount() const { return series.size(); }
+    std::size_t rowCount() const { return bounds.rows; }
+
+    // First pass: row counts per chunk and the bounds of all series.
+    void scan()
+    {
+        std::size_t const chunks = input.chunkCount();
+        std::vector<Bounds> slots(options.threads);
+        first_rows.assign(chunks + 1, 0);
+        runWindows(
+            chunks, options.threads,
+            [&](std::size_t chunk, std::size_t slot)
+            { slots[slot] = scanChunk(chunk); },
+            [&](std::size_t chunk, std::size_t slot)
+            {
+                first_rows[chunk + 1] = first_rows[chunk] + slots[slot].rows;
+                bounds.add(slots[slot]);
+            });
+        if (x_column < 0)
+        {
+            bounds.x_min = 0;
+            bounds.x_max = bounds.rows ? bounds.rows - 1.0 : 0;
+        }
+
+        // LineChart draws its axis 10% past the data, which has to fit too.
+        double const room = options.chart ? 1.1 : 1;
+        double const plot_width = (options.width - 2 * plot_margin) / room;
+        double const plot_height = (options.height - 2 * plot_margin) / room;
+        x_scale = bounds.x_max > bounds.x_min
+                      ? plot_width / (bounds.x_max - bounds.x_min)
+                      : 0;
+        y_scale = bounds.y_max > bounds.y_min
+                      ? plot_height / (bounds.y_max - bounds.y_min)
+                      : 0;
+        bin_count = static_cast<std::size_t>(std::max(1.0, plot_width));
+    }
+
+    // Second pass, writing every point in one read of the input.  Series
+    //  after the first are spilled to temporary files and copied once the
+    //  first is complete.  Returns the number of points written.
+    std::size_t writeAll(Sink &sink) const
+    {
+        std::vector<std::unique_ptr<SpillFile>> spills;
+        for (std::size_t s = 1; s < series.size(); ++s)
+            spills.push_back(std::unique_ptr<SpillFile>(new SpillFile()));
+        std::vector<std::vector<std::string>> buffers(
+            options.threads, std::vector<std::string>(series.size()));
+        std::vector<std::size_t> counts(options.threads);
+        std::size_t points = 0;
+        bool spilled = true;
+
+        sink.write("\t<polyline points=\"");
+        runWindows(
+            input.chunkCount(), options.threads,
+            [&](std::size_t chunk, std::size_t slot)
+            { counts[slot] = formatChunk(chunk, buffers[slot]); },
+            [&](std::size_t, std::size_t slot)
+            {
+                sink.write(buffers[slot][0]);
+                for (std::size_t s = 1; s < series.size(); ++s)
+                    spilled = spills[s - 1]->write(buffers[slot][s]) && spilled;
+                points += counts[slot];
+            });
+        sink.write(polylineTail(0));
+
+        for (std::size_t s = 1; s < series.size(); ++s)
+        {
+            sink.write("\t<polyline points=\"");
+            spilled = spills[s - 1]->copyTo(sink) && spilled;
+            sink.write(polylineTail(s));
+        }
+        if (!spilled) sink.fail("cannot write a temporary file");
+        return points;
+    }
+
+    // Second pass, keeping a few points per pixel column.  Returns the
+    //  number of points written.
+    std::size_t writeDecimated(Sink &sink) const
+    {
+        std::vector<std::vector<Bin>> merged(
+            series.size(), std::vector<Bin>(bin_count));
+        std::vector<std::vector<std::vector<Bin>>> slots(
+            options.threads, merged);
+        runWindows(
+            input.chunkCount(), options.threads,
+            [&](std::size_t chunk, std::size_t slot)
+            { binChunk(chunk, slots[slot]); },
+            [&](std::size_t, std::size_t slot)
+            {
+                for (std::size_t s = 0; s < series.size(); ++s)
+                    for (std::size_t b = 0; b < bin_count; ++b)
+                        merged[s][b].add(slots[slot][s][b]);
+            });
+
+        std::size_t points = 0;
+        LineChart chart(Dimensions(plot_margin, plot_margin));
+        ShapeColl lines;
+        for (std::size_t s = 0; s < series.size(); ++s)
+        {
+            Polyline line(Fill(), Stroke(1, seriesColor(s)));
+            for (Bin const &bin : merged[s])
+            {
+                if (!bin.used) continue;
+                Point corners[] = {bin.first, bin.low, bin.high, bin.last};
+                std::stable_sort(corners, corners + 4,
+                                 [](Point const &a, Point const &b)
+                                 { return a.x < b.x; });
+                for (Point const &corner : corners)
+                    if (line.points.empty() ||
+                        corner.x != line.points.back().x ||
+                        corner.y != line.points.back().y)
+                        line << corner;
+            }
+            points += line.points.size();
+            if (options.chart)
+            {
+                // LineChart adds the margin itself.
+                line.offset(Point(-plot_margin, -plot_margin));
+                chart << line;
+            }
+            else
+                lines << line;
+        }
+
+        std::string svg;
+        if (options.chart)
+            chart.appendTo(svg, layout);
+        else
+            lines.appendTo(svg, layout);
+        sink.write(svg);
+        return points;
+    }
+
+    Layout const &plotLayout() const { return layout; }
+
+   private:
+    Options const &options;
+    Input const &input;
+    Layout layout;
+    int x_column;
+    std::vector<std::size_t> series;
+    std::vector<std::size_t> first_rows;
+    Bounds bounds;
+    double x_scale;
+    double y_scale;
+    std::size_t bin_count;
+
+    Bounds scanChunk(std::size_t chunk) const
+    {
+        Bounds local;
+        input.forEachRow(chunk,
+                         [&](double const *values)
+                         {
+                             ++local.rows;
+                             if (x_column >= 0 &&
+                                 std::isfinite(values[x_column]))
+                             {
+                                 double x = values[x_column];
+                                 local.x_min = std::min(local.x_min, x);
+                                 local.x_max = std::max(local.x_max, x);
+                             }
+                             for (std::size_t column : series)
+                             {
+                                 double y = values[column];
+                                 if (!std::isfinite(y)) continue;
+                                 local.y_min = std::min(local.y_min, y);
+                                 local.y_max = std::max(local.y_max, y);
+                             }
+                         });
+        return local;
+    }
+    // Replaces out[s] with the points of series s in chunk as Polyline
+    //  writes them.
+    std::size_t formatChunk(std::size_t chunk,
+                            std::vector<std::string> &out) const
+    {
+        for (auto &text : out) text.clear();
+        std::size_t count = 0;
+        std::size_t row = first_rows[chunk];
+        input.forEachRow(chunk,
+                         [&](double const *values)
+                         {
+                             for (std::size_t s = 0; s < series.size(); ++s)
+                             {
+                                 Point point;
+                                 if (!toPlot(values, series[s], row, point))
+                                     continue;
+                                 std::string &text = out[s];
+                                 appendNumber(text,
+                                              translateX(point.x, layout));
+                                 text += ',';
+                                 appendNumber(text,
+                                              translateY(point.y, layout));
+                                 text += ' ';
+                                 ++count;
+                             }
+                             ++row;
+                         });
+        return count;
+    }
+    // The part of what Polyline writes after the points of series s.
+    std::string polylineTail(std::size_t s) const
+    {
+        std::string tail = "\" ";
+        Fill().appendTo(tail, layout);
+        Stroke(1, seriesColor(s)).appendTo(tail, layout);
+        tail += "/>\n";
+        return tail;
+    }
+    void binChunk(std::size_t chunk, std::vector<std::vector<Bin>> &bins) const
+    {
+        for (auto &series_bins : bins)
+            std::fill(series_bins.begin(), series_bins.end(), Bin());
+        std::size_t row = first_rows[chunk];
+        input.forEachRow(chunk,
+                         [&](double const *values)
+                         {
+                             for (std::size_t s = 0; s < series.size(); ++s)
+                             {
+                                 Point point;
+                                 if (toPlot(values, series[s], row, point))
+                                     bins[s][binOf(point)].add(point);
+                             }
+                             ++row;
+                         });
+    }
+
+    // The point of column in plot coordinates; false if it is not finite.
+    bool toPlot(double const *values, std::size_t column, std::size_t row,
+                Point &point) const
+    {
+        double x = x_column < 0 ? static_cast<double>(row) : values[x_column];
+        double y = values[column];
+        if (!std::isfinite(x) || !std::isfinite(y)) return false;
+
+        point.x = plot_margin + (x - bounds.x_min) * x_scale;
+        point.y = plot_margin + (y - bounds.y_min) * y_scale;
+        return true;
+    }
+    std::size_t binOf(Point const &point) const
+    {
+        double column = std::floor(point.x - plot_margin);
+        if (column < 0) return 0;
+        return std::min(bin_count - 1, static_cast<std::size_t>(column));
+    }
+};
+
+bool takeFlag(std::string const &arg, char const *flag, std::string &value)
+{
+    std::string prefix = std::string("--") + flag + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+int usage()
+{
+    std::cerr << "usage: svgplot [--format=csv|f64] [--columns=<n>] "
+                 "[--x=<column>]\n"
+                 "               [--width=<px>] [--height=<px>] [--decimate] "
+                 "[--chart]\n"
+                 "               [--threads=<n>] <input> <output.svg>\n";
+    return 2;
+}
+
+bool parseOptions(int argc, char **argv, Options &options)
+{
+    std::string format;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        std::string value;
+        if (takeFlag(arg, "format", format))
+            continue;
+        else if (takeFlag(arg, "columns", value))
+            options.columns = std::strtoul(value.c_str(), nullptr, 10);
+        else if (takeFlag(arg, "x", value))
+            options.x_column = std::atoi(value.c_str());
+        else if (takeFlag(arg, "width", value))
+            options.width = std::atof(value.c_str());
+        else if (takeFlag(arg, "height", value))
+            options.height = std::atof(value.c_str());
+        else if (takeFlag(arg, "threads", value))
+            options.threads = std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--decimate")
+            options.decimate = true;
+        else if (arg == "--chart")
+            options.chart = true;
+        else if (arg.compare(0, 2, "--") == 0)
+            return false;
+        else
+            files.push_back(arg);
+    }
+    if (files.size() != 2) return false;
+
+    options.input = files[0];
+    options.output = files[1];
+    std::size_t const length = options.input.size();
+    bool const csv_name =
+        length >= 4 && options.input.compare(length - 4, 4, ".csv") == 0;
+    options.csv = format.empty() ? csv_name : format == "csv";
+    if (options.threads == 0) options.threads = 1;
+    return (format.empty() || format == "csv" || format == "f64") &&
+           options.columns > 0 && options.columns <= max_columns &&
+           options.x_column >= -2 && options.width > 2 * plot_margin &&
+           options.height > 2 * plot_margin &&
+           (options.decimate || !options.chart);
+}
+}  // namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) return usage();
+
+    MappedFile file(options.input);
+    if (!file.isOpen())
+    {
+        std::cerr << options.input << ": " << file.error() << std::endl;
+        return 1;
+    }
+    Input input(file, options.csv, options.columns);
+    if (options.x_column >= static_cast<int>(input.columnCount()))
+    {
+        std::cerr << "--x=" << options.x_column << ": the input has "
+                  << input.columnCount() << " columns" << std::endl;
+        return 1;
+    }
+
+    Plotter plotter(options, input);
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    plotter.scan();
+    double const ingest_seconds = secondsSince(start);
+    if (plotter.rowCount() == 0 || plotter.seriesCount() == 0)
+    {
+        std::cerr << options.input << ": no data to plot" << std::endl;
+        return 1;
+    }
+
+    start = std::chrono::steady_clock::now();
+    Sink sink(options.output);
+    sink.write(documentProlog(plotter.plotLayout()));
+    std::size_t const points = options.decimate ? plotter.writeDecimated(sink)
+                                                : plotter.writeAll(sink);
+    sink.write("</svg>\n");
+    if (!sink.finish())
+    {
+        std::cerr << options.output << ": " << sink.error << std::endl;
+        return 1;
+    }
+    double const serialize_seconds = secondsSince(start);
+
+    double const read_mb = input.bytes() / 1e6;
+    double const written_mb = sink.bytes / 1e6;
+    std::fprintf(stderr,
+                 "%zu rows, %zu series, %zu points plotted\n"
+                 "ingest:    %.1f MB read in %.3f s, %.1f MB/s\n"
+                 "serialize: %.1f MB written in %.3f s, %.1f MB/s\n",
+                 plotter.rowCount(), plotter.seriesCount(), points, read_mb,
+                 ingest_seconds, read_mb / ingest_seconds, written_mb,
+                 serialize_seconds, written_mb / serialize_seconds);
+    return 0;
+}